@@ -0,0 +1,102 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Micro-benchmark for lazy flag evaluation.
+//
+// Runs a loop where almost every instruction sets the flags but only the
+// loop branch and one predicated add read them.  The eager run evaluates
+// NZCV after every instruction, which is what the emulator did before the
+// flags were made lazy.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <time.h>
+#include "block.h"
+#include "cpu.h"
+#include "flags.h"
+#include "machine.h"
+#include "memory.h"
+
+enum {
+	START_ADDR = 0x8000,
+	NUM_INSTRUCTIONS = 20 * 1000 * 1000
+};
+
+static const uint32_t program[] = {
+	0xe3a00601,		//         mov   r0, #0x100000
+	0xe3a01000,		//         mov   r1, #0
+	0xe3a02000,		//         mov   r2, #0
+	0xe2911003,		// loop:   adds  r1, r1, #3
+	0xe1b04001,		//         movs  r4, r1
+	0xe2522001,		//         subs  r2, r2, #1
+	0xe1510002,		//         cmp   r1, r2
+	0x02833001,		//         addeq r3, r3, #1
+	0xe2500001,		//         subs  r0, r0, #1
+	0x1afffff8,		//         bne   loop
+	0xeafffffe		//         b     .
+};
+
+static void reset(machine_t *m) {
+	for (size_t i = 0; i < sizeof(program) / sizeof(program[0]); i++)
+		write_word(m, START_ADDR + i * 4, program[i]);
+
+	set_program_counter(m, START_ADDR + 8);
+}
+
+static double seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double run_step(machine_t *m, int eager) {
+	uint32_t nzcv = 0;
+	reset(m);
+	double start = seconds();
+
+	for (int i = 0; i < NUM_INSTRUCTIONS; i++) {
+		step(m);
+
+		if (eager)
+			nzcv ^= evaluate_flags(&m->flags);
+	}
+
+	double elapsed = seconds() - start;
+
+	if (nzcv == 0xffffffff)			// Keep the evaluation from being optimised away
+		printf("\n");
+
+	return elapsed;
+}
+
+static double run_engine(machine_t *m, execution_engine_t engine) {
+	reset(m);
+	m->execution_engine = engine;
+	double start = seconds();
+	execute(m, NUM_INSTRUCTIONS);
+	return seconds() - start;
+}
+
+static void report(char *name, double elapsed) {
+	printf("%-24s %8.2f ns/instruction %8.1f MIPS\n", name, elapsed * 1e9 / NUM_INSTRUCTIONS, NUM_INSTRUCTIONS / elapsed / 1e6);
+}
+
+int main() {
+	machine_t *m = create_machine();
+
+	double eager = run_step(m, 1);
+	double lazy = run_step(m, 0);
+
+	report("step, eager flags", eager);
+	report("step, lazy flags", lazy);
+	printf("saving                   %8.2f ns/instruction\n", (eager - lazy) * 1e9 / NUM_INSTRUCTIONS);
+
+	report("blocks, lazy flags", run_engine(m, ENGINE_BLOCKS));
+	report("jit, lazy flags", run_engine(m, ENGINE_JIT));
+
+	destroy_machine(m);
+}
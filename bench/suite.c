@@ -0,0 +1,343 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Throughput benchmarks of small guest programs.
+//
+// Each program is written to a temporary image and run headless on every
+// engine until it has retired a fixed number of instructions.  Every run is
+// made in a child process of its own so the peak resident set reported is
+// the run's alone.  The results are printed as a table and written to a JSON
+// file labelled with the build, so builds can be compared over time.
+//
+///////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "headless.h"
+
+// Register arithmetic, every instruction dependent on the last
+static const uint32_t alu[] = {
+	0xe3a00000,		//         mov   r0, #0
+	0xe3a01001,		//         mov   r1, #1
+	0xe3a02003,		//         mov   r2, #3
+	0xe0813002,		// loop:   add   r3, r1, r2
+	0xe0434101,		//         sub   r4, r3, r1, lsl #2
+	0xe0845083,		//         add   r5, r4, r3, lsl #1
+	0xe1a06185,		//         mov   r6, r5, lsl #3
+	0xe0461002,		//         sub   r1, r6, r2
+	0xe2822007,		//         add   r2, r2, #7
+	0xe2800001,		//         add   r0, r0, #1
+	0xeafffff7		//         b     loop
+};
+
+// Flag setting arithmetic with most instructions predicated, half of them failing
+static const uint32_t conditional[] = {
+	0xe3a01000,		//         mov   r1, #0
+	0xe3a02000,		//         mov   r2, #0
+	0xe3a03000,		//         mov   r3, #0
+	0xe3a04000,		//         mov   r4, #0
+	0xe2911003,		// loop:   adds  r1, r1, #3
+	0xe2522001,		//         subs  r2, r2, #1
+	0xe1510002,		//         cmp   r1, r2
+	0x02833001,		//         addeq r3, r3, #1
+	0x12844001,		//         addne r4, r4, #1
+	0x41a05001,		//         movmi r5, r1
+	0x52466001,		//         subpl r6, r6, #1
+	0xe3510601,		//         cmp   r1, #0x100000
+	0x82877001,		//         addhi r7, r7, #1
+	0x83a01000,		//         movhi r1, #0
+	0xeafffff4		//         b     loop
+};
+
+// Loads and stores striding through 64KB of RAM
+static const uint32_t load_store[] = {
+	0xe3a00601,		//         mov   r0, #0x100000
+	0xe3a01000,		//         mov   r1, #0
+	0xe0802001,		// loop:   add   r2, r0, r1
+	0xe5923000,		//         ldr   r3, [r2]
+	0xe2833001,		//         add   r3, r3, #1
+	0xe5823000,		//         str   r3, [r2]
+	0xe5924004,		//         ldr   r4, [r2, #4]
+	0xe5824008,		//         str   r4, [r2, #8]
+	0xe592500c,		//         ldr   r5, [r2, #12]
+	0xe5825004,		//         str   r5, [r2, #4]
+	0xe2811010,		//         add   r1, r1, #16
+	0xe3510801,		//         cmp   r1, #0x10000
+	0x23a01000,		//         movcs r1, #0
+	0xeafffff3		//         b     loop
+};
+
+// Short blocks joined by conditional branches that go both ways in turn
+static const uint32_t branch[] = {
+	0xe3a00000,		//         mov   r0, #0
+	0xe3a02000,		//         mov   r2, #0
+	0xe3a03000,		//         mov   r3, #0
+	0xe2800001,		// loop:   add   r0, r0, #1
+	0xe1b01f80,		//         movs  r1, r0, lsl #31
+	0x4a000001,		//         bmi   odd
+	0xe2822001,		//         add   r2, r2, #1
+	0xea000000,		//         b     join
+	0xe2422001,		// odd:    sub   r2, r2, #1
+	0xe1b01f00,		// join:   movs  r1, r0, lsl #30
+	0x5a000000,		//         bpl   skip
+	0xe2833001,		//         add   r3, r3, #1
+	0xeafffff5		// skip:   b     loop
+};
+
+// Sets and clears GPIO 16 and reads the levels back
+static const uint32_t gpio[] = {
+	0xe3a00202,		//         mov   r0, #0x20000000
+	0xe2800602,		//         add   r0, r0, #0x200000
+	0xe3a01701,		//         mov   r1, #0x40000
+	0xe5801004,		//         str   r1, [r0, #4]			GPFSEL1, 16 is an output
+	0xe3a01801,		//         mov   r1, #0x10000
+	0xe580101c,		// loop:   str   r1, [r0, #0x1c]		GPSET0
+	0xe5902034,		//         ldr   r2, [r0, #0x34]		GPLEV0
+	0xe5801028,		//         str   r1, [r0, #0x28]		GPCLR0
+	0xe5902034,		//         ldr   r2, [r0, #0x34]
+	0xeafffffa		//         b     loop
+};
+
+// Waits 100 microseconds at a time by polling the system timer
+static const uint32_t timer[] = {
+	0xe3a00202,		//         mov   r0, #0x20000000
+	0xe2800a03,		//         add   r0, r0, #0x3000
+	0xe3a04000,		//         mov   r4, #0
+	0xe5901004,		// wait:   ldr   r1, [r0, #4]			CLO
+	0xe5902004,		// poll:   ldr   r2, [r0, #4]
+	0xe0422001,		//         sub   r2, r2, r1
+	0xe3520064,		//         cmp   r2, #100
+	0x3afffffb,		//         bcc   poll
+	0xe2844001,		//         add   r4, r4, #1
+	0xeafffff8		//         b     wait
+};
+
+typedef struct benchmark {
+	const char *name;
+	uint64_t instructions;
+	const uint32_t *program;
+	size_t size;
+} benchmark_t;
+
+#define PROGRAM(words)		words, sizeof(words)
+
+// Polling the timer is mostly skipped, which costs more per instruction retired, so it runs for fewer
+static const benchmark_t benchmarks[] = {
+	{ "alu",         20000000, PROGRAM(alu) },
+	{ "conditional", 20000000, PROGRAM(conditional) },
+	{ "load_store",  20000000, PROGRAM(load_store) },
+	{ "branch",      20000000, PROGRAM(branch) },
+	{ "gpio",        20000000, PROGRAM(gpio) },
+	{ "timer",        2000000, PROGRAM(timer) }
+};
+
+enum { NUM_BENCHMARKS = sizeof(benchmarks) / sizeof(benchmarks[0]) };
+
+static const char *engine_names[] = { "step", "blocks", "jit" };
+
+typedef struct run {
+	const benchmark_t *benchmark;
+	headless_options_t options;
+	headless_result_t result;
+	long peak_rss;					// KB
+} run_t;
+
+static void usage() {
+	fprintf(stderr, "usage: bench-suite [-b build] [-f flags] [-e step|blocks|jit] results.json\n");
+	fprintf(stderr, "  -b  label of the build the results are for, e.g. a commit\n");
+	fprintf(stderr, "  -f  compiler flags it was built with\n");
+	fprintf(stderr, "  -e  only run on this engine\n\n");
+}
+
+// Writes the program to a new temporary image.  Returns false if it can't be written.
+static bool write_image(const benchmark_t *benchmark, char *filename) {
+	int fd = mkstemp(filename);
+
+	if (fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	bool written = write(fd, benchmark->program, benchmark->size) == (ssize_t)benchmark->size;
+
+	if (!written)
+		perror(filename);
+
+	close(fd);
+	return written;
+}
+
+// Runs the image headless in a child process and collects the result and the child's peak resident set.
+// Returns false if the child didn't send a result back.
+static bool run_child(run_t *run) {
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		perror("Benchmark");
+		return false;
+	}
+
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("Benchmark");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		headless_result_t result = run_headless(&run->options);
+		_exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	bool received = read(fds[0], &run->result, sizeof(run->result)) == sizeof(run->result);
+	close(fds[0]);
+
+	struct rusage usage;
+	int status;
+
+	if (wait4(pid, &status, 0, &usage) < 0)
+		return false;
+
+	run->peak_rss = usage.ru_maxrss;
+	return received;
+}
+
+static bool run_benchmark(run_t *run, const benchmark_t *benchmark, execution_engine_t engine) {
+	char image[] = "/tmp/piemu-bench-XXXXXX";
+
+	if (!write_image(benchmark, image))
+		return false;
+
+	run->benchmark = benchmark;
+	init_headless_options(&run->options);
+	run->options.image = image;
+	run->options.engine = engine;
+	run->options.max_instructions = benchmark->instructions;
+
+	bool ran = run_child(run);
+	unlink(image);
+
+	// The summary names the benchmark rather than the image it was run from
+	run->options.image = (char *)benchmark->name;
+	return ran;
+}
+
+static double ns_per_instruction(const run_t *run) {
+	return run->result.instructions > 0 ? run->result.seconds * 1e9 / run->result.instructions : 0;
+}
+
+static void print_run(const run_t *run) {
+	double mips = run->result.seconds > 0 ? run->result.instructions / run->result.seconds / 1e6 : 0;
+
+	printf("%-12s %-7s %12llu %10.2f %10.2f %10ld\n", run->benchmark->name, engine_names[run->options.engine],
+		(unsigned long long)run->result.instructions, mips, ns_per_instruction(run), run->peak_rss);
+}
+
+static bool write_results(const char *filename, const char *build, const char *flags, const run_t *runs, int num_runs) {
+	FILE *f = fopen(filename, "w");
+	struct utsname host;
+	char date[32];
+	time_t now = time(NULL);
+
+	if (f == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	uname(&host);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+	fprintf(f, "{\"build\":");
+	write_json_string(f, build);
+	fprintf(f, ",\"flags\":");
+	write_json_string(f, flags);
+	fprintf(f, ",\"date\":\"%s\",\"host\":\"%s %s %s\",\"runs\":[\n", date, host.sysname, host.release, host.machine);
+
+	for (int i = 0; i < num_runs; i++) {
+		const run_t *run = &runs[i];
+
+		fprintf(f, "{\"benchmark\":\"%s\",\"engine\":\"%s\",", run->benchmark->name, engine_names[run->options.engine]);
+		write_summary_fields(f, &run->options, &run->result);
+		fprintf(f, ",\"ns_per_instruction\":%.3f,\"peak_rss_kb\":%ld}%s\n", ns_per_instruction(run), run->peak_rss, i < num_runs - 1 ? "," : "");
+	}
+
+	fprintf(f, "]}\n");
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	run_t runs[NUM_BENCHMARKS * 3];
+	int num_runs = 0;
+	char *build = "";
+	char *flags = "";
+	int first_engine = ENGINE_STEP;
+	int last_engine = ENGINE_JIT;
+	int option;
+
+	while ((option = getopt(argc, argv, "b:f:e:")) != -1) {
+		switch (option) {
+			case 'b':
+				build = optarg;
+				break;
+
+			case 'f':
+				flags = optarg;
+				break;
+
+			case 'e':
+				for (first_engine = ENGINE_STEP; first_engine <= ENGINE_JIT; first_engine++)
+					if (strcmp(optarg, engine_names[first_engine]) == 0)
+						break;
+
+				if (first_engine > ENGINE_JIT) {
+					usage();
+					return 1;
+				}
+
+				last_engine = first_engine;
+				break;
+
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage();
+		return 1;
+	}
+
+	printf("%-12s %-7s %12s %10s %10s %10s\n", "benchmark", "engine", "instructions", "MIPS", "ns/instr", "peak KB");
+
+	for (int i = 0; i < NUM_BENCHMARKS; i++) {
+		for (int engine = first_engine; engine <= last_engine; engine++) {
+			run_t *run = &runs[num_runs];
+
+			if (!run_benchmark(run, &benchmarks[i], engine)) {
+				fprintf(stderr, "%s didn't run on the %s engine\n", benchmarks[i].name, engine_names[engine]);
+				return 2;
+			}
+
+			print_run(run);
+			num_runs++;
+		}
+	}
+
+	return write_results(argv[optind], build, flags, runs, num_runs) ? 0 : 2;
+}
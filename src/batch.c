@@ -0,0 +1,329 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Runs a manifest of headless jobs across a pool of threads.
+//
+// Each line of the manifest is an image followed by the options piemu -H
+// takes, e.g. "blink.img -g 16=1 -t 10".  Blank lines and lines starting
+// with # are skipped.  Jobs vary a lot in length so each worker has a queue
+// of its own and steals from the others when it runs out, rather than the
+// jobs being split up front.  A line of JSON is written for each job as it
+// finishes, and the aggregate speed and job latencies are printed at the end.
+//
+///////////////////////////////////////
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "headless.h"
+
+enum {
+	MAX_LINE_LENGTH = 4096,
+	MAX_JOB_ARGS    = 64
+};
+
+typedef struct job {
+	int line;						// Manifest line, for reporting
+	char *text;						// Copy of the line the options point into
+	headless_options_t options;
+	headless_result_t result;
+	double wall_seconds;			// Including creating the machine and loading the image
+} job_t;
+
+// A worker's jobs.  The owner takes from the bottom and thieves take from the top.
+typedef struct job_queue {
+	pthread_mutex_t lock;
+	int *jobs;
+	int top;
+	int bottom;
+} job_queue_t;
+
+typedef struct batch {
+	job_t *jobs;
+	int num_jobs;
+	job_queue_t *queues;
+	int num_workers;
+	FILE *results;
+	pthread_mutex_t results_lock;
+} batch_t;
+
+typedef struct worker {
+	batch_t *batch;
+	int index;
+} worker_t;
+
+static double seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: piemu-batch [-j threads] manifest results.jsonl\n");
+	fprintf(stderr, "  -j  number of worker threads (default one per online CPU)\n\n");
+	fprintf(stderr, "Each manifest line is an image followed by piemu -H options:\n");
+	fprintf(stderr, "  [-n] [-e step|blocks|jit] [-a addr] [-m instructions] [-t seconds] [-p addr] [-g pin=level] [-l] [-r file] [-s file] [-T file] [-R first:last] [-P file] [-F file] [-S interval] [-L instructions] [-w file] [-x name]\n\n");
+}
+
+// Parses a manifest line into the job.  Returns false if it isn't valid.
+static bool parse_job(job_t *job, char *line) {
+	char *argv[MAX_JOB_ARGS + 1];
+	int argc = 0;
+
+	argv[argc++] = "piemu-batch";
+
+	for (char *arg = strtok(line, " \t\r\n"); arg != NULL; arg = strtok(NULL, " \t\r\n")) {
+		if (argc == MAX_JOB_ARGS)
+			return false;
+
+		argv[argc++] = arg;
+	}
+
+	argv[argc] = NULL;
+	init_headless_options(&job->options);
+	job->options.image = NULL;
+
+	int option;
+	optind = 0;				// Start getopt afresh for every line
+
+	while ((option = getopt(argc, argv, HEADLESS_OPTIONS)) != -1) {
+		if (!parse_headless_option(&job->options, option, optarg))
+			return false;
+	}
+
+	if (optind == argc - 1)
+		job->options.image = argv[optind];
+
+	return job->options.image != NULL;
+}
+
+// Reads the jobs from the manifest.  Returns the number read or -1 on error.
+static int read_manifest(char *filename, job_t **jobs) {
+	FILE *f = fopen(filename, "r");
+	char line[MAX_LINE_LENGTH];
+	int num_jobs = 0;
+	int capacity = 0;
+
+	if (f == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	*jobs = NULL;
+
+	for (int line_number = 1; fgets(line, sizeof(line), f) != NULL; line_number++) {
+		char *text = line + strspn(line, " \t\r\n");
+
+		if (*text == '\0' || *text == '#')
+			continue;
+
+		if (num_jobs == capacity) {
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			*jobs = realloc(*jobs, capacity * sizeof(job_t));
+		}
+
+		job_t *job = &(*jobs)[num_jobs];
+		memset(job, 0, sizeof(*job));
+		job->line = line_number;
+		job->text = strdup(text);
+
+		if (!parse_job(job, job->text)) {
+			fprintf(stderr, "%s:%d: expected an image and piemu -H options\n", filename, line_number);
+			fclose(f);
+			return -1;
+		}
+
+		num_jobs++;
+	}
+
+	fclose(f);
+	return num_jobs;
+}
+
+// Takes a job from the worker's own queue, newest first
+static int take_job(job_queue_t *queue) {
+	int job = -1;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->bottom > queue->top)
+		job = queue->jobs[--queue->bottom];
+
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+// Takes the oldest job from another worker's queue
+static int steal_job(job_queue_t *queue) {
+	int job = -1;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->bottom > queue->top)
+		job = queue->jobs[queue->top++];
+
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+// Returns the next job for the worker or -1 when every queue is empty.  No jobs are added once the
+// workers start so an empty sweep means there is nothing left.
+static int next_job(batch_t *batch, int worker) {
+	int job = take_job(&batch->queues[worker]);
+
+	for (int i = 1; job < 0 && i < batch->num_workers; i++)
+		job = steal_job(&batch->queues[(worker + i) % batch->num_workers]);
+
+	return job;
+}
+
+static void write_result(batch_t *batch, int index, int worker) {
+	job_t *job = &batch->jobs[index];
+
+	pthread_mutex_lock(&batch->results_lock);
+	fprintf(batch->results, "{\"job\":%d,\"line\":%d,\"worker\":%d,\"wall_seconds\":%.6f,", index, job->line, worker, job->wall_seconds);
+	write_summary_fields(batch->results, &job->options, &job->result);
+	fprintf(batch->results, "}\n");
+	fflush(batch->results);
+	pthread_mutex_unlock(&batch->results_lock);
+}
+
+static void *run_worker(void *arg) {
+	worker_t *worker = arg;
+	batch_t *batch = worker->batch;
+	int index;
+
+	while ((index = next_job(batch, worker->index)) >= 0) {
+		job_t *job = &batch->jobs[index];
+		double start = seconds();
+
+		job->result = run_headless(&job->options);
+		job->wall_seconds = seconds() - start;
+		write_result(batch, index, worker->index);
+	}
+
+	return NULL;
+}
+
+// Deals the jobs out round robin so every worker starts with something to do
+static void fill_queues(batch_t *batch) {
+	batch->queues = calloc(batch->num_workers, sizeof(job_queue_t));
+
+	for (int worker = 0; worker < batch->num_workers; worker++) {
+		job_queue_t *queue = &batch->queues[worker];
+		pthread_mutex_init(&queue->lock, NULL);
+		queue->jobs = malloc((batch->num_jobs / batch->num_workers + 1) * sizeof(int));
+	}
+
+	// Put in reverse so each owner takes its jobs in manifest order
+	for (int job = batch->num_jobs - 1; job >= 0; job--) {
+		job_queue_t *queue = &batch->queues[job % batch->num_workers];
+		queue->jobs[queue->bottom++] = job;
+	}
+}
+
+static int compare_seconds(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted times
+static double percentile(const double *sorted, int count, int percent) {
+	int rank = (count * percent + 99) / 100;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_report(const batch_t *batch, double elapsed) {
+	double *times = malloc(batch->num_jobs * sizeof(double));
+	uint64_t instructions = 0;
+	int errors = 0;
+	int diverged = 0;
+
+	for (int i = 0; i < batch->num_jobs; i++) {
+		times[i] = batch->jobs[i].wall_seconds;
+		instructions += batch->jobs[i].result.instructions;
+		errors += batch->jobs[i].result.reason == EXIT_ERROR;
+		diverged += batch->jobs[i].result.reason == EXIT_DIVERGED;
+	}
+
+	qsort(times, batch->num_jobs, sizeof(double), compare_seconds);
+
+	fprintf(stderr, "%d jobs on %d threads in %.3f s, %d failed, %d diverged\n", batch->num_jobs, batch->num_workers, elapsed, errors, diverged);
+	fprintf(stderr, "%llu guest instructions, %.1f MIPS aggregate\n", (unsigned long long)instructions, elapsed > 0 ? instructions / elapsed / 1e6 : 0);
+	fprintf(stderr, "job wall time  p50 %.3f s  p90 %.3f s  p99 %.3f s  max %.3f s\n",
+		percentile(times, batch->num_jobs, 50), percentile(times, batch->num_jobs, 90), percentile(times, batch->num_jobs, 99), times[batch->num_jobs - 1]);
+
+	free(times);
+}
+
+int main(int argc, char **argv) {
+	batch_t batch;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int option;
+
+	while ((option = getopt(argc, argv, "j:")) != -1) {
+		switch (option) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if (argc - optind != 2 || threads < 1) {
+		usage();
+		return 1;
+	}
+
+	// Reading the manifest uses getopt again
+	char *manifest = argv[optind];
+	char *results = argv[optind + 1];
+
+	memset(&batch, 0, sizeof(batch));
+	batch.num_jobs = read_manifest(manifest, &batch.jobs);
+
+	if (batch.num_jobs < 0)
+		return 1;
+
+	if (batch.num_jobs == 0) {
+		fprintf(stderr, "%s: no jobs\n", manifest);
+		return 1;
+	}
+
+	if ((batch.results = fopen(results, "w")) == NULL) {
+		perror(results);
+		return 2;
+	}
+
+	batch.num_workers = threads < batch.num_jobs ? threads : batch.num_jobs;
+	pthread_mutex_init(&batch.results_lock, NULL);
+	fill_queues(&batch);
+
+	pthread_t *ids = malloc(batch.num_workers * sizeof(pthread_t));
+	worker_t *workers = malloc(batch.num_workers * sizeof(worker_t));
+	double start = seconds();
+
+	for (int i = 0; i < batch.num_workers; i++) {
+		workers[i].batch = &batch;
+		workers[i].index = i;
+		pthread_create(&ids[i], NULL, run_worker, &workers[i]);
+	}
+
+	for (int i = 0; i < batch.num_workers; i++)
+		pthread_join(ids[i], NULL);
+
+	print_report(&batch, seconds() - start);
+	fclose(batch.results);
+	return 0;
+}
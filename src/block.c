@@ -0,0 +1,770 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Basic block translation engine.
+//
+// Guest code is split into blocks ending at the next branch or PC write.  Each
+// instruction in a block is bound to an operation and the block is executed
+// with direct threading (computed goto), so there is no fetch, decode or PC
+// writeback per instruction.  Blocks are chained to their successors once
+// they have been looked up.
+//
+///////////////////////////////////////
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "breakpoint.h"
+#include "cpu.h"
+#include "flags.h"
+#include "flow.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "machine.h"
+#include "memory.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "timer.h"
+
+enum {
+	MAX_BLOCK_LENGTH = 64,
+
+	DEFAULT_JIT_THRESHOLD = 1000	// Block executions before it is compiled to host code
+};
+
+static void flush_blocks(machine_t *m) {
+	count_block_executions(m);
+	m->arena_used = 0;
+	memset(m->block_hash, 0, sizeof(m->block_hash));
+
+	for (uint32_t page = m->first_translated_page; page <= m->last_translated_page; page++)
+		unmark_code_page(m, page << CODE_PAGE_SHIFT, CODE_PAGE_TRANSLATED);
+
+	m->first_translated_page = NUM_CODE_PAGES;
+	m->last_translated_page = 0;
+
+	flush_jit(m);
+	m->flush_count++;
+}
+
+// Blocks are carved out of an arena and all thrown away together when code is modified or the arena fills
+void init_blocks(machine_t *m) {
+	m->block_arena = malloc(BLOCK_ARENA_SIZE);
+
+	if (m->block_arena == NULL) {
+		perror("Block arena");
+		exit(2);
+	}
+
+	m->jit_threshold = DEFAULT_JIT_THRESHOLD;
+	init_jit(m);
+	flush_blocks(m);
+}
+
+void free_blocks(machine_t *m) {
+	free_code_map(m->code_map);
+	m->code_map = NULL;
+	free_jit(m);
+	free(m->block_arena);
+	m->block_arena = NULL;
+}
+
+// Called when a page that code has been translated from is written
+void invalidate_blocks(machine_t *m, uint32_t addr) {
+	(void)addr;
+	flush_blocks(m);
+}
+
+static unsigned block_hash_index(uint32_t addr) {
+	return (addr >> 2) & (BLOCK_HASH_SIZE - 1);
+}
+
+// Binds a decoded instruction to the operation the threaded dispatcher runs for it
+static block_op_kind_t select_op(decoded_instruction_t *decoded) {
+	switch (decoded->type) {
+		case INSTRUCTION_DATA_PROCESSING_IMMEDIATE:
+		case INSTRUCTION_DATA_PROCESSING_LSL: {
+			bool immediate = decoded->type == INSTRUCTION_DATA_PROCESSING_IMMEDIATE;
+
+			// Reading or writing the PC as a general register goes through the interpreter
+			if (decoded->rd == pc || decoded->rn == pc || (!immediate && decoded->rm == pc))
+				return OP_GENERIC;
+
+			switch (decoded->opcode) {
+				case OPCODE_MOV:
+					return immediate ? OP_MOV_IMMEDIATE : OP_MOV_LSL;
+
+				case OPCODE_SUB:
+					return immediate ? OP_SUB_IMMEDIATE : OP_SUB_LSL;
+
+				case OPCODE_ADD:
+					return immediate ? OP_ADD_IMMEDIATE : OP_ADD_LSL;
+
+				case OPCODE_CMP:
+					return immediate ? OP_CMP_IMMEDIATE : OP_CMP_LSL;
+			}
+
+			return OP_GENERIC;
+		}
+
+		case INSTRUCTION_LOAD_WORD:
+			if (decoded->rd == pc)
+				return OP_GENERIC;
+
+			// ldr rd, [pc, #offset] is how literals are loaded so fold the address in
+			if (decoded->rn == pc) {
+				decoded->immediate += decoded->addr + 8;
+				return OP_LOAD_ABSOLUTE;
+			}
+
+			return OP_LOAD;
+
+		case INSTRUCTION_STORE_WORD:
+			return decoded->rn == pc || decoded->rd == pc ? OP_GENERIC : OP_STORE;
+
+		case INSTRUCTION_BRANCH:
+			return OP_BRANCH;
+
+		default:
+			return OP_GENERIC;
+	}
+}
+
+// True if the operation can change the flow of control so must be the last in its block
+static bool ends_block(block_op_kind_t kind) {
+	return kind == OP_BRANCH || kind == OP_GENERIC;
+}
+
+enum { FLAGS_REGISTER = 16 };		// Bit for the flags in the register masks of an operation
+
+// Masks of the registers, and the flags, that the operation reads and writes.  A write that depends on
+// the condition is a read of the flags too, and so is a MOVS as it can leave C alone.
+static void op_registers(const block_op_t *op, uint32_t *reads, uint32_t *writes) {
+	const decoded_instruction_t *d = &op->decoded;
+	uint32_t flags = 1u << FLAGS_REGISTER;
+
+	*reads = d->cond != COND_AL ? flags : 0;
+	*writes = 0;
+
+	switch (op->kind) {
+		case OP_MOV_LSL:
+			*reads |= 1u << d->rm;
+			// Fall through
+
+		case OP_MOV_IMMEDIATE:
+			*writes = 1u << d->rd | (d->s ? flags : 0);
+			*reads |= d->s ? flags : 0;
+			break;
+
+		case OP_SUB_LSL:
+		case OP_ADD_LSL:
+			*reads |= 1u << d->rm;
+			// Fall through
+
+		case OP_SUB_IMMEDIATE:
+		case OP_ADD_IMMEDIATE:
+			*reads |= 1u << d->rn;
+			*writes = 1u << d->rd | (d->s ? flags : 0);
+			break;
+
+		case OP_CMP_LSL:
+			*reads |= 1u << d->rm;
+			// Fall through
+
+		case OP_CMP_IMMEDIATE:
+			*reads |= 1u << d->rn;
+			*writes = flags;
+			break;
+
+		case OP_LOAD:
+			*reads |= 1u << d->rn;
+			// Fall through
+
+		case OP_LOAD_ABSOLUTE:
+			*writes = 1u << d->rd;
+			break;
+
+		default:
+			break;
+	}
+}
+
+// True if the block loops back to itself doing nothing but loads and arithmetic, and every pass
+// works its registers out afresh: nothing the loop writes is read before the pass has written it.
+// The passes are then all alike, so if one of the loads is from the system timer the guest is
+// waiting for time to pass and the passes until it has can be skipped.
+static bool is_poll_loop(const block_t *block) {
+	uint32_t defined = 0;			// Written so far this pass whatever the condition
+	uint32_t written = 0;
+	uint32_t carried = 0;			// Read before this pass has defined them
+	bool loads = false;
+
+	for (int i = 0; i < block->length; i++) {
+		const block_op_t *op = &block->ops[i];
+		uint32_t reads, writes;
+
+		if (i < block->length - 1 && (op->kind == OP_STORE || op->kind == OP_GENERIC))
+			return false;
+
+		loads |= op->kind == OP_LOAD || op->kind == OP_LOAD_ABSOLUTE;
+		op_registers(op, &reads, &writes);
+		carried |= reads & ~defined;
+		written |= writes;
+
+		if (op->decoded.cond == COND_AL)
+			defined |= writes;
+	}
+
+	return loads && (carried & written) == 0;
+}
+
+// True if the block is a delay loop that only adds or subtracts a constant from a counter until
+// it equals a fixed value, e.g.
+//
+//     loop: sub r2, r2, #1          loop: subs r2, r2, #1
+//           cmp r2, #0                    bne loop
+//           bne loop
+static bool is_countdown_loop(const block_t *block) {
+	const block_op_t *count = &block->ops[0];
+	const block_op_t *compare = &block->ops[1];
+
+	if (block->ops[block->length - 1].decoded.cond != COND_NE)
+		return false;
+
+	if ((count->kind != OP_SUB_IMMEDIATE && count->kind != OP_ADD_IMMEDIATE) || count->decoded.cond != COND_AL ||
+			count->decoded.rd != count->decoded.rn || count->decoded.immediate == 0)
+		return false;
+
+	if (block->length == 2)
+		return count->decoded.s == 1;
+
+	// The value counted to is a constant or a register that isn't the counter
+	if (block->length != 3 || compare->decoded.cond != COND_AL || compare->decoded.rn != count->decoded.rd)
+		return false;
+
+	return compare->kind == OP_CMP_IMMEDIATE ||
+		(compare->kind == OP_CMP_LSL && compare->decoded.shift == 0 && compare->decoded.rm != count->decoded.rd);
+}
+
+static loop_kind_t classify_loop(const block_t *block) {
+	const block_op_t *last = &block->ops[block->length - 1];
+
+	if (last->kind != OP_BRANCH || last->decoded.cond == COND_AL || last->decoded.immediate - 8 != block->addr)
+		return LOOP_NONE;
+
+	if (is_countdown_loop(block))
+		return LOOP_COUNTDOWN;
+
+	return is_poll_loop(block) ? LOOP_POLL : LOOP_NONE;
+}
+
+static block_t *translate_block(machine_t *m, uint32_t addr, const void *const *labels) {
+	size_t size = sizeof(block_t) + MAX_BLOCK_LENGTH * sizeof(block_op_t);
+
+	if (m->arena_used + size > BLOCK_ARENA_SIZE)
+		flush_blocks(m);
+
+	block_t *block = (block_t *)(m->block_arena + m->arena_used);
+	block->addr = addr;
+	block->length = 0;
+	block->taken = NULL;
+	block->fallthrough = NULL;
+	block->executions = 0;
+	block->polls_timer = false;
+	block->code = NULL;
+	block->stop = breakpoint_at(m, addr) ? STOP_BREAKPOINT : STOP_NONE;
+
+	block_op_kind_t kind;
+
+	do {
+		uint32_t instruction_addr = addr + block->length * 4;
+
+		// A breakpoint always starts a block so the engine sees it before running the instruction
+		if (block->length > 0 && breakpoint_at(m, instruction_addr))
+			break;
+
+		block_op_t *op = &block->ops[block->length++];
+
+		decode_instruction(instruction_addr, fetch_word(m, instruction_addr), &op->decoded);
+		kind = select_op(&op->decoded);
+		op->kind = kind;
+		op->label = labels[kind];
+		mark_code_page(m, instruction_addr, CODE_PAGE_TRANSLATED);
+
+		if (instruction_addr >> CODE_PAGE_SHIFT < m->first_translated_page)
+			m->first_translated_page = instruction_addr >> CODE_PAGE_SHIFT;
+
+		if (instruction_addr >> CODE_PAGE_SHIFT > m->last_translated_page)
+			m->last_translated_page = instruction_addr >> CODE_PAGE_SHIFT;
+	} while (!ends_block(kind) && block->length < MAX_BLOCK_LENGTH - 1);
+
+	if (m->stop_on_self_branch && block->length == 1 && is_self_branch(&block->ops[0].decoded) && block->stop == STOP_NONE)
+		block->stop = STOP_SELF_BRANCH;
+
+	block->loop = classify_loop(block);
+
+	if (!ends_block(kind)) {
+		block_op_t *op = &block->ops[block->length];
+		op->kind = OP_FALLTHROUGH;
+		op->label = labels[OP_FALLTHROUGH];
+		op->decoded.addr = addr + block->length * 4;
+		op->decoded.cond = COND_AL;
+	}
+
+	m->arena_used += (sizeof(block_t) + (block->length + 1) * sizeof(block_op_t) + 15) & ~(size_t)15;
+
+	unsigned index = block_hash_index(addr);
+	block->hash_next = m->block_hash[index];
+	m->block_hash[index] = block;
+
+	return block;
+}
+
+static block_t *find_block(machine_t *m, uint32_t addr, const void *const *labels) {
+	for (block_t *block = m->block_hash[block_hash_index(addr)]; block != NULL; block = block->hash_next)
+		if (block->addr == addr)
+			return block;
+
+	return translate_block(m, addr, labels);
+}
+
+// Looks up the successor at addr and chains it to the link in the previous block.  The link is
+// left alone if the lookup had to throw translations away, as the previous block has gone with them.
+static block_t *chain_block(machine_t *m, block_t **link, uint32_t addr, const void *const *labels) {
+	unsigned flushes = m->flush_count;
+	block_t *next = find_block(m, addr, labels);
+
+	if (flushes == m->flush_count)
+		*link = next;
+
+	return next;
+}
+
+// Translates every block of the code map so the engine doesn't stop to translate as it first reaches
+// each one.  Gives up if the arena fills, as the blocks already translated are thrown away with it.
+static void translate_code_map(machine_t *m, const void *const *labels) {
+	unsigned flushes = m->flush_count;
+
+	m->code_map_translated = true;
+
+	for (int i = 0; i < m->code_map->num_blocks && flushes == m->flush_count; i++)
+		find_block(m, m->code_map->blocks[i].addr, labels);
+}
+
+// Runs one more pass of a poll loop with the clock moved on by skip cycles and returns true if
+// the loop would exit.  Everything the pass changes is put back.
+static bool poll_loop_exits(machine_t *m, const block_t *block, uint64_t skip) {
+	uint32_t registers[NUM_REGISTERS];
+	lazy_flags_t flags = m->flags;
+	uint64_t retired = m->retired;
+	stop_reason_t stop_reason = m->stop_reason;
+	uint64_t mmio_access_count = m->mmio_access_count;
+
+	memcpy(registers, m->registers, sizeof(registers));
+	m->idle_cycles += skip;
+	m->registers[pc] = block->addr + 8;
+
+	for (int i = 0; i < block->length; i++)
+		step(m);
+
+	bool exits = m->registers[pc] != block->addr + 8;
+
+	memcpy(m->registers, registers, sizeof(registers));
+	m->flags = flags;
+	m->retired = retired;
+	m->stop_reason = stop_reason;
+	m->mmio_access_count = mmio_access_count;
+	m->idle_cycles -= skip;
+	return exits;
+}
+
+// Moves the clock on past time the poll loop would have spun for.  Lockstep is told, as its reference
+// single steps so has to spin through it.
+static void skip_poll_time(machine_t *m, const block_t *block, uint64_t cycles) {
+	advance_time(m, cycles);
+
+	if (m->lockstep != NULL)
+		note_skipped_time(m, block->addr, block->length, cycles);
+}
+
+// The block is about to go round again after reading the system timer.  Rather than spin, move
+// the clock on to the first microsecond the loop exits at, found by doubling the skip and then
+// halving the interval, or to the next event if that comes first.  The counter wraps after 2^32
+// microseconds so a loop that hasn't exited by then never will, and is no longer treated as
+// waiting on the timer.
+static void skip_poll_loop(machine_t *m, block_t *block) {
+	uint64_t limit = (1ull << 32) * CYCLES_PER_MICROSECOND;
+	uint64_t until_event = m->next_event - current_time(m);
+	uint64_t skip = CYCLES_PER_MICROSECOND;
+	uint64_t exited = 0;
+
+	if (m->next_event != (uint64_t)NO_EVENT && until_event < limit)
+		limit = until_event;
+
+	for (; skip < limit; skip *= 2) {
+		if (poll_loop_exits(m, block, skip)) {
+			exited = skip;
+			break;
+		}
+	}
+
+	if (exited == 0 && poll_loop_exits(m, block, limit))
+		exited = limit;
+
+	if (exited == 0) {
+		if (limit == until_event)
+			skip_poll_time(m, block, until_event);
+		else
+			block->loop = LOOP_NONE;
+
+		m->timer_read = false;
+		return;
+	}
+
+	uint64_t waiting = exited / 2;
+
+	while (exited - waiting > CYCLES_PER_MICROSECOND) {
+		uint64_t middle = waiting + (exited - waiting) / 2;
+
+		if (poll_loop_exits(m, block, middle))
+			exited = middle;
+		else
+			waiting = middle;
+	}
+
+	skip_poll_time(m, block, exited);
+	m->timer_read = false;
+}
+
+// The countdown loop block has just been run and is going round again.  Works out how many more
+// passes it takes for the counter to reach the value it is compared with and runs all but the
+// last of them in one go, leaving the last to set the flags and exit.  Loops that only exit after
+// the counter wraps are left to run, and so is anything past the end of the slice so instruction
+// limits, events and profiler samples still land where they would have.  A loop with a breakpoint
+// on it is never skipped.
+static void skip_countdown_loop(machine_t *m, block_t *block) {
+	const decoded_instruction_t *count = &block->ops[0].decoded;
+	const block_op_t *compare = &block->ops[1];
+	uint32_t counter = m->registers[count->rd];
+	uint32_t target = 0;
+
+	if (block->length == 3)
+		target = compare->kind == OP_CMP_IMMEDIATE ? compare->decoded.immediate : m->registers[compare->decoded.rm];
+
+	uint32_t distance = count->opcode == OPCODE_SUB ? counter - target : target - counter;
+
+	if (distance % count->immediate != 0 || m->slice_end <= m->retired || block->stop != STOP_NONE)
+		return;
+
+	uint64_t passes = distance / count->immediate - 1;
+	uint64_t budget = (m->slice_end - m->retired) / block->length;
+
+	if (passes > budget)
+		passes = budget;
+
+	uint32_t counted = count->opcode == OPCODE_SUB ? counter - passes * count->immediate : counter + passes * count->immediate;
+
+	m->registers[count->rd] = counted;
+	m->retired += passes * block->length;
+
+	// The flags the last pass skipped would have set, which matter when the slice ends before the pass
+	// that sets them again
+	if (passes > 0 && block->length == 3)
+		set_flags_sub(&m->flags, counted, target);
+	else if (passes > 0 && count->opcode == OPCODE_SUB)
+		set_flags_sub(&m->flags, counted + count->immediate, count->immediate);
+	else if (passes > 0)
+		set_flags_add(&m->flags, counted - count->immediate, count->immediate);
+
+	// The profiler counts the passes skipped as runs of the block.  Otherwise the count is only the JIT's.
+	if (m->profile != NULL)
+		block->executions += passes;
+}
+
+// The retired count is only brought up to date at the end of a block, so accesses that leave the fast
+// path are made with it moved on to the instruction making them, index instructions into the block.
+// Peripherals see the clock as it would be single stepping.
+static inline uint32_t block_read_word(machine_t *m, uint32_t addr, int index) {
+	uintptr_t entry = m->page_table[addr >> PAGE_SHIFT];
+
+	if (((entry & (PAGE_READ_TRAP | PAGE_MMIO_READS)) | (addr & 3)) == 0)
+		return *(uint32_t *)(page_host(entry) + addr);
+
+	if (((entry & PAGE_READ_TRAP) | (addr & 3)) == 0 && addr <= mmio_reads_end(m, entry))
+		return *(uint32_t *)(page_host(entry) + addr);
+
+	m->retired += index;
+	uint32_t value = read_word_slow(m, addr);
+	m->retired -= index;
+	return value;
+}
+
+static inline void block_write_word(machine_t *m, uint32_t addr, uint32_t value, int index) {
+	uintptr_t entry = m->page_table[addr >> PAGE_SHIFT];
+
+	if (((entry & PAGE_WRITE_TRAP) | (addr & 3)) == 0) {
+		*(uint32_t *)(page_host(entry) + addr) = value;
+		return;
+	}
+
+	m->retired += index;
+	write_word_slow(m, addr, value);
+	m->retired -= index;
+}
+
+// Runs blocks from the current PC until max_instructions have been executed or stop_reason is set.
+// A block that would run past max_instructions is single stepped up to it instead, so the engine
+// stops where the step engine would, unless the block ends within overrun_limit and no event is due.
+// Returns the number of instructions executed, including those skipped by their condition.
+uint64_t run_blocks(machine_t *m, uint64_t max_instructions) {
+	static const void *const labels[NUM_OPS] = {
+		[OP_GENERIC]         = &&op_generic,
+		[OP_MOV_IMMEDIATE]   = &&op_mov_immediate,
+		[OP_MOV_LSL]         = &&op_mov_lsl,
+		[OP_SUB_IMMEDIATE]   = &&op_sub_immediate,
+		[OP_SUB_LSL]         = &&op_sub_lsl,
+		[OP_ADD_IMMEDIATE]   = &&op_add_immediate,
+		[OP_ADD_LSL]         = &&op_add_lsl,
+		[OP_CMP_IMMEDIATE]   = &&op_cmp_immediate,
+		[OP_CMP_LSL]         = &&op_cmp_lsl,
+		[OP_LOAD]            = &&op_load,
+		[OP_LOAD_ABSOLUTE]   = &&op_load_absolute,
+		[OP_STORE]           = &&op_store,
+		[OP_BRANCH]          = &&op_branch,
+		[OP_FALLTHROUGH]     = &&op_fallthrough
+	};
+
+	uint32_t *registers = m->registers;
+	lazy_flags_t *flags = &m->flags;
+	uint64_t start = m->retired;
+	uint64_t end = start + max_instructions;
+
+	if (m->code_map != NULL && !m->code_map_translated)
+		translate_code_map(m, labels);
+
+	block_t *block = find_block(m, registers[pc] - 8, labels);
+	block_op_t *op;
+	const decoded_instruction_t *d;
+	uint32_t operand;
+	uint32_t value;
+	unsigned flushes;
+	bool jit = m->execution_engine == ENGINE_JIT;
+
+// Skip the operation if its condition fails, otherwise fall into its body
+#define BEGIN_OP()		d = &op->decoded; if (d->cond != COND_AL && !condition_table[d->cond][evaluate_flags(flags)]) goto *(++op)->label
+#define NEXT_OP()		goto *(++op)->label
+
+	while (m->retired < end && m->stop_reason == STOP_NONE) {
+		if (block->stop != STOP_NONE) {
+			// Single stepping stops at a self branch once it has run it, so it is counted the same
+			if (block->stop == STOP_SELF_BRANCH)
+				m->retired++;
+
+			m->stop_reason = block->stop;
+			break;
+		}
+
+		if (end - m->retired < (uint64_t)block->length &&
+				(m->retired + block->length > m->overrun_limit || end + m->idle_cycles >= m->next_event)) {
+			registers[pc] = block->addr + 8;
+
+			while (m->retired < end && m->stop_reason == STOP_NONE)
+				step(m);
+
+			return m->retired - start;
+		}
+
+		if (block->code != NULL) {
+			int exit = block->code(m);
+
+			if (exit == JIT_EXIT_TAKEN) {
+				m->retired += block->length;
+
+				if (block->loop == LOOP_COUNTDOWN && m->skip_delay_loops)
+					skip_countdown_loop(m, block);
+
+				op = &block->ops[block->length - 1];
+				block = block->taken != NULL ? block->taken : chain_block(m, &block->taken, op->decoded.immediate - 8, labels);
+			} else if (exit == JIT_EXIT_FALLTHROUGH) {
+				m->retired += block->length;
+				uint32_t next = block->addr + block->length * 4;
+				block = block->fallthrough != NULL ? block->fallthrough : chain_block(m, &block->fallthrough, next, labels);
+			} else {
+				// The compiled code stopped before an instruction it can't do, so interpret that one
+				int index = exit - JIT_EXIT_INTERPRET;
+				m->retired += index;
+				registers[pc] = block->ops[index].decoded.addr + 8;
+				step(m);
+				block = find_block(m, registers[pc] - 8, labels);
+			}
+
+			continue;
+		}
+
+		if (++block->executions == m->jit_threshold && jit)
+			block->code = jit_compile(m, block);
+
+		// Only a read of the timer by this pass of a poll loop means it is waiting on the timer
+		if (block->loop == LOOP_POLL)
+			m->timer_read = false;
+
+		op = block->ops;
+		goto *op->label;
+
+	op_mov_immediate:
+		BEGIN_OP();
+		registers[d->rd] = d->immediate;
+
+		if (d->s)
+			set_flags_logical(flags, d->immediate, immediate_carry(d->immediate, d->shift));
+
+		NEXT_OP();
+
+	op_mov_lsl:
+		BEGIN_OP();
+		operand = registers[d->rm];
+		registers[d->rd] = operand << d->shift;
+
+		if (d->s)
+			set_flags_logical(flags, operand << d->shift, lsl_carry(operand, d->shift));
+
+		NEXT_OP();
+
+	op_sub_immediate:
+		BEGIN_OP();
+		operand = registers[d->rn];
+		registers[d->rd] = operand - d->immediate;
+
+		if (d->s)
+			set_flags_sub(flags, operand, d->immediate);
+
+		NEXT_OP();
+
+	op_sub_lsl:
+		BEGIN_OP();
+		operand = registers[d->rm] << d->shift;
+		value = registers[d->rn];
+		registers[d->rd] = value - operand;
+
+		if (d->s)
+			set_flags_sub(flags, value, operand);
+
+		NEXT_OP();
+
+	op_add_immediate:
+		BEGIN_OP();
+		operand = registers[d->rn];
+		registers[d->rd] = operand + d->immediate;
+
+		if (d->s)
+			set_flags_add(flags, operand, d->immediate);
+
+		NEXT_OP();
+
+	op_add_lsl:
+		BEGIN_OP();
+		operand = registers[d->rm] << d->shift;
+		value = registers[d->rn];
+		registers[d->rd] = value + operand;
+
+		if (d->s)
+			set_flags_add(flags, value, operand);
+
+		NEXT_OP();
+
+	op_cmp_immediate:
+		BEGIN_OP();
+		set_flags_sub(flags, registers[d->rn], d->immediate);
+		NEXT_OP();
+
+	op_cmp_lsl:
+		BEGIN_OP();
+		set_flags_sub(flags, registers[d->rn], registers[d->rm] << d->shift);
+		NEXT_OP();
+
+	op_load:
+		BEGIN_OP();
+		registers[d->rd] = block_read_word(m, registers[d->rn] + d->immediate, op - block->ops);
+
+		if (m->stop_reason != STOP_NONE)
+			goto leave_block;
+
+		NEXT_OP();
+
+	op_load_absolute:
+		BEGIN_OP();
+		registers[d->rd] = block_read_word(m, d->immediate, op - block->ops);
+
+		if (m->stop_reason != STOP_NONE)
+			goto leave_block;
+
+		NEXT_OP();
+
+	op_store:
+		BEGIN_OP();
+		flushes = m->flush_count;
+		block_write_word(m, registers[d->rn] + d->immediate, registers[d->rd], op - block->ops);
+
+		// The store hit translated code so this block may no longer exist, or it hit a watchpoint
+		if (flushes != m->flush_count || m->stop_reason != STOP_NONE)
+			goto leave_block;
+
+		NEXT_OP();
+
+	// Carry on from the instruction after the current one, outside of this block
+	leave_block:
+		m->retired += op - block->ops + 1;
+		block = find_block(m, d->addr + 4, labels);
+		continue;
+
+	op_branch:
+		d = &op->decoded;
+		m->retired += block->length;
+
+		if (condition_table[d->cond][evaluate_flags(flags)]) {
+			if (block->loop == LOOP_POLL && m->timer_read) {
+				block->polls_timer = true;
+				skip_poll_loop(m, block);
+			}
+			else if (block->loop == LOOP_COUNTDOWN && m->skip_delay_loops)
+				skip_countdown_loop(m, block);
+
+			block = block->taken != NULL ? block->taken : chain_block(m, &block->taken, d->immediate - 8, labels);
+		} else
+			block = block->fallthrough != NULL ? block->fallthrough : chain_block(m, &block->fallthrough, d->addr + 4, labels);
+
+		continue;
+
+	op_fallthrough:
+		m->retired += block->length;
+		block = block->fallthrough != NULL ? block->fallthrough : chain_block(m, &block->fallthrough, op->decoded.addr, labels);
+		continue;
+
+	// Retired once it has run, as single stepping does, so WFI and peripherals see the same clock
+	op_generic:
+		d = &op->decoded;
+		m->retired += block->length - 1;
+		registers[pc] = d->addr + 8;
+
+		if (!condition_table[d->cond][evaluate_flags(flags)])
+			registers[pc] += 4;
+		else
+			d->handler(m, d);
+
+		m->retired++;
+
+		block = find_block(m, registers[pc] - 8, labels);
+	}
+
+#undef BEGIN_OP
+#undef NEXT_OP
+
+	registers[pc] = block->addr + 8;
+	return m->retired - start;
+}
@@ -0,0 +1,68 @@
+#ifndef __BLOCK_H
+#define __BLOCK_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+// Operations a translated instruction can be bound to
+typedef enum {
+	OP_GENERIC,						// Execute through the decoded handler and leave the block
+	OP_MOV_IMMEDIATE,
+	OP_MOV_LSL,
+	OP_SUB_IMMEDIATE,
+	OP_SUB_LSL,
+	OP_ADD_IMMEDIATE,
+	OP_ADD_LSL,
+	OP_CMP_IMMEDIATE,
+	OP_CMP_LSL,
+	OP_LOAD,
+	OP_LOAD_ABSOLUTE,				// PC relative load with the address folded in at translation
+	OP_STORE,
+	OP_BRANCH,
+	OP_FALLTHROUGH,					// Block was cut short, carry on at the next address
+	NUM_OPS
+} block_op_kind_t;
+
+typedef struct block_op {
+	const void *label;				// Threaded dispatch target
+	block_op_kind_t kind;
+	decoded_instruction_t decoded;
+} block_op_t;
+
+enum {
+	BLOCK_HASH_SIZE  = 4096,
+	BLOCK_ARENA_SIZE = 4 * 1024 * 1024
+};
+
+// Loops the engine can skip the spinning of
+typedef enum {
+	LOOP_NONE,
+	LOOP_POLL,						// Only loads and arithmetic that each pass does afresh, which may be waiting on the timer
+	LOOP_COUNTDOWN					// Only counts a register to a fixed value
+} loop_kind_t;
+
+// Host code compiled from a block.  Returns one of the JIT_EXIT_ values.
+typedef int (*jit_code_t)(machine_t *m);
+
+// A run of guest instructions ending at a branch or a write to the PC
+typedef struct block {
+	uint32_t addr;					// Address of the first instruction
+	int length;
+	uint64_t executions;			// Times it has been interpreted, which is every time unless it is compiled
+	stop_reason_t stop;				// Why the engine must stop before running the block, normally STOP_NONE
+	loop_kind_t loop;				// If it loops back to itself, what the loop does
+	bool polls_timer;				// A poll loop that has read the timer, so is kept interpreted to be skipped
+	jit_code_t code;				// Compiled block, NULL if it is interpreted
+	struct block *taken;			// Chained successor when the final branch is taken
+	struct block *fallthrough;		// Chained successor when it is not
+	struct block *hash_next;
+	block_op_t ops[];
+} block_t;
+
+// Public functions
+extern void init_blocks(machine_t *m);
+extern void free_blocks(machine_t *m);
+extern void invalidate_blocks(machine_t *m, uint32_t addr);
+extern uint64_t run_blocks(machine_t *m, uint64_t max_instructions);
+
+#endif
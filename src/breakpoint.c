@@ -0,0 +1,185 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Breakpoints and watchpoints.
+//
+// Neither costs anything while the guest runs normally.  A breakpoint cuts
+// the translated block it falls in, so the engines only look at the bitmap
+// when they start a block.  A watchpoint traps the page it is on, so only
+// accesses to that page leave the memory fast path.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "block.h"
+#include "breakpoint.h"
+#include "cpu.h"
+#include "machine.h"
+#include "memory.h"
+
+// Returns the word of the bitmap holding the bit for addr, allocating its chunk if asked
+static uint32_t *breakpoint_word(machine_t *m, uint32_t addr, bool allocate) {
+	uint32_t **chunk = &m->breakpoint_chunks[addr >> BREAKPOINT_CHUNK_SHIFT];
+
+	if (*chunk == NULL) {
+		if (!allocate)
+			return NULL;
+
+		*chunk = calloc(BREAKPOINT_CHUNK_WORDS, sizeof(uint32_t));
+	}
+
+	return &(*chunk)[((addr & BREAKPOINT_CHUNK_MASK) >> 2) >> 5];
+}
+
+static uint32_t breakpoint_bit(uint32_t addr) {
+	return 1u << ((addr >> 2) & 31);
+}
+
+void free_breakpoints(machine_t *m) {
+	for (uint32_t chunk = 0; chunk < NUM_BREAKPOINT_CHUNKS; chunk++) {
+		free(m->breakpoint_chunks[chunk]);
+		m->breakpoint_chunks[chunk] = NULL;
+	}
+
+	m->num_breakpoints = 0;
+}
+
+// Returns false if there is already a breakpoint at addr
+bool set_breakpoint(machine_t *m, uint32_t addr) {
+	addr &= ~3;
+
+	if (breakpoint_at(m, addr))
+		return false;
+
+	*breakpoint_word(m, addr, true) |= breakpoint_bit(addr);
+	m->num_breakpoints++;
+
+	// Translated blocks have to be cut at the new breakpoint
+	invalidate_blocks(m, addr);
+	return true;
+}
+
+// Returns false if there wasn't a breakpoint at addr
+bool clear_breakpoint(machine_t *m, uint32_t addr) {
+	addr &= ~3;
+
+	if (!breakpoint_at(m, addr))
+		return false;
+
+	*breakpoint_word(m, addr, false) &= ~breakpoint_bit(addr);
+	m->num_breakpoints--;
+
+	invalidate_blocks(m, addr);
+	return true;
+}
+
+void list_breakpoints(machine_t *m) {
+	if (m->num_breakpoints == 0) {
+		printf("No breakpoints\n");
+		return;
+	}
+
+	for (uint32_t chunk = 0; chunk < NUM_BREAKPOINT_CHUNKS; chunk++) {
+		if (m->breakpoint_chunks[chunk] == NULL)
+			continue;
+
+		for (uint32_t word = 0; word < BREAKPOINT_CHUNK_WORDS; word++) {
+			uint32_t bits = m->breakpoint_chunks[chunk][word];
+
+			for (int bit = 0; bits != 0; bit++, bits >>= 1) {
+				if (bits & 1)
+					printf("Breakpoint at 0x%08x\n", chunk << BREAKPOINT_CHUNK_SHIFT | (word * 32 + bit) << 2);
+			}
+		}
+	}
+}
+
+static watchpoint_t *find_watchpoint(machine_t *m, uint32_t addr) {
+	for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+		if (m->watchpoints[i].kind != 0 && m->watchpoints[i].addr == addr)
+			return &m->watchpoints[i];
+	}
+
+	return NULL;
+}
+
+static bool page_watched(machine_t *m, uint32_t addr) {
+	for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+		if (m->watchpoints[i].kind != 0 && (m->watchpoints[i].addr >> PAGE_SHIFT) == (addr >> PAGE_SHIFT))
+			return true;
+	}
+
+	return false;
+}
+
+// Watches the word at addr.  Returns false if there are no free watchpoints.
+bool set_watchpoint(machine_t *m, uint32_t addr, watch_kind_t kind) {
+	addr &= ~3;
+	watchpoint_t *watchpoint = find_watchpoint(m, addr);
+
+	for (int i = 0; watchpoint == NULL && i < MAX_WATCHPOINTS; i++) {
+		if (m->watchpoints[i].kind == 0)
+			watchpoint = &m->watchpoints[i];
+	}
+
+	if (watchpoint == NULL)
+		return false;
+
+	watchpoint->addr = addr;
+	watchpoint->kind = kind;
+	set_page_trap(m, addr, PAGE_TRAP_WATCH);
+	return true;
+}
+
+// Returns false if the word at addr isn't watched
+bool clear_watchpoint(machine_t *m, uint32_t addr) {
+	addr &= ~3;
+	watchpoint_t *watchpoint = find_watchpoint(m, addr);
+
+	if (watchpoint == NULL)
+		return false;
+
+	watchpoint->kind = 0;
+
+	if (!page_watched(m, addr))
+		clear_page_trap(m, addr, PAGE_TRAP_WATCH);
+
+	return true;
+}
+
+void list_watchpoints(machine_t *m) {
+	static const char *kinds[] = { "", "read", "write", "access" };
+	bool any = false;
+
+	for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+		if (m->watchpoints[i].kind != 0) {
+			printf("Watchpoint on %s of 0x%08x\n", kinds[m->watchpoints[i].kind], m->watchpoints[i].addr);
+			any = true;
+		}
+	}
+
+	if (!any)
+		printf("No watchpoints\n");
+}
+
+// Called by the memory slow path for every access to a watched page.  Execution stops after the
+// instruction making the access.
+void watchpoint_access(machine_t *m, uint32_t addr, uint32_t value, bool write) {
+	watchpoint_t *watchpoint = find_watchpoint(m, addr & ~3);
+
+	if (watchpoint == NULL || (watchpoint->kind & (write ? WATCH_WRITE : WATCH_READ)) == 0)
+		return;
+
+	m->hit_addr = addr;
+	m->hit_value = value;
+	m->hit_write = write;
+	m->stop_reason = STOP_WATCHPOINT;
+}
+
+void print_watchpoint_hit(machine_t *m) {
+	printf("Watchpoint: %s 0x%08x %s 0x%08x\n", m->hit_write ? "wrote" : "read", m->hit_value, m->hit_write ? "to" : "from", m->hit_addr);
+}
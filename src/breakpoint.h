@@ -0,0 +1,44 @@
+#ifndef __BREAKPOINT_H
+#define __BREAKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct machine machine_t;
+
+// Breakpoints are a bitmap with a bit for every word of the address space.  It is split into 64K
+// chunks and only the chunks that have held a breakpoint are allocated.
+enum {
+	BREAKPOINT_CHUNK_SHIFT = 16,
+	BREAKPOINT_CHUNK_MASK  = (1 << BREAKPOINT_CHUNK_SHIFT) - 1,
+	NUM_BREAKPOINT_CHUNKS  = 1 << (32 - BREAKPOINT_CHUNK_SHIFT),
+	BREAKPOINT_CHUNK_WORDS = (1 << BREAKPOINT_CHUNK_SHIFT) / 4 / 32,
+
+	MAX_WATCHPOINTS = 16
+};
+
+// Accesses a watchpoint stops on
+typedef enum {
+	WATCH_READ   = 1,
+	WATCH_WRITE  = 2,
+	WATCH_ACCESS = WATCH_READ | WATCH_WRITE
+} watch_kind_t;
+
+typedef struct watchpoint {
+	uint32_t addr;					// Word watched
+	watch_kind_t kind;				// 0 if the slot is free
+} watchpoint_t;
+
+// Public functions.  breakpoint_at is in machine.h as it needs the bitmap.
+extern void free_breakpoints(machine_t *m);
+extern bool set_breakpoint(machine_t *m, uint32_t addr);
+extern bool clear_breakpoint(machine_t *m, uint32_t addr);
+extern void list_breakpoints(machine_t *m);
+
+extern bool set_watchpoint(machine_t *m, uint32_t addr, watch_kind_t kind);
+extern bool clear_watchpoint(machine_t *m, uint32_t addr);
+extern void list_watchpoints(machine_t *m);
+extern void watchpoint_access(machine_t *m, uint32_t addr, uint32_t value, bool write);
+extern void print_watchpoint_hit(machine_t *m);
+
+#endif
@@ -0,0 +1,303 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Checkpoints for reverse execution.
+//
+// While checkpoints are on every RAM page is write trapped.  The first write
+// to a page after a checkpoint saves what the page held into the checkpoint
+// and drops the trap, so a checkpoint is the machine state when it was taken
+// plus the pages written before the next one.  Going back puts those pages
+// back newest first, loads the state of the checkpoint at or before the target
+// and single steps forward to it.  The machine takes the same path every time
+// it runs forward from the same state, so there is no trace to keep.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "checkpoint.h"
+#include "cpu.h"
+#include "machine.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+struct checkpoint {
+	snapshot_state_t state;
+	uint32_t *pages;				// RAM pages written after the checkpoint, each once
+	uint8_t *contents;				// What they held when it was taken, PAGE_SIZE each
+	int num_pages;
+	int capacity;
+};
+
+// Where a replay would have stopped running forward
+typedef struct stop {
+	stop_reason_t reason;			// STOP_NONE if it wouldn't have
+	uint64_t position;
+	uint32_t hit_addr;				// Watchpoint hit, for STOP_WATCHPOINT
+	uint32_t hit_value;
+	bool hit_write;
+} stop_t;
+
+static size_t checkpoint_size(const checkpoint_t *checkpoint) {
+	return sizeof(checkpoint_t) + (size_t)checkpoint->capacity * (PAGE_SIZE + sizeof(uint32_t));
+}
+
+static void free_checkpoint(checkpoints_t *c, checkpoint_t *checkpoint) {
+	c->used -= checkpoint_size(checkpoint);
+	free(checkpoint->pages);
+	free(checkpoint->contents);
+}
+
+// Going back past the new oldest checkpoint is no longer possible
+static void drop_oldest(checkpoints_t *c) {
+	free_checkpoint(c, &c->list[0]);
+	memmove(c->list, c->list + 1, --c->count * sizeof(checkpoint_t));
+}
+
+// Index of the newest checkpoint at or before position, -1 if there isn't one
+static int checkpoint_at_or_before(const checkpoints_t *c, uint64_t position) {
+	int index = c->count - 1;
+
+	while (index >= 0 && c->list[index].state.retired > position)
+		index--;
+
+	return index;
+}
+
+// Starts tracking writes so the debugger can go back.  A replay is single stepped, which only takes the
+// same path as running forward did if that was single stepped too, so the step engine is switched to.
+// Returns false if the machine talks to the outside world, which a replay can't repeat.
+bool enable_checkpoints(machine_t *m, uint64_t interval, size_t budget) {
+	if (m->vcd != NULL || m->shared_gpio != NULL) {
+		fprintf(stderr, "Reverse execution isn't available while the GPIO is recorded or shared\n");
+		return false;
+	}
+
+	checkpoints_t *c = calloc(1, sizeof(checkpoints_t));
+	c->interval = interval > 0 ? interval : 1;
+	c->budget = budget;
+
+	m->checkpoints = c;
+	m->execution_engine = ENGINE_STEP;
+
+	for (uint32_t addr = 0; addr < RAM_SIZE; addr += PAGE_SIZE)
+		set_page_trap(m, addr, PAGE_TRAP_DIRTY);
+
+	return true;
+}
+
+void free_checkpoints(machine_t *m) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c == NULL)
+		return;
+
+	for (int i = 0; i < c->count; i++)
+		free_checkpoint(c, &c->list[i]);
+
+	for (uint32_t addr = 0; addr < RAM_SIZE; addr += PAGE_SIZE)
+		clear_page_trap(m, addr, PAGE_TRAP_DIRTY);
+
+	free(c->list);
+	free(c);
+	m->checkpoints = NULL;
+}
+
+static void take_checkpoint(machine_t *m) {
+	checkpoints_t *c = m->checkpoints;
+
+	// The pages written since the last checkpoint are tracked again for this one
+	if (c->count > 0) {
+		const checkpoint_t *last = &c->list[c->count - 1];
+
+		for (int i = 0; i < last->num_pages; i++)
+			set_page_trap(m, last->pages[i] << PAGE_SHIFT, PAGE_TRAP_DIRTY);
+	}
+
+	if (c->count == c->capacity) {
+		c->capacity = c->capacity == 0 ? 64 : c->capacity * 2;
+		c->list = realloc(c->list, c->capacity * sizeof(checkpoint_t));
+	}
+
+	checkpoint_t *checkpoint = &c->list[c->count++];
+	memset(checkpoint, 0, sizeof(*checkpoint));
+	save_machine_state(m, &checkpoint->state);
+
+	c->used += checkpoint_size(checkpoint);
+	c->next = m->retired + c->interval;
+
+	while (c->used > c->budget && c->count > 1)
+		drop_oldest(c);
+}
+
+// Takes a checkpoint if one is due.  The debugger calls this between instructions as it runs forward.
+void checkpoint_if_due(machine_t *m) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c != NULL && (c->count == 0 || m->retired >= c->next))
+		take_checkpoint(m);
+}
+
+// Instructions that can be run before checkpoint_if_due has to be called again
+uint64_t instructions_to_checkpoint(machine_t *m) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c == NULL)
+		return UINT64_MAX;
+
+	return m->retired < c->next ? c->next - m->retired : 0;
+}
+
+// Called by the first write to a RAM page since the last checkpoint, before it is made
+void save_written_page(machine_t *m, uint32_t addr) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c == NULL || c->count == 0)
+		return;
+
+	checkpoint_t *checkpoint = &c->list[c->count - 1];
+	uint32_t page = addr >> PAGE_SHIFT;
+
+	if (checkpoint->num_pages == checkpoint->capacity) {
+		c->used -= checkpoint_size(checkpoint);
+		checkpoint->capacity = checkpoint->capacity == 0 ? 16 : checkpoint->capacity * 2;
+		checkpoint->pages = realloc(checkpoint->pages, checkpoint->capacity * sizeof(uint32_t));
+		checkpoint->contents = realloc(checkpoint->contents, (size_t)checkpoint->capacity * PAGE_SIZE);
+		c->used += checkpoint_size(checkpoint);
+	}
+
+	checkpoint->pages[checkpoint->num_pages] = page;
+	memcpy(checkpoint->contents + (size_t)checkpoint->num_pages * PAGE_SIZE, m->ram + (page << PAGE_SHIFT), PAGE_SIZE);
+	checkpoint->num_pages++;
+
+	clear_page_trap(m, addr, PAGE_TRAP_DIRTY);
+}
+
+// Puts the machine back to a checkpoint, which becomes the newest with nothing written since
+static void restore_checkpoint(machine_t *m, int index) {
+	checkpoints_t *c = m->checkpoints;
+
+	for (int i = c->count - 1; i >= index; i--) {
+		checkpoint_t *checkpoint = &c->list[i];
+
+		for (int p = 0; p < checkpoint->num_pages; p++) {
+			uint32_t addr = checkpoint->pages[p] << PAGE_SHIFT;
+
+			memcpy(m->ram + addr, checkpoint->contents + (size_t)p * PAGE_SIZE, PAGE_SIZE);
+			set_page_trap(m, addr, PAGE_TRAP_DIRTY);
+		}
+
+		if (i > index)
+			free_checkpoint(c, checkpoint);
+	}
+
+	c->count = index + 1;
+	c->list[index].num_pages = 0;
+	c->next = c->list[index].state.retired + c->interval;
+
+	load_machine_state(m, &c->list[index].state);
+	flush_decoded_instructions(m);
+	invalidate_blocks(m, 0);
+}
+
+// Single steps to target, taking checkpoints on the way as running forward does.  If stop isn't NULL it
+// gets the last point before target at which running forward would have stopped.
+static void replay(machine_t *m, uint64_t target, stop_t *stop) {
+	while (m->retired < target) {
+		checkpoint_if_due(m);
+
+		if (stop != NULL && breakpoint_at(m, program_counter(m) - 8)) {
+			stop->reason = STOP_BREAKPOINT;
+			stop->position = m->retired;
+		}
+
+		step_traced(m);
+		run_due_events(m);
+
+		if (stop != NULL && m->stop_reason == STOP_WATCHPOINT && m->retired < target) {
+			stop->reason = STOP_WATCHPOINT;
+			stop->position = m->retired;
+			stop->hit_addr = m->hit_addr;
+			stop->hit_value = m->hit_value;
+			stop->hit_write = m->hit_write;
+		}
+
+		m->stop_reason = STOP_NONE;
+	}
+
+	checkpoint_if_due(m);
+}
+
+// Goes back to position, which mustn't be before the oldest checkpoint
+static void go_back_to(machine_t *m, uint64_t position) {
+	restore_checkpoint(m, checkpoint_at_or_before(m->checkpoints, position));
+	replay(m, position, NULL);
+}
+
+// Goes back count instructions, or as far as the oldest checkpoint.  Returns how many it went back.
+uint64_t reverse_step(machine_t *m, uint64_t count) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c == NULL || c->count == 0)
+		return 0;
+
+	uint64_t now = m->retired;
+	uint64_t oldest = c->list[0].state.retired;
+	uint64_t target = now - oldest < count ? oldest : now - count;
+
+	go_back_to(m, target);
+	return now - target;
+}
+
+// Goes back to the last point running forward stopped at a breakpoint or watchpoint, replaying the
+// intervals between checkpoints newest first to find it.  Returns why it stopped there, or STOP_NONE
+// with the machine at the oldest checkpoint if there wasn't one.
+stop_reason_t reverse_continue(machine_t *m) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c == NULL || c->count == 0)
+		return STOP_NONE;
+
+	uint64_t end = m->retired;
+
+	while (c->count > 0 && end > c->list[0].state.retired) {
+		int index = checkpoint_at_or_before(c, end - 1);
+		uint64_t start = c->list[index].state.retired;
+		stop_t stop = { .reason = STOP_NONE };
+
+		restore_checkpoint(m, index);
+		replay(m, end, &stop);
+
+		if (stop.reason != STOP_NONE) {
+			go_back_to(m, stop.position);
+			m->hit_addr = stop.hit_addr;
+			m->hit_value = stop.hit_value;
+			m->hit_write = stop.hit_write;
+			return stop.reason;
+		}
+
+		end = start;
+	}
+
+	restore_checkpoint(m, 0);
+	return STOP_NONE;
+}
+
+void print_checkpoints(machine_t *m) {
+	checkpoints_t *c = m->checkpoints;
+
+	if (c == NULL || c->count == 0) {
+		printf("No checkpoints\n");
+		return;
+	}
+
+	printf("%d checkpoints every %llu instructions back to instruction %llu, %llu KB of %llu KB\n", c->count,
+		(unsigned long long)c->interval, (unsigned long long)c->list[0].state.retired,
+		(unsigned long long)c->used / 1024, (unsigned long long)c->budget / 1024);
+}
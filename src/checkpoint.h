@@ -0,0 +1,38 @@
+#ifndef __CHECKPOINT_H
+#define __CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+typedef struct machine machine_t;
+typedef struct checkpoint checkpoint_t;
+
+enum {
+	DEFAULT_CHECKPOINT_INTERVAL = 100000,				// Instructions
+	DEFAULT_CHECKPOINT_BUDGET = 64 * 1024 * 1024		// Bytes
+};
+
+// The points a debugging session can go back to, oldest first
+typedef struct checkpoints {
+	checkpoint_t *list;
+	int count;
+	int capacity;
+	uint64_t interval;					// Instructions between checkpoints
+	uint64_t next;						// Retired count the next one is taken at
+	size_t budget;						// Bytes the oldest are dropped to stay under
+	size_t used;
+} checkpoints_t;
+
+// Public functions
+extern bool enable_checkpoints(machine_t *m, uint64_t interval, size_t budget);
+extern void free_checkpoints(machine_t *m);
+extern void checkpoint_if_due(machine_t *m);
+extern uint64_t instructions_to_checkpoint(machine_t *m);
+extern void save_written_page(machine_t *m, uint32_t addr);
+extern uint64_t reverse_step(machine_t *m, uint64_t count);
+extern stop_reason_t reverse_continue(machine_t *m);
+extern void print_checkpoints(machine_t *m);
+
+#endif
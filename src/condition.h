@@ -0,0 +1,72 @@
+#ifndef __CONDITION_H
+#define __CONDITION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Condition codes
+enum {
+	COND_EQ = 0,
+	COND_NE = 1,
+	COND_CS = 2,
+	COND_CC = 3,
+	COND_MI = 4,
+	COND_PL = 5,
+	COND_VS = 6,
+	COND_VC = 7,
+	COND_HI = 8,
+	COND_LS = 9,
+	COND_GE = 10,
+	COND_LT = 11,
+	COND_GT = 12,
+	COND_LE = 13,
+	COND_AL = 14,
+	COND_NV = 15,			// Unconditional instruction space on ARMv5 and later
+
+	NUM_CONDITIONS = 16
+};
+
+// Suffixes used by the disassembler.  AL is left blank.
+extern const char *const condition_names[NUM_CONDITIONS];
+
+// Flags out of an NZCV nibble
+#define NZCV_N(nzcv)	((nzcv) >> 3 & 1)
+#define NZCV_Z(nzcv)	((nzcv) >> 2 & 1)
+#define NZCV_C(nzcv)	((nzcv) >> 1 & 1)
+#define NZCV_V(nzcv)	((nzcv) & 1)
+
+#define CONDITION_PASSES(cond, nzcv) ( \
+	(cond) == COND_EQ ? NZCV_Z(nzcv) : \
+	(cond) == COND_NE ? !NZCV_Z(nzcv) : \
+	(cond) == COND_CS ? NZCV_C(nzcv) : \
+	(cond) == COND_CC ? !NZCV_C(nzcv) : \
+	(cond) == COND_MI ? NZCV_N(nzcv) : \
+	(cond) == COND_PL ? !NZCV_N(nzcv) : \
+	(cond) == COND_VS ? NZCV_V(nzcv) : \
+	(cond) == COND_VC ? !NZCV_V(nzcv) : \
+	(cond) == COND_HI ? NZCV_C(nzcv) && !NZCV_Z(nzcv) : \
+	(cond) == COND_LS ? !NZCV_C(nzcv) || NZCV_Z(nzcv) : \
+	(cond) == COND_GE ? NZCV_N(nzcv) == NZCV_V(nzcv) : \
+	(cond) == COND_LT ? NZCV_N(nzcv) != NZCV_V(nzcv) : \
+	(cond) == COND_GT ? !NZCV_Z(nzcv) && NZCV_N(nzcv) == NZCV_V(nzcv) : \
+	(cond) == COND_LE ? NZCV_Z(nzcv) || NZCV_N(nzcv) != NZCV_V(nzcv) : \
+	1)
+
+#define CONDITION_ROW(cond) { \
+	CONDITION_PASSES(cond, 0),  CONDITION_PASSES(cond, 1),  CONDITION_PASSES(cond, 2),  CONDITION_PASSES(cond, 3), \
+	CONDITION_PASSES(cond, 4),  CONDITION_PASSES(cond, 5),  CONDITION_PASSES(cond, 6),  CONDITION_PASSES(cond, 7), \
+	CONDITION_PASSES(cond, 8),  CONDITION_PASSES(cond, 9),  CONDITION_PASSES(cond, 10), CONDITION_PASSES(cond, 11), \
+	CONDITION_PASSES(cond, 12), CONDITION_PASSES(cond, 13), CONDITION_PASSES(cond, 14), CONDITION_PASSES(cond, 15) }
+
+// condition_table[cond][nzcv] is true if an instruction with the condition executes when the flags are nzcv
+static const bool condition_table[NUM_CONDITIONS][16] = {
+	CONDITION_ROW(0),  CONDITION_ROW(1),  CONDITION_ROW(2),  CONDITION_ROW(3),
+	CONDITION_ROW(4),  CONDITION_ROW(5),  CONDITION_ROW(6),  CONDITION_ROW(7),
+	CONDITION_ROW(8),  CONDITION_ROW(9),  CONDITION_ROW(10), CONDITION_ROW(11),
+	CONDITION_ROW(12), CONDITION_ROW(13), CONDITION_ROW(14), CONDITION_ROW(15)
+};
+
+#undef CONDITION_ROW
+#undef CONDITION_PASSES
+
+#endif
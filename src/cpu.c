@@ -9,231 +9,676 @@
 ///////////////////////////////////////
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include "block.h"
+#include "breakpoint.h"
 #include "cpu.h"
+#include "decode.h"
 #include "error.h"
+#include "flags.h"
+#include "machine.h"
 #include "memory.h"
+#include "scheduler.h"
+
+const char *const register_names[16] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc" };
+
+void init_cpu(machine_t *m) {
+	// ARM1176JZF-S starts off in system mode with interrupts disabled.  Z starts off set.
+	m->cpsr = PSR_I | PSR_F | MODE_SYSTEM;
+	m->flags = (lazy_flags_t){ .operation = FLAGS_NZCV, .left = FLAG_Z };
+
+	m->execution_engine = DEFAULT_ENGINE;
+	m->decode_cache_enabled = true;
+	m->skip_delay_loops = false;
+	m->stop_reason = STOP_NONE;
+	m->stop_on_self_branch = false;
+	m->overrun_limit = 0;
+	m->next_event = NO_EVENT;
+}
 
-// Processor modes
-typedef enum {
-	MODE_USER       = 16,
-	MODE_FIQ        = 17,
-	MODE_IRQ        = 18,
-	MODE_SUPERVISOR = 19,
-	MODE_ABORT      = 23,
-	MODE_UNDEFINED  = 27,
-	MODE_SYSTEM     = 31
-} processor_mode_t;
+static processor_mode_t current_mode(machine_t *m) {
+	return m->cpsr & PSR_MODE_MASK;
+}
 
-// ARM1176JZF-S starts off in system mode
-static processor_mode_t mode = MODE_SYSTEM;
+// Returns the bank of the mode or -1 if it isn't a valid mode
+static int mode_bank(uint32_t mode) {
+	switch (mode) {
+		case MODE_USER:
+		case MODE_SYSTEM:
+			return BANK_USER;
 
-// Only 16 visible at any time.  Others are switched based on mode.
-enum { NUM_REGISTERS = 32 };
+		case MODE_FIQ:
+			return BANK_FIQ;
 
-uint32_t registers[NUM_REGISTERS];
+		case MODE_IRQ:
+			return BANK_IRQ;
 
-// CPSR
-static int n_flag = 0;
-static int z_flag = 1;
-static int c_flag = 0;
-static int v_flag = 0;
+		case MODE_SUPERVISOR:
+			return BANK_SUPERVISOR;
 
-static uint32_t read_register(int reg) {
-	assert(0 <= reg && reg <= 15);
+		case MODE_ABORT:
+			return BANK_ABORT;
 
-	if (mode == MODE_USER || mode == MODE_SYSTEM)
-		return registers[reg];
+		case MODE_UNDEFINED:
+			return BANK_UNDEFINED;
 
-	not_implemented(__func__, "Mode %d", mode);
-	return 0;			// Can't get here
+		default:
+			return -1;
+	}
 }
 
-static void write_register(int reg, uint32_t value) {
-	assert(0 <= reg && reg <= 15);
+// Bank that a register is taken from in a mode using the bank
+static int register_bank(int bank, int reg) {
+	return reg < FIRST_BANKED_NOT_FIQ && bank != BANK_FIQ ? BANK_USER : bank;
+}
 
-	if (mode == MODE_USER || mode == MODE_SYSTEM)
-		registers[reg] = value;
-	else
+// Changes mode, swapping in the new mode's banked registers
+static void switch_mode(machine_t *m, uint32_t mode) {
+	int old_bank = mode_bank(current_mode(m));
+	int new_bank = mode_bank(mode);
+
+	if (new_bank < 0)
 		not_implemented(__func__, "Mode %d", mode);
+
+	if (new_bank != old_bank) {
+		for (int reg = FIRST_BANKED; reg < pc; reg++) {
+			int from = register_bank(old_bank, reg);
+			int to = register_bank(new_bank, reg);
+
+			if (from != to) {
+				m->banked_registers[from][reg - FIRST_BANKED] = m->registers[reg];
+				m->registers[reg] = m->banked_registers[to][reg - FIRST_BANKED];
+			}
+		}
+	}
+
+	m->cpsr = (m->cpsr & ~PSR_MODE_MASK) | mode;
+}
+
+static uint32_t read_register(machine_t *m, int reg) {
+	assert(0 <= reg && reg <= 15);
+	return m->registers[reg];
+}
+
+static void write_register(machine_t *m, int reg, uint32_t value) {
+	assert(0 <= reg && reg <= 15);
+	m->registers[reg] = value;
+}
+
+uint32_t read_cpsr(machine_t *m) {
+	return evaluate_flags(&m->flags) << FLAGS_SHIFT | m->cpsr;
+}
+
+// Writes the bytes of the CPSR selected by byte_mask.  Only the flags can be changed in user mode.
+static void write_cpsr(machine_t *m, uint32_t value, uint32_t byte_mask) {
+	if (current_mode(m) == MODE_USER)
+		byte_mask &= PSR_FLAGS_MASK;
+
+	if (byte_mask & PSR_FLAGS_MASK)
+		set_flags_nzcv(&m->flags, value >> FLAGS_SHIFT);
+
+	byte_mask &= ~PSR_FLAGS_MASK;
+	value = (m->cpsr & ~byte_mask) | (value & byte_mask);
+
+	if (value & PSR_T)
+		not_implemented(__func__, "Thumb state");
+
+	switch_mode(m, value & PSR_MODE_MASK);
+	m->cpsr = value;
+}
+
+static uint32_t *current_spsr(machine_t *m) {
+	int bank = mode_bank(current_mode(m));
+
+	if (bank == BANK_USER)
+		not_implemented(__func__, "SPSR in mode %d", current_mode(m));
+
+	return &m->spsr[bank];
+}
+
+// Takes an exception.  The PC is the instruction after the one that caused it plus the pipeline.
+void enter_exception(machine_t *m, exception_t exception) {
+	static const processor_mode_t exception_modes[] = {
+		MODE_SUPERVISOR, MODE_UNDEFINED, MODE_SUPERVISOR, MODE_ABORT, MODE_ABORT, 0, MODE_IRQ, MODE_FIQ
+	};
+
+	uint32_t saved = read_cpsr(m);
+	uint32_t return_addr = m->registers[pc] - (exception == EXCEPTION_DATA_ABORT ? 0 : 4);
+
+	switch_mode(m, exception_modes[exception]);
+	m->spsr[mode_bank(current_mode(m))] = saved;
+	m->cpsr |= PSR_I;
+
+	if (exception == EXCEPTION_RESET || exception == EXCEPTION_FIQ)
+		m->cpsr |= PSR_F;
+
+	// ARMv6 masks imprecise aborts on every exception but the undefined instruction and SWI
+	if (exception != EXCEPTION_UNDEFINED && exception != EXCEPTION_SWI)
+		m->cpsr |= PSR_A;
+
+	m->registers[lr] = return_addr;
+	m->registers[pc] = exception * 4 + 8;				// Low vectors
 }
 
 // Returns the current program counter
-uint32_t program_counter() {
-	return registers[pc];
+uint32_t program_counter(machine_t *m) {
+	return m->registers[pc];
 }
 
 // Sets the program counter to the specified address.
 // NOTE: This should take into account the 8 byte pipeline.
-void set_program_counter(uint32_t addr) {
-	write_register(pc, addr);
+void set_program_counter(machine_t *m, uint32_t addr) {
+	write_register(m, pc, addr);
 }
 
 // Returns the instruction at the current program counter minus the 8 byte pipeline.
-uint32_t fetch_instruction() {
-	return read_word(read_register(pc) - 8);		// 2 instruction pipeline
+uint32_t fetch_instruction(machine_t *m) {
+	return fetch_word(m, read_register(m, pc) - 8);		// 2 instruction pipeline
 }
 
-static void execute_branch(uint32_t instruction) {
-	int l = instruction >> 24 & 1;
-	int signedImmed24 = instruction & 0x00FFFFFF;
+// Move on to the next instruction.  PC is already 8 bytes ahead so just add a word.
+static void advance_program_counter(machine_t *m) {
+	m->registers[pc] += 4;
+}
 
-	uint32_t targetAddress = ((signedImmed24 << 8) >> 6) + read_register(pc) + 8;		// Add extra 2 words for pipeline
+static void execute_branch(machine_t *m, const decoded_instruction_t *decoded) {
+	write_register(m, pc, decoded->immediate);
+}
 
-	if (l == 0)
-		write_register(pc, targetAddress);
+// Writes the result of an instruction to a register.  Writing the PC branches so it is moved on
+// for the pipeline and the caller mustn't advance it.
+static void write_result(machine_t *m, int reg, uint32_t value) {
+	if (reg == pc)
+		write_register(m, pc, value + 8);
 	else
-		not_implemented(__func__, "Branch and link");
-}
-
-static void execute_data_processing(uint32_t instruction) {
-	int i = instruction >> 25 & 1;
-	int opcode = instruction >> 21 & OPCODE_MASK;
-	int s = instruction >> 20 & 1;
-	int rn = instruction >> 16 & REGISTER_MASK;
-	int rd = instruction >> 12 & REGISTER_MASK;
-
-	uint32_t operand;
-
-	if (i == 1) {
-		int rotate = (instruction >> 8 & ROTATE_MASK) << 1;
-		int immediate = instruction & IMMEDIATE_MASK;
-		operand = (immediate >> rotate) | (immediate << (32 - rotate));
-		// TODO: Set carry out
-	} else if ((instruction & DATA_PROCESSING_LSL_MASK) == 0) {
-		int shift = instruction >> 7 & SHIFT_MASK;
-		int rm = instruction & REGISTER_MASK;
-		uint32_t rmValue = read_register(rm);
-		uint32_t rnValue = read_register(rn);
-		operand = rmValue << shift;
-		// TODO: Set carry out
-	} else {
-		not_implemented(__func__, "Data processing instruction");
-	}
+		write_register(m, reg, value);
+}
 
-	switch (opcode) {
+static void execute_not_implemented(machine_t *m, const decoded_instruction_t *decoded) {
+	(void)m;
+	not_implemented(__func__, "Instruction %08x", decoded->instruction);
+}
+
+static void execute_data_processing_operation(machine_t *m, const decoded_instruction_t *decoded, uint32_t operand, int carry) {
+	uint32_t rn = read_register(m, decoded->rn);
+	uint32_t result;
+
+	switch (decoded->opcode) {
 		case OPCODE_SUB:
-			write_register(rd, read_register(rn) - operand);
+			result = rn - operand;
 
-			if (s == 1) {
-				// TODO: Set flags
-				not_implemented(__func__, "Set CPSR");
-			}
+			if (decoded->s == 1)
+				set_flags_sub(&m->flags, rn, operand);
 
 			break;
 
-		case OPCODE_CMP: {
-			int value = read_register(rn) - operand;
-			n_flag = value >> 31;
-			z_flag = value == 0 ? 1 : 0;
+		case OPCODE_ADD:
+			result = rn + operand;
+
+			if (decoded->s == 1)
+				set_flags_add(&m->flags, rn, operand);
 
-			// TODO: Set c and v flags
 			break;
-		}
+
+		case OPCODE_CMP:
+			set_flags_sub(&m->flags, rn, operand);
+			advance_program_counter(m);
+			return;
 
 		case OPCODE_MOV:
-			write_register(rd, operand);
+			result = operand;
 
-			if (s == 1) {
-				// TODO: Set flags
-				not_implemented(__func__, "Set CPSR");
-			}
+			if (decoded->s == 1)
+				set_flags_logical(&m->flags, result, carry);
 
 			break;
 
 		default:
 			not_implemented(__func__, "Opcode");
-			break;
+			return;
+	}
+
+	// Writing the PC with the S bit set returns from an exception
+	if (decoded->s == 1 && decoded->rd == pc)
+		write_cpsr(m, *current_spsr(m), ~0);
+
+	write_result(m, decoded->rd, result);
+
+	if (decoded->rd != pc)
+		advance_program_counter(m);
+}
+
+static void execute_data_processing_immediate(machine_t *m, const decoded_instruction_t *decoded) {
+	execute_data_processing_operation(m, decoded, decoded->immediate, immediate_carry(decoded->immediate, decoded->shift));
+}
+
+static void execute_data_processing_lsl(machine_t *m, const decoded_instruction_t *decoded) {
+	uint32_t rm = read_register(m, decoded->rm);
+	execute_data_processing_operation(m, decoded, rm << decoded->shift, lsl_carry(rm, decoded->shift));
+}
+
+// Reads the CPSR or SPSR into a register
+static void execute_mrs(machine_t *m, const decoded_instruction_t *decoded) {
+	write_register(m, decoded->rd, decoded->s ? *current_spsr(m) : read_cpsr(m));
+	advance_program_counter(m);
+}
+
+// Writes the fields of the CPSR or SPSR selected by the instruction
+static void execute_msr(machine_t *m, const decoded_instruction_t *decoded, uint32_t operand) {
+	uint32_t byte_mask = 0;
+
+	for (int field = 0; field < 4; field++) {
+		if (decoded->opcode >> field & 1)
+			byte_mask |= 0xff << (field * 8);
+	}
+
+	if (decoded->s) {
+		uint32_t *saved = current_spsr(m);
+		*saved = (*saved & ~byte_mask) | (operand & byte_mask);
+	} else
+		write_cpsr(m, operand, byte_mask);
+
+	advance_program_counter(m);
+}
+
+static void execute_msr_immediate(machine_t *m, const decoded_instruction_t *decoded) {
+	execute_msr(m, decoded, decoded->immediate);
+}
+
+static void execute_msr_register(machine_t *m, const decoded_instruction_t *decoded) {
+	execute_msr(m, decoded, read_register(m, decoded->rm));
+}
+
+// NOP, YIELD, WFE, WFI and SEV.  Only WFI does anything: there are no interrupts yet, so the
+// guest waits for the next event.
+static void execute_hint(machine_t *m, const decoded_instruction_t *decoded) {
+	if ((decoded->instruction & IMMEDIATE_MASK) == HINT_WFI)
+		wait_for_interrupt(m);
+
+	advance_program_counter(m);
+}
+
+// Changes the interrupt masks and/or the mode.  Does nothing in user mode.
+static void execute_cps(machine_t *m, const decoded_instruction_t *decoded) {
+	uint32_t instruction = decoded->instruction;
+	int imod = instruction >> 18 & 3;
+	int mmod = instruction >> 17 & 1;
+	uint32_t masks = instruction & (PSR_A | PSR_I | PSR_F);
+
+	if (current_mode(m) != MODE_USER) {
+		uint32_t value = m->cpsr;
+
+		if (imod == 2)
+			value &= ~masks;
+		else if (imod == 3)
+			value |= masks;
+
+		if (mmod == 1)
+			value = (value & ~PSR_MODE_MASK) | (instruction & PSR_MODE_MASK);
+
+		write_cpsr(m, value, ~PSR_FLAGS_MASK);
 	}
+
+	advance_program_counter(m);
+}
+
+static void execute_swi(machine_t *m, const decoded_instruction_t *decoded) {
+	(void)decoded;
+	enter_exception(m, EXCEPTION_SWI);
 }
 
 // TODO: This needs to fully implement TLBs, etc.
-static void execute_load_store_word_or_unsigned_byte(uint32_t instruction) {
-	int i = instruction >> 25 & 1;
+static void execute_load_word(machine_t *m, const decoded_instruction_t *decoded) {
+	write_result(m, decoded->rd, read_word(m, read_register(m, decoded->rn) + decoded->immediate));
+
+	if (decoded->rd != pc)
+		advance_program_counter(m);
+}
+
+static void execute_store_word(machine_t *m, const decoded_instruction_t *decoded) {
+	write_word(m, read_register(m, decoded->rn) + decoded->immediate, read_register(m, decoded->rd));
+	advance_program_counter(m);
+}
+
+static void decode_branch(uint32_t instruction, decoded_instruction_t *decoded) {
+	int signed_immed24 = instruction & 0x00FFFFFF;
+
+	// Target is relative to the PC (addr + 8) and the PC register is kept a further 8 bytes ahead for the pipeline
+	decoded->immediate = ((signed_immed24 << 8) >> 6) + decoded->addr + 16;
+	decoded->type = INSTRUCTION_BRANCH;
+	decoded->handler = execute_branch;
+}
+
+static void decode_data_processing_fields(uint32_t instruction, decoded_instruction_t *decoded) {
+	decoded->opcode = instruction >> 21 & OPCODE_MASK;
+	decoded->s = instruction >> 20 & 1;
+	decoded->rn = instruction >> 16 & REGISTER_MASK;
+	decoded->rd = instruction >> 12 & REGISTER_MASK;
+}
+
+static void decode_rotated_immediate(uint32_t instruction, decoded_instruction_t *decoded) {
+	int rotate = (instruction >> 8 & ROTATE_MASK) << 1;
+	uint32_t immediate = instruction & IMMEDIATE_MASK;
+
+	decode_data_processing_fields(instruction, decoded);
+	decoded->immediate = rotate == 0 ? immediate : (immediate >> rotate) | (immediate << (32 - rotate));
+	decoded->shift = rotate;
+}
+
+static void decode_data_processing_immediate(uint32_t instruction, decoded_instruction_t *decoded) {
+	decode_rotated_immediate(instruction, decoded);
+	decoded->type = INSTRUCTION_DATA_PROCESSING_IMMEDIATE;
+	decoded->handler = execute_data_processing_immediate;
+}
+
+static void decode_data_processing_lsl(uint32_t instruction, decoded_instruction_t *decoded) {
+	decode_data_processing_fields(instruction, decoded);
+	decoded->shift = instruction >> 7 & SHIFT_MASK;
+	decoded->rm = instruction & REGISTER_MASK;
+	decoded->type = INSTRUCTION_DATA_PROCESSING_LSL;
+	decoded->handler = execute_data_processing_lsl;
+}
+
+// MRS and MSR live in the space of the compare instructions without the S bit.  s is the
+// instruction's R bit, set for the SPSR, and MSR keeps its field mask in opcode.
+static void decode_mrs(uint32_t instruction, decoded_instruction_t *decoded) {
+	if ((instruction & MRS_MASK) != MRS)
+		return;
+
+	decode_data_processing_fields(instruction, decoded);
+	decoded->s = instruction >> 22 & 1;
+	decoded->type = INSTRUCTION_MRS;
+	decoded->handler = execute_mrs;
+}
+
+static void decode_msr_fields(uint32_t instruction, decoded_instruction_t *decoded) {
+	decoded->s = instruction >> 22 & 1;
+	decoded->opcode = instruction >> 16 & 15;
+	decoded->rd = 0;
+	decoded->rn = 0;
+	decoded->rm = instruction & REGISTER_MASK;
+	decoded->type = INSTRUCTION_MSR;
+}
+
+static void decode_msr_register(uint32_t instruction, decoded_instruction_t *decoded) {
+	if ((instruction & MSR_REGISTER_MASK) != MSR_REGISTER)
+		return;
+
+	decode_data_processing_fields(instruction, decoded);
+	decode_msr_fields(instruction, decoded);
+	decoded->handler = execute_msr_register;
+}
+
+// MSR immediate without any fields is a hint
+static void decode_msr_immediate(uint32_t instruction, decoded_instruction_t *decoded) {
+	decode_rotated_immediate(instruction, decoded);
+
+	if ((instruction & HINT_MASK) == HINT) {
+		decoded->type = INSTRUCTION_HINT;
+		decoded->handler = execute_hint;
+	} else if ((instruction & MSR_IMMEDIATE_MASK) == MSR_IMMEDIATE) {
+		decode_msr_fields(instruction, decoded);
+		decoded->handler = execute_msr_immediate;
+	}
+}
+
+static void decode_load_store_immediate(uint32_t instruction, decoded_instruction_t *decoded) {
 	int p = instruction >> 24 & 1;
 	int u = instruction >> 23 & 1;
 	int b = instruction >> 22 & 1;
 	int w = instruction >> 21 & 1;
 	int l = instruction >> 20 & 1;
-	int rn = instruction >> 16 & REGISTER_MASK;
-	int rd = instruction >> 12 & REGISTER_MASK;
-	int rm = instruction & REGISTER_MASK;
-	int offset12 = instruction & 0xfff;
-	int shiftImm = instruction >> 7 & 0x1f;
-	int shift = instruction >> 5 & 3;
-
-	uint32_t addr = read_register(rn);
-
-	if (p == 1) {				// Immediate offset
-		if (u == 1)
-			addr += offset12;
-		else
-			addr -= offset12;
-	} else
-		not_implemented(__func__, "p = 0");
+	uint32_t offset12 = instruction & 0xfff;
 
-	if (l == 1) {				// Load
-		if (b == 0)				// Word
-			write_register(rd, read_word(addr));
-		else
-			not_implemented(__func__, "Load, b = 1");
-	} else { 					// Store
-		if (b == 0)				// Word
-			write_word(addr, read_register(rd));
-		else
-			not_implemented(__func__, "Store, b = 1");
+	decoded->rn = instruction >> 16 & REGISTER_MASK;
+	decoded->rd = instruction >> 12 & REGISTER_MASK;
+
+	// Only offset addressing of words without writeback is supported
+	if (p == 0 || w == 1 || b == 1)
+		return;
+
+	decoded->immediate = u == 1 ? offset12 : -offset12;
+	if (l == 1) {
+		decoded->type = INSTRUCTION_LOAD_WORD;
+		decoded->handler = execute_load_word;
+	} else {
+		decoded->type = INSTRUCTION_STORE_WORD;
+		decoded->handler = execute_store_word;
 	}
 }
 
-enum {
-	COND_EQ = 0,
-	COND_NE = 1,
-	COND_AL = 14
+static void decode_swi(uint32_t instruction, decoded_instruction_t *decoded) {
+	(void)instruction;
+	decoded->type = INSTRUCTION_SWI;
+	decoded->handler = execute_swi;
+}
+
+static void decode_cps(uint32_t instruction, decoded_instruction_t *decoded) {
+	(void)instruction;
+	decoded->type = INSTRUCTION_CPS;
+	decoded->handler = execute_cps;
+}
+
+// Decoder of each instruction class.  Classes without one aren't implemented.
+static void (*const class_decoders[NUM_CLASSES])(uint32_t instruction, decoded_instruction_t *decoded) = {
+	[CLASS_MRS]                       = decode_mrs,
+	[CLASS_MSR_REGISTER]              = decode_msr_register,
+	[CLASS_MSR_IMMEDIATE]             = decode_msr_immediate,
+	[CLASS_DATA_PROCESSING_LSL]       = decode_data_processing_lsl,
+	[CLASS_DATA_PROCESSING_IMMEDIATE] = decode_data_processing_immediate,
+	[CLASS_LOAD_STORE_IMMEDIATE]      = decode_load_store_immediate,
+	[CLASS_BRANCH]                    = decode_branch,
+	[CLASS_SWI]                       = decode_swi,
+	[CLASS_CPS]                       = decode_cps
 };
 
-static void execute_instruction(uint32_t instruction) {
-	int cond = instruction >> 28;
-
-	if (cond != COND_AL) {
-		switch (cond) {
-			case COND_EQ:
-				if (z_flag == 0) {
-					write_register(pc, read_register(pc) + 4);
-					return;
-				}
-			
-			case COND_NE:
-				if (z_flag == 1) {
-					write_register(pc, read_register(pc) + 4);
-					return;
-				}
+// Extracts the fields of the instruction at addr and selects the handler that executes it.
+void decode_instruction(uint32_t addr, uint32_t instruction, decoded_instruction_t *decoded) {
+	memset(decoded, 0, sizeof(*decoded));
+	decoded->addr = addr;
+	decoded->instruction = instruction;
+	decoded->cond = instruction >> CONDITION_SHIFT;
+	decoded->type = INSTRUCTION_UNKNOWN;
+	decoded->handler = execute_not_implemented;
+
+	void (*decoder)(uint32_t, decoded_instruction_t *) = class_decoders[instruction_class(instruction)];
+
+	if (decoder != NULL)
+		decoder(instruction, decoded);
+}
+
+// Records that instructions on the page have been decoded or translated, so writes to it are trapped
+void mark_code_page(machine_t *m, uint32_t addr, uint8_t kind) {
+	uint8_t *page = &m->code_pages[addr >> CODE_PAGE_SHIFT];
+
+	if (*page == 0)
+		set_page_trap(m, addr, PAGE_TRAP_CODE);
+
+	*page |= kind;
+}
+
+// Forgets that a kind of decoded copy was made from the page
+void unmark_code_page(machine_t *m, uint32_t addr, uint8_t kind) {
+	uint8_t *page = &m->code_pages[addr >> CODE_PAGE_SHIFT];
+
+	if ((*page & kind) == 0)
+		return;
+
+	*page &= ~kind;
+
+	if (*page == 0)
+		clear_page_trap(m, addr, PAGE_TRAP_CODE);
+}
+
+static decoded_instruction_t *decode_cache_entry(machine_t *m, uint32_t addr) {
+	return &m->decode_cache[(addr >> 2) & (DECODE_CACHE_SIZE - 1)];
+}
+
+void init_decode_cache(machine_t *m) {
+	for (int i = 0; i < DECODE_CACHE_SIZE; i++)
+		m->decode_cache[i].addr = DECODE_CACHE_INVALID;
+}
+
+// Drops every decoded instruction, for when all of memory is replaced
+void flush_decoded_instructions(machine_t *m) {
+	init_decode_cache(m);
+
+	for (uint32_t page = 0; page < NUM_CODE_PAGES; page++)
+		unmark_code_page(m, page << CODE_PAGE_SHIFT, CODE_PAGE_DECODED);
+}
+
+// Called when a page holding code is written so stale decodes of self-modified code are dropped.
+void invalidate_decoded_instruction(machine_t *m, uint32_t addr) {
+	uint8_t page = m->code_pages[addr >> CODE_PAGE_SHIFT];
+
+	if (page == 0)
+		return;
+
+	decoded_instruction_t *entry = decode_cache_entry(m, addr);
+
+	if (entry->addr == (addr & ~3))
+		entry->addr = DECODE_CACHE_INVALID;
+
+	if (page & CODE_PAGE_TRANSLATED)
+		invalidate_blocks(m, addr);
+}
+
+// Returns true if the CPSR flags allow an instruction with the condition to execute
+bool condition_passed(machine_t *m, int cond) {
+	return condition_table[cond][evaluate_flags(&m->flags)];
+}
+
+static void execute_instruction(machine_t *m, const decoded_instruction_t *decoded) {
+	if (decoded->cond != COND_AL && !condition_passed(m, decoded->cond)) {
+		advance_program_counter(m);
+		return;
+	}
+
+	decoded->handler(m, decoded);
+}
+
+// Returns the instruction at addr decoded, from the decode cache if it is enabled and otherwise decoded
+// into scratch
+const decoded_instruction_t *fetch_decoded(machine_t *m, uint32_t addr, decoded_instruction_t *scratch) {
+	if (!m->decode_cache_enabled) {
+		decode_instruction(addr, fetch_word(m, addr), scratch);
+		return scratch;
+	}
+
+	decoded_instruction_t *entry = decode_cache_entry(m, addr);
+
+	if (entry->addr != addr) {
+		decode_instruction(addr, fetch_word(m, addr), entry);
+		mark_code_page(m, addr, CODE_PAGE_DECODED);
+	}
+
+	return entry;
+}
+
+// Executes an instruction fetched from the PC and retires it, even if its condition fails
+void execute_decoded(machine_t *m, const decoded_instruction_t *decoded) {
+	execute_instruction(m, decoded);
+	m->retired++;
+}
+
+// Execute the current instruction and increments the PC.  The instruction is retired even if its
+// condition fails.
+void step(machine_t *m) {
+	decoded_instruction_t scratch;
+	execute_decoded(m, fetch_decoded(m, read_register(m, pc) - 8, &scratch));			// 2 instruction pipeline
+}
+
+bool is_self_branch(const decoded_instruction_t *decoded) {
+	return decoded->type == INSTRUCTION_BRANCH && decoded->cond == COND_AL && decoded->immediate - 8 == decoded->addr;
+}
+
+// Steps like step(), recording the instruction if instructions are traced.  Everything that single
+// steps the machine goes through here so the trace has every instruction executed.
+void step_traced(machine_t *m) {
+	if (m->trace != NULL)
+		trace_step(m);
+	else
+		step(m);
+}
+
+// Single steps until max_instructions have been executed or stop_reason is set
+static void run_steps(machine_t *m, uint64_t max_instructions) {
+	uint64_t end = m->retired + max_instructions;
+
+	while (m->retired < end && m->stop_reason == STOP_NONE) {
+		uint32_t addr = m->registers[pc];
+
+		if (breakpoint_at(m, addr - 8)) {
+			m->stop_reason = STOP_BREAKPOINT;
+			break;
 		}
+
+		step_traced(m);
+
+		if (m->stop_on_self_branch && m->registers[pc] == addr)
+			m->stop_reason = STOP_SELF_BRANCH;
 	}
+}
 
-	if ((instruction & DATA_PROCESSING_MASK) == 0)
-		execute_data_processing(instruction);
-	else if ((instruction & LOAD_STORE_WORD_OR_UNSIGNED_BYTE_MASK) == LOAD_STORE_WORD_OR_UNSIGNED_BYTE)
-		execute_load_store_word_or_unsigned_byte(instruction);
-	else if ((instruction & BRANCH_MASK) == BRANCH) {
-		execute_branch(instruction);
-		return;
-	} else
-		not_implemented(__func__, "Instruction %08x", instruction);
+// Executes max_instructions with the selected engine and returns how many were executed.  Stops
+// early at a breakpoint or after a watchpoint is hit, leaving the reason in stop_reason.
+//
+// The engines are run in slices that end at the next scheduled event, so events are handled here
+// rather than checked for per instruction.  One scheduled while a block runs may be handled up to
+// the end of the block late.
+uint64_t execute(machine_t *m, uint64_t max_instructions) {
+	uint64_t start = m->retired;
+	uint64_t end = start + max_instructions;
+
+	run_due_events(m);
+
+	while (m->retired < end && m->stop_reason == STOP_NONE) {
+		m->slice_end = end;
+
+		if (m->next_event < end + m->idle_cycles)
+			m->slice_end = m->next_event - m->idle_cycles;
+
+		if (m->execution_engine == ENGINE_STEP)
+			run_steps(m, m->slice_end - m->retired);
+		else
+			run_blocks(m, m->slice_end - m->retired);
 
-	write_register(pc, read_register(pc) + 4);
+		if (m->stop_reason == STOP_EVENT)
+			m->stop_reason = STOP_NONE;
+
+		run_due_events(m);
+	}
+
+	m->slice_end = 0;
+	return m->retired - start;
+}
+
+static const char *mode_name(processor_mode_t mode) {
+	switch (mode) {
+		case MODE_USER:			return "usr";
+		case MODE_FIQ:			return "fiq";
+		case MODE_IRQ:			return "irq";
+		case MODE_SUPERVISOR:	return "svc";
+		case MODE_ABORT:		return "abt";
+		case MODE_UNDEFINED:	return "und";
+		case MODE_SYSTEM:		return "sys";
+		default:				return "???";
+	}
 }
 
-// Execute the current instruction and increments the PC
-void step() {
-	uint32_t instruction = fetch_instruction();
-	execute_instruction(instruction);
+const char *current_mode_name(machine_t *m) {
+	return mode_name(current_mode(m));
 }
 
-void print_cpsr() {
-	printf("CPSR: %c%c%c%c\n", n_flag == 0 ? 'n' : 'N', z_flag == 0 ? 'z' : 'Z', c_flag == 0 ? 'c' : 'C', v_flag == 0 ? 'v' : 'V');
+void print_cpsr(machine_t *m) {
+	uint32_t nzcv = evaluate_flags(&m->flags);
+	printf("CPSR: %c%c%c%c %c%c %s\n", nzcv & FLAG_N ? 'N' : 'n', nzcv & FLAG_Z ? 'Z' : 'z', nzcv & FLAG_C ? 'C' : 'c', nzcv & FLAG_V ? 'V' : 'v',
+		m->cpsr & PSR_I ? 'I' : 'i', m->cpsr & PSR_F ? 'F' : 'f', current_mode_name(m));
 }
 
-void print_registers() {
+void print_registers(machine_t *m) {
 	for (int reg = 0; reg < 16; reg++) {
 		printf("%s: ", register_names[reg]);
 
@@ -241,7 +686,7 @@ void print_registers() {
 			printf(" ");
 		}
 
-		printf("0x%08x", read_register(reg));
+		printf("0x%08x", read_register(m, reg));
 
 		if (reg == 3 || reg == 7 || reg == 11 || reg == 15) {
 			printf("\n");
@@ -1,7 +1,11 @@
 #ifndef __CPU_H
 #define __CPU_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "condition.h"
+
+typedef struct machine machine_t;
 
 // Named registers
 typedef enum {
@@ -10,7 +14,7 @@ typedef enum {
 	pc = 15
 } named_register_t;
 
-static char *register_names[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc" };
+extern const char *const register_names[16];
 
 // Instruction masks
 enum {
@@ -32,22 +36,183 @@ enum {
 	LOAD_STORE_WORD_OR_UNSIGNED_BYTE_MASK = 3 << 26,
 
 	BRANCH      = 5 << 25,
-	BRANCH_MASK = 7 << 25
+	BRANCH_MASK = 7 << 25,
+
+	MRS      = 0x010f0000,
+	MRS_MASK = 0x0fbf0fff,
+
+	MSR_IMMEDIATE      = 0x0320f000,
+	MSR_IMMEDIATE_MASK = 0x0fb0f000,
+	MSR_REGISTER       = 0x0120f000,
+	MSR_REGISTER_MASK  = 0x0fb0fff0,
+
+	HINT      = 0x0320f000,			// MSR immediate without any fields
+	HINT_MASK = 0x0fffff00,
+	HINT_WFI  = 3,
+
+	CPS      = 0xf1000000,
+	CPS_MASK = 0xfff1fe20,
+
+	SWI      = 0x0f000000,
+	SWI_MASK = 0x0f000000
+};
+
+// CPSR and SPSR bits below the condition flags
+enum {
+	PSR_MODE_MASK = 0x1f,
+	PSR_T         = 1 << 5,
+	PSR_F         = 1 << 6,
+	PSR_I         = 1 << 7,
+	PSR_A         = 1 << 8,
+
+	PSR_FLAGS_MASK = 0xf0000000
 };
 
 // Data processing opcodes
 enum {
 	OPCODE_SUB = 2,
+	OPCODE_ADD = 4,
 	OPCODE_CMP = 10,
 	OPCODE_MOV = 13
 };
 
+// Kinds of instruction the decoder recognises
+typedef enum {
+	INSTRUCTION_UNKNOWN,
+	INSTRUCTION_DATA_PROCESSING_IMMEDIATE,
+	INSTRUCTION_DATA_PROCESSING_LSL,
+	INSTRUCTION_LOAD_WORD,
+	INSTRUCTION_STORE_WORD,
+	INSTRUCTION_BRANCH,
+	INSTRUCTION_MRS,
+	INSTRUCTION_MSR,
+	INSTRUCTION_HINT,
+	INSTRUCTION_CPS,
+	INSTRUCTION_SWI,
+	NUM_INSTRUCTION_TYPES
+} instruction_type_t;
+
+// Processor modes
+typedef enum {
+	MODE_USER       = 16,
+	MODE_FIQ        = 17,
+	MODE_IRQ        = 18,
+	MODE_SUPERVISOR = 19,
+	MODE_ABORT      = 23,
+	MODE_UNDEFINED  = 27,
+	MODE_SYSTEM     = 31
+} processor_mode_t;
+
+// Exceptions, in the order of their vectors
+typedef enum {
+	EXCEPTION_RESET,
+	EXCEPTION_UNDEFINED,
+	EXCEPTION_SWI,
+	EXCEPTION_PREFETCH_ABORT,
+	EXCEPTION_DATA_ABORT,
+	EXCEPTION_IRQ = 6,
+	EXCEPTION_FIQ
+} exception_t;
+
+// An instruction with its fields already extracted, ready to be executed by its handler
+typedef struct decoded_instruction decoded_instruction_t;
+typedef void (*instruction_handler_t)(machine_t *m, const decoded_instruction_t *decoded);
+
+struct decoded_instruction {
+	uint32_t addr;					// Address the instruction was fetched from
+	uint32_t instruction;
+	instruction_handler_t handler;
+	instruction_type_t type;
+	uint8_t cond;
+	uint8_t opcode;
+	uint8_t s;
+	uint8_t rd;
+	uint8_t rn;
+	uint8_t rm;
+	uint8_t shift;					// LSL amount, or the rotation of an immediate
+	uint32_t immediate;				// Rotated immediate, signed load/store offset or branch target PC
+};
+
+// Execution engines
+typedef enum {
+	ENGINE_STEP,					// Fetch, decode and execute one instruction at a time
+	ENGINE_BLOCKS,					// Threaded basic blocks
+	ENGINE_JIT						// Threaded basic blocks with hot blocks compiled to host code
+} execution_engine_t;
+
+// The JIT only generates x86-64
+#if defined(__x86_64__)
+#define DEFAULT_ENGINE ENGINE_JIT
+#else
+#define DEFAULT_ENGINE ENGINE_BLOCKS
+#endif
+
+// Why the engine stopped before executing all the instructions it was asked to
+typedef enum {
+	STOP_NONE,
+	STOP_BREAKPOINT,				// PC is at a breakpoint that hasn't been executed
+	STOP_WATCHPOINT,				// The last instruction touched a watched word
+	STOP_SELF_BRANCH,				// PC is at a branch to itself
+	STOP_GPIO,						// A GPIO pin was driven to the level being waited for
+	STOP_EVENT						// An event is due.  execute() handles it and carries on.
+} stop_reason_t;
+
+// Register banks.  User and system mode share one.
+typedef enum {
+	BANK_USER,
+	BANK_FIQ,
+	BANK_IRQ,
+	BANK_SUPERVISOR,
+	BANK_ABORT,
+	BANK_UNDEFINED,
+	NUM_BANKS
+} register_bank_t;
+
+enum {
+	NUM_REGISTERS        = 16,		// Visible at any time
+	FIRST_BANKED         = 8,		// FIQ banks r8 to r14, the other modes just sp and lr
+	FIRST_BANKED_NOT_FIQ = sp,
+	NUM_BANKED           = 15 - FIRST_BANKED
+};
+
+// Decoded instruction cache.  Direct mapped on the word address of the instruction.
+enum {
+	DECODE_CACHE_SIZE    = 4096,
+	DECODE_CACHE_INVALID = 1			// Instructions are word aligned so this never matches
+};
+
+// Code page flags
+enum {
+	CODE_PAGE_SHIFT = 12,
+	NUM_CODE_PAGES  = 1 << (32 - CODE_PAGE_SHIFT),
+
+	CODE_PAGE_DECODED    = 1,	// Instructions from the page are in the decode cache
+	CODE_PAGE_TRANSLATED = 2	// Instructions from the page are in translated blocks
+};
+
 // Public functions
-extern uint32_t program_counter();
-extern void set_program_counter(uint32_t addr);
+extern void init_cpu(machine_t *m);
+extern bool condition_passed(machine_t *m, int cond);
+extern bool is_self_branch(const decoded_instruction_t *decoded);
+extern void decode_instruction(uint32_t addr, uint32_t instruction, decoded_instruction_t *decoded);
+extern void init_decode_cache(machine_t *m);
+extern void mark_code_page(machine_t *m, uint32_t addr, uint8_t kind);
+extern void unmark_code_page(machine_t *m, uint32_t addr, uint8_t kind);
+extern void invalidate_decoded_instruction(machine_t *m, uint32_t addr);
+extern void flush_decoded_instructions(machine_t *m);
+
+extern uint32_t program_counter(machine_t *m);
+extern void set_program_counter(machine_t *m, uint32_t addr);
+extern uint32_t read_cpsr(machine_t *m);
+extern const char *current_mode_name(machine_t *m);
+extern void enter_exception(machine_t *m, exception_t exception);
 
-extern void print_cpsr();
-extern void print_registers();
-extern void step();
+extern void print_cpsr(machine_t *m);
+extern void print_registers(machine_t *m);
+extern void step(machine_t *m);
+extern void step_traced(machine_t *m);
+extern const decoded_instruction_t *fetch_decoded(machine_t *m, uint32_t addr, decoded_instruction_t *scratch);
+extern void execute_decoded(machine_t *m, const decoded_instruction_t *decoded);
+extern uint64_t execute(machine_t *m, uint64_t max_instructions);
 
 #endif
\ No newline at end of file
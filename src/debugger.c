@@ -10,72 +10,189 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "breakpoint.h"
+#include "checkpoint.h"
 #include "cpu.h"
 #include "debugger.h"
 #include "disassemble.h"
+#include "machine.h"
+#include "memory.h"
+#include "scheduler.h"
 
 static void display_prompt() {
     printf("> ");
 }
 
-static int step_count = 0;         // -1 means run forever, 0 means break into debugger, > 0 means execute instruction (this will decrement each instruction)
-
 enum { BUFFER_LENGTH = 80 };
 
-static char input_buffer[BUFFER_LENGTH];
-static char previous_input[BUFFER_LENGTH] = "s\n";       // Previous action is to single step
+// A debugging session on one machine
+typedef struct debugger {
+    machine_t *m;
+    int step_count;                         // -1 means run forever, 0 means break into debugger, > 0 means execute instruction (this will decrement each instruction)
+    char input_buffer[BUFFER_LENGTH];
+    char previous_input[BUFFER_LENGTH];
+    bool quit;                              // Setting to true will quit the debugger
+} debugger_t;
+
+// Reads a hex address following a command.  Returns what follows it or NULL if there isn't one.
+static char *parse_address(char *text, uint32_t *addr) {
+    char *end;
+    *addr = strtoul(text, &end, 16);
+    return end == text ? NULL : end;
+}
+
+// b          list breakpoints
+// b <addr>   set a breakpoint
+// bd <addr>  clear a breakpoint
+static void breakpoint_command(machine_t *m, char *input) {
+    bool clear = input[1] == 'd';
+    uint32_t addr;
+
+    if (parse_address(input + (clear ? 2 : 1), &addr) == NULL) {
+        list_breakpoints(m);
+    } else if (clear) {
+        if (!clear_breakpoint(m, addr))
+            printf("No breakpoint at 0x%08x\n", addr);
+    } else if (!set_breakpoint(m, addr))
+        printf("Already a breakpoint at 0x%08x\n", addr);
+}
+
+// w                 list watchpoints
+// w <addr> [r|w|a]  watch reads, writes or both (the default) of a word
+// wd <addr>         clear a watchpoint
+static void watchpoint_command(machine_t *m, char *input) {
+    bool clear = input[1] == 'd';
+    uint32_t addr;
+    char *end = parse_address(input + (clear ? 2 : 1), &addr);
+
+    if (end == NULL) {
+        list_watchpoints(m);
+    } else if (clear) {
+        if (!clear_watchpoint(m, addr))
+            printf("No watchpoint on 0x%08x\n", addr);
+    } else {
+        watch_kind_t kind = WATCH_ACCESS;
+        char *option = end + strspn(end, " \t");
+
+        if (*option == 'r')
+            kind = WATCH_READ;
+        else if (*option == 'w')
+            kind = WATCH_WRITE;
+
+        if (!set_watchpoint(m, addr, kind))
+            printf("No watchpoints left\n");
+    }
+}
+
+// rs [count]  go back an instruction, or count of them
+// rc          go back to where running forward last stopped at a breakpoint or watchpoint
+static void reverse_command(machine_t *m, char *input) {
+    if (m->checkpoints == NULL) {
+        printf("Going back needs checkpoints, see -k\n");
+        return;
+    }
+
+    if (input[1] == 'c') {
+        stop_reason_t reason = reverse_continue(m);
+
+        if (reason == STOP_BREAKPOINT)
+            printf("Breakpoint at 0x%08x\n", program_counter(m) - 8);
+        else if (reason == STOP_WATCHPOINT)
+            print_watchpoint_hit(m);
+        else
+            printf("Back at the oldest checkpoint\n");
+    } else {
+        char *end;
+        uint64_t count = strtoull(input + 2, &end, 10);
+
+        if (end == input + 2 || count == 0)
+            count = 1;
 
-// Setting to true will quit the debugger
-static bool quit = false;
+        if (reverse_step(m, count) < count)
+            printf("Back at the oldest checkpoint\n");
+    }
+}
 
-static void debug () {
-    printf("%s\n", disassemble(program_counter() - 8));
+static void debug(debugger_t *debugger) {
+    machine_t *m = debugger->m;
+    char disassembly[DISASSEMBLY_LENGTH];
+    printf("%s\n", disassemble(m, program_counter(m) - 8, disassembly));
     bool done = false;
 
-    while (!quit && !done) {
+    while (!debugger->quit && !done) {
         display_prompt();
-        fgets(input_buffer, BUFFER_LENGTH, stdin);
+        fgets(debugger->input_buffer, BUFFER_LENGTH, stdin);
 
-        char *input = input_buffer;
+        char *input = debugger->input_buffer;
 
         if (*input == '\n')
-            input = previous_input;
+            input = debugger->previous_input;
 
         switch (*input) {
+            case 'b':
+                breakpoint_command(m, input);
+                break;
+
             case 'c':
-                print_cpsr();
+                print_cpsr(m);
                 break;
 
             case 'g':
-                step_count = -1;
+                debugger->step_count = -1;
+
+                // Move off a breakpoint before running so it doesn't stop straight away
+                if (breakpoint_at(m, program_counter(m) - 8))
+                    step_traced(m);
                 
-                if (previous_input != input)
-                    strcpy(previous_input, input);
+                if (debugger->previous_input != input)
+                    strcpy(debugger->previous_input, input);
 
                 done = true;
                 break;
 
+            case 'k':
+                print_checkpoints(m);
+                break;
+
             case 'l':
-                printf("%s\n", disassemble(program_counter() - 8));
+                printf("%s\n", disassemble(m, program_counter(m) - 8, disassembly));
+                break;
+
+            case 'm':
+                printf("Memory accesses off the fast path: %llu\n", (unsigned long long)slow_accesses(m));
                 break;
 
             case 'q':
-                quit = true;
+                debugger->quit = true;
                 break;
 
             case 'r':
-                print_registers();
+                if (input[1] != 's' && input[1] != 'c') {
+                    print_registers(m);
+                    break;
+                }
+
+                reverse_command(m, input);
+                printf("%s\n", disassemble(m, program_counter(m) - 8, disassembly));
+
+                if (debugger->previous_input != input)
+                    strcpy(debugger->previous_input, input);
+
                 break;
 
             case 's':
-                step_count = 1;
+                debugger->step_count = 1;
 
-                if (previous_input != input)
-                    strcpy(previous_input, input);
+                if (debugger->previous_input != input)
+                    strcpy(debugger->previous_input, input);
 
                 done = true;
                 break;
 
+            case 'w':
+                watchpoint_command(m, input);
+                break;
+
             default:
                 printf("Unknown command: %c\n", *input);
                 break;
@@ -83,18 +200,38 @@ static void debug () {
     }
 }
 
-void run() {
+// Number of instructions to execute between checks when running freely
+enum { RUN_QUANTUM = 1024 * 1024 };
+
+void run(machine_t *m) {
+    debugger_t debugger = { .m = m, .step_count = 0, .previous_input = "s\n", .quit = false };      // Previous action is to single step
+
     while (true) {
-        if (step_count == 0) {
-            debug();
+        checkpoint_if_due(m);
 
-            if (quit)
-                exit(0);
+        if (debugger.step_count == 0) {
+            debug(&debugger);
+
+            if (debugger.quit)
+                return;
+        } else if (debugger.step_count < 0) {
+            uint64_t to_checkpoint = instructions_to_checkpoint(m);
+            execute(m, to_checkpoint < RUN_QUANTUM ? to_checkpoint : RUN_QUANTUM);
         } else {
-            step();
+            step_traced(m);
+            run_due_events(m);
+            debugger.step_count--;
+        }
 
-            if (step_count > 0)
-                step_count--;
+        // Break into the debugger when a breakpoint or watchpoint is hit
+        if (m->stop_reason != STOP_NONE) {
+            if (m->stop_reason == STOP_BREAKPOINT)
+                printf("Breakpoint at 0x%08x\n", program_counter(m) - 8);
+            else
+                print_watchpoint_hit(m);
+
+            m->stop_reason = STOP_NONE;
+            debugger.step_count = 0;
         }
     }
-}
\ No newline at end of file
+}
@@ -1,7 +1,9 @@
 #ifndef __DEBUGGER_H
 #define __DEBUGGER_H
 
+typedef struct machine machine_t;
+
 // Public functions
-extern void run();
+extern void run(machine_t *m);
 
 #endif
\ No newline at end of file
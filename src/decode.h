@@ -0,0 +1,17 @@
+#ifndef __DECODE_H
+#define __DECODE_H
+
+#include <stdint.h>
+#include "condition.h"
+#include "cpu.h"
+#include "decode_table.h"				// Generated from instructions.spec
+
+// Returns the class of the instruction.  Everything but the unconditional space is one table lookup.
+static inline instruction_class_t instruction_class(uint32_t instruction) {
+	if (instruction >> CONDITION_SHIFT == COND_NV)
+		return (instruction & CPS_MASK) == CPS ? CLASS_CPS : CLASS_UNDEFINED;
+
+	return decode_table[(instruction >> 16 & 0xff0) | (instruction >> 4 & 0xf)];
+}
+
+#endif
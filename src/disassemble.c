@@ -4,37 +4,131 @@
 //
 // (c) Mark Jackson	2019
 //
+// Disassembler.
+//
+// Listings of whole images label the functions and branch targets found by
+// the control flow pass.  Large images are split into ranges listed on
+// threads of their own and written out in order.
+//
 ///////////////////////////////////////
 
-#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
+#include "decode.h"
 #include "disassemble.h"
-#include "error.h"
+#include "flow.h"
+#include "machine.h"
 #include "memory.h"
 
-// Buffer for disassembly
-static char buffer[128];
-static char *buf_ptr;
+enum { MIN_WORDS_PER_THREAD = 16 * 1024 };		// Smaller images aren't worth a thread
+
+const char *const condition_names[NUM_CONDITIONS] = { "eq", "ne", "cs", "cc", "mi", "pl", "vs", "vc", "hi", "ls", "ge", "lt", "gt", "le", "  ", "  " };
 
-static char *conditions[] = { "eq", "ne", "cs", "cc", "mi", "pl", "vs", "vc", "hi", "ls", "ge", "lt", "gt", "le", "  ", "  " };
+// A range of an image listed by one thread
+typedef struct listing {
+	const uint32_t *words;
+	uint32_t start;				// Address of words[0]
+	int first;					// Range of words listed
+	int end;
+	const code_map_t *map;
+	char *text;
+	size_t length;
+} listing_t;
 
-static char *condition_string(uint32_t instruction) {
-    return conditions[(instruction >> CONDITION_SHIFT) & CONDITION_MASK];
+static const char *condition_string(uint32_t instruction) {
+    return condition_names[(instruction >> CONDITION_SHIFT) & CONDITION_MASK];
 }
 
-static void disassemble_branch(uint32_t addr, uint32_t instruction) {
-	int l = instruction >> 24 & 1;
+static uint32_t branch_target(uint32_t addr, uint32_t instruction) {
 	int signed_immed24 = instruction & 0x00FFFFFF;
+	return ((signed_immed24 << 8) >> 6) + addr + 8;		// 8 byte pipeline
+}
 
-	uint32_t target_address = ((signed_immed24 << 8) >> 6) + program_counter();
-    sprintf(buf_ptr, "%s%s%s%x", l == 0 ? "b" : "bl", condition_string(instruction), l == 0 ? "     " : "    ", target_address);
+static void disassemble_branch(char *buf_ptr, uint32_t addr, uint32_t instruction) {
+	int l = instruction >> 24 & 1;
+
+    sprintf(buf_ptr, "%s%s%s%x", l == 0 ? "b" : "bl", condition_string(instruction), l == 0 ? "     " : "    ", branch_target(addr, instruction));
+}
+
+static void disassemble_cps(char *buf_ptr, uint32_t instruction) {
+    int imod = instruction >> 18 & 3;
+    int mmod = instruction >> 17 & 1;
+
+    buf_ptr += sprintf(buf_ptr, "%-8s", imod == 2 ? "cpsie" : imod == 3 ? "cpsid" : "cps");
+
+    if (imod >= 2) {
+        if (instruction & PSR_A)
+            *buf_ptr++ = 'a';
+
+        if (instruction & PSR_I)
+            *buf_ptr++ = 'i';
+
+        if (instruction & PSR_F)
+            *buf_ptr++ = 'f';
+
+        if (mmod == 1)
+            buf_ptr += sprintf(buf_ptr, ", ");
+    }
+
+    if (mmod == 1)
+        buf_ptr += sprintf(buf_ptr, "#%d", instruction & PSR_MODE_MASK);
 }
 
 static char *opcodes[] = { "and", "eor", "sub", "rsb", "add", "adc", "sbc", "rsc", "tst", "teq", "cmp", "cmn", "orr", "mov", "bic", "mvn" };
 
-static void disassemble_data_processing(uint32_t instruction) {
+// Returns false if the bits the table doesn't look at aren't those of MRS
+static bool disassemble_mrs(char *buf_ptr, uint32_t instruction) {
+    int rd = instruction >> 12 & REGISTER_MASK;
+
+    if ((instruction & MRS_MASK) != MRS)
+        return false;
+
+    sprintf(buf_ptr, "mrs%s   %s, %s", condition_string(instruction), register_names[rd], (instruction >> 22 & 1) == 0 ? "cpsr" : "spsr");
+    return true;
+}
+
+// MSR immediate without any fields is a hint.  Returns false if it is neither.
+static bool disassemble_msr(char *buf_ptr, uint32_t instruction) {
+    int i = instruction >> 25 & 1;
+
+    if (i == 1 && (instruction & HINT_MASK) == HINT) {
+        static char *hints[] = { "nop", "yield", "wfe", "wfi", "sev" };
+        int hint = instruction & IMMEDIATE_MASK;
+
+        if (hint < 5)
+            sprintf(buf_ptr, "%s%s", hints[hint], condition_string(instruction));
+        else
+            sprintf(buf_ptr, "hint%s  #%d", condition_string(instruction), hint);
+
+        return true;
+    }
+
+    if ((instruction & MSR_IMMEDIATE_MASK) != MSR_IMMEDIATE && (instruction & MSR_REGISTER_MASK) != MSR_REGISTER)
+        return false;
+
+    buf_ptr += sprintf(buf_ptr, "msr%s   %s_", condition_string(instruction), (instruction >> 22 & 1) == 0 ? "cpsr" : "spsr");
+
+    for (int field = 0; field < 4; field++) {
+        if (instruction >> (16 + field) & 1)
+            *buf_ptr++ = "cxsf"[field];
+    }
+
+    if (i == 1) {
+        int rotate = (instruction >> 8 & ROTATE_MASK) << 1;
+        uint32_t immediate = instruction & IMMEDIATE_MASK;
+        buf_ptr += sprintf(buf_ptr, ", #0x%x", rotate == 0 ? immediate : (immediate >> rotate) | (immediate << (32 - rotate)));
+    } else
+        buf_ptr += sprintf(buf_ptr, ", %s", register_names[instruction & REGISTER_MASK]);
+
+    return true;
+}
+
+// Immediate operands and registers shifted left by an immediate
+static void disassemble_data_processing(char *buf_ptr, uint32_t instruction) {
     int i = instruction >> 25 & 1;
 	int opcode = instruction >> 21 & OPCODE_MASK;
 	int s = instruction >> 20 & 1;
@@ -42,7 +136,7 @@ static void disassemble_data_processing(uint32_t instruction) {
 	int rd = instruction >> 12 & REGISTER_MASK;
 
 	if (opcode == OPCODE_MOV) {
-		if (i == 0 && (instruction & DATA_PROCESSING_LSL_MASK) == 0)
+		if (i == 0)
 			strcpy(buf_ptr, "lsl");
 		else
 			strcpy(buf_ptr, "mov");
@@ -73,7 +167,7 @@ static void disassemble_data_processing(uint32_t instruction) {
             buf_ptr += sprintf(buf_ptr, "#%d", operand);
         else
             buf_ptr += sprintf(buf_ptr ,"%s, #%d", register_names[rn], operand);        
-	} else if ((instruction & DATA_PROCESSING_LSL_MASK) == 0) {
+	} else {
 		int shift = instruction >> 7 & SHIFT_MASK;
 		int rm = instruction & REGISTER_MASK;
 
@@ -81,13 +175,11 @@ static void disassemble_data_processing(uint32_t instruction) {
             buf_ptr += sprintf(buf_ptr, "%s, #%d", register_names[rm], shift);
         else
             buf_ptr += sprintf(buf_ptr ,"%s, lsl #%d", register_names[rm], shift);
-	} else {
-		not_implemented(__func__, "Data processing instruction");
 	}
 }
 
-static void disassemble_load_store_word_or_unsigned_byte(uint32_t addr, uint32_t instruction) {
-	int i = (instruction >> 25) & 1;
+// Immediate offsets only
+static void disassemble_load_store_word_or_unsigned_byte(char *buf_ptr, uint32_t addr, uint32_t instruction) {
 	int p = (instruction >> 24) & 1;
 	int u = (instruction >> 23) & 1;
 	int b = (instruction >> 22) & 1;
@@ -95,10 +187,7 @@ static void disassemble_load_store_word_or_unsigned_byte(uint32_t addr, uint32_t
 	int l = (instruction >> 20) & 1;
 	int rn = (instruction >> 16) & REGISTER_MASK;
 	int rd = (instruction >> 12) & REGISTER_MASK;
-	int rm = instruction & REGISTER_MASK;
 	int offset12 = instruction & 0xfff;
-	int shift_imm = (instruction >> 7) & 0x1f;
-	int shift = (instruction >> 5) & 3;
 
     if (l == 1)
         buf_ptr += sprintf(buf_ptr, "ldr%s", condition_string(instruction));
@@ -125,40 +214,144 @@ static void disassemble_load_store_word_or_unsigned_byte(uint32_t addr, uint32_t
     
     buf_ptr += sprintf(buf_ptr, " %s, ", register_names[rd]);
 
-    if (i == 0) {
-        buf_ptr += sprintf(buf_ptr, "[%s, #", register_names[rn]);
-
-        if (u == 0) {
-            buf_ptr += sprintf(buf_ptr, "-%d]", offset12);
-            addr -= offset12;
-        } else {
-            buf_ptr += sprintf(buf_ptr, "%d]", offset12);
-            addr += offset12;
-        }
+    buf_ptr += sprintf(buf_ptr, "[%s, #", register_names[rn]);
 
-        if (rn == pc)
-            buf_ptr += sprintf(buf_ptr, "   ; %x", addr + 8);           // 8 byte pipeline
-        else if (offset12 > 15)
-            buf_ptr += sprintf(buf_ptr, "   ; 0x%x", offset12); 
+    if (u == 0) {
+        buf_ptr += sprintf(buf_ptr, "-%d]", offset12);
+        addr -= offset12;
     } else {
-        not_implemented(__func__, "i == 1");
-        assert(0);
+        buf_ptr += sprintf(buf_ptr, "%d]", offset12);
+        addr += offset12;
     }
+
+    if (rn == pc)
+        buf_ptr += sprintf(buf_ptr, "   ; %x", addr + 8);           // 8 byte pipeline
+    else if (offset12 > 15)
+        buf_ptr += sprintf(buf_ptr, "   ; 0x%x", offset12); 
 }
 
-char *disassemble(uint32_t addr) {
-    uint32_t instruction = read_word(addr);
+// Disassembles the instruction into buffer, which must hold DISASSEMBLY_LENGTH characters.  addr is
+// only used for PC relative operands.  Nothing is shared between calls so any thread can use it, and
+// anything it can't print is shown as a .word.
+char *disassemble_instruction(uint32_t addr, uint32_t instruction, char *buffer) {
     sprintf(buffer, "%8x:  %08x  ", addr, instruction);
-    buf_ptr = buffer + 21;  // Length of above string
-
-    if ((instruction & DATA_PROCESSING_MASK) == 0)
-        disassemble_data_processing(instruction);
-    else if ((instruction & LOAD_STORE_WORD_OR_UNSIGNED_BYTE_MASK) == LOAD_STORE_WORD_OR_UNSIGNED_BYTE)
-        disassemble_load_store_word_or_unsigned_byte(addr, instruction);
-    else if ((instruction & BRANCH_MASK) == BRANCH)
-        disassemble_branch(addr, instruction);
-    else
+    char *buf_ptr = buffer + 21;  // Length of above string
+    bool printed = true;
+
+    switch (instruction_class(instruction)) {
+        case CLASS_CPS:
+            disassemble_cps(buf_ptr, instruction);
+            break;
+
+        case CLASS_MRS:
+            printed = disassemble_mrs(buf_ptr, instruction);
+            break;
+
+        case CLASS_MSR_REGISTER:
+        case CLASS_MSR_IMMEDIATE:
+            printed = disassemble_msr(buf_ptr, instruction);
+            break;
+
+        case CLASS_DATA_PROCESSING_LSL:
+        case CLASS_DATA_PROCESSING_IMMEDIATE:
+            disassemble_data_processing(buf_ptr, instruction);
+            break;
+
+        case CLASS_LOAD_STORE_IMMEDIATE:
+            disassemble_load_store_word_or_unsigned_byte(buf_ptr, addr, instruction);
+            break;
+
+        case CLASS_BRANCH:
+        case CLASS_BRANCH_LINK:
+            disassemble_branch(buf_ptr, addr, instruction);
+            break;
+
+        case CLASS_SWI:
+            sprintf(buf_ptr, "swi%s   0x%x", condition_string(instruction), instruction & 0x00ffffff);
+            break;
+
+        default:
+            printed = false;
+            break;
+    }
+
+    if (!printed)
         sprintf(buf_ptr, ".word   0x%08x", instruction);
 
     return buffer;
 }
+
+// Disassembles the instruction at addr in the machine's memory
+char *disassemble(machine_t *m, uint32_t addr, char *buffer) {
+    return disassemble_instruction(addr, fetch_word(m, addr), buffer);
+}
+
+static void *list_words(void *arg) {
+	listing_t *listing = arg;
+	FILE *f = open_memstream(&listing->text, &listing->length);
+	char disassembly[DISASSEMBLY_LENGTH];
+	char label[CODE_LABEL_LENGTH];
+
+	for (int i = listing->first; i < listing->end; i++) {
+		uint32_t addr = listing->start + i * 4;
+		uint32_t instruction = listing->words[i];
+		int code = code_at(listing->map, addr);
+
+		if (code_label(listing->map, addr, label))
+			fprintf(f, "%s%s:\n", (code & CODE_FUNCTION) != 0 ? "\n" : "", label);
+
+		fputs(disassemble_instruction(addr, instruction, disassembly), f);
+
+		instruction_class_t class = instruction_class(instruction);
+
+		if ((code & CODE_INSTRUCTION) != 0 && (class == CLASS_BRANCH || class == CLASS_BRANCH_LINK) &&
+			code_label(listing->map, branch_target(addr, instruction), label))
+			fprintf(f, "   ; %s", label);
+
+		fputc('\n', f);
+	}
+
+	fclose(f);
+	return NULL;
+}
+
+// Writes a listing of the image of num_words words at start to f, labelled from the map.  Images large
+// enough are split across up to num_threads threads.
+void disassemble_image(FILE *f, const uint32_t *words, uint32_t start, int num_words, const code_map_t *map, int num_threads) {
+	int num_listings = num_words / MIN_WORDS_PER_THREAD;
+
+	if (num_listings > num_threads)
+		num_listings = num_threads;
+
+	if (num_listings < 1)
+		num_listings = 1;
+
+	listing_t *listings = calloc(num_listings, sizeof(listing_t));
+	pthread_t *threads = malloc(num_listings * sizeof(pthread_t));
+
+	for (int i = 0; i < num_listings; i++) {
+		listing_t *listing = &listings[i];
+		listing->words = words;
+		listing->start = start;
+		listing->first = (int64_t)num_words * i / num_listings;
+		listing->end = (int64_t)num_words * (i + 1) / num_listings;
+		listing->map = map;
+
+		// This thread lists the first range itself
+		if (i > 0)
+			pthread_create(&threads[i], NULL, list_words, listing);
+	}
+
+	list_words(&listings[0]);
+
+	for (int i = 0; i < num_listings; i++) {
+		if (i > 0)
+			pthread_join(threads[i], NULL);
+
+		fwrite(listings[i].text, 1, listings[i].length, f);
+		free(listings[i].text);
+	}
+
+	free(threads);
+	free(listings);
+}
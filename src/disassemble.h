@@ -2,8 +2,17 @@
 #define __DISASSEMBLE_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include "flow.h"
+
+typedef struct machine machine_t;
+
+// Room for one line of disassembly
+enum { DISASSEMBLY_LENGTH = 128 };
 
 // public functions
-extern char *disassemble(uint32_t addr);
+extern char *disassemble_instruction(uint32_t addr, uint32_t instruction, char *buffer);
+extern char *disassemble(machine_t *m, uint32_t addr, char *buffer);
+extern void disassemble_image(FILE *f, const uint32_t *words, uint32_t start, int num_words, const code_map_t *map, int num_threads);
 
 #endif
\ No newline at end of file
@@ -6,9 +6,22 @@
 //
 ///////////////////////////////////////
 
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "error.h"
+
+// Where the thread goes when it hits something that isn't implemented.  NULL exits the process.
+static __thread jmp_buf *error_handler = NULL;
+
+// Has errors on this thread longjmp to the handler rather than exit, so one of many machines can fail on its own.
+// Returns the handler it replaces so it can be put back.
+jmp_buf *set_error_handler(jmp_buf *handler) {
+    jmp_buf *previous = error_handler;
+    error_handler = handler;
+    return previous;
+}
 
 void not_implemented(const char *fn, char *msg, ...) {
     va_list ap;
@@ -17,5 +30,9 @@ void not_implemented(const char *fn, char *msg, ...) {
     vfprintf(stderr, msg, ap);
     va_end(ap);
     fprintf(stderr, " not implemented.\n");
+
+    if (error_handler != NULL)
+        longjmp(*error_handler, 1);
+
     exit(1);
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #ifndef __ERROR_H
 #define __ERROR_H
 
+#include <setjmp.h>
+
 // Public functions
-extern void not_implemented(const char *fn, char *msg, ...);
+extern jmp_buf *set_error_handler(jmp_buf *handler);
+extern void not_implemented(const char *fn, char *msg, ...) __attribute__((noreturn));
 
 #endif
\ No newline at end of file
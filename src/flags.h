@@ -0,0 +1,133 @@
+#ifndef __FLAGS_H
+#define __FLAGS_H
+
+#include <stdint.h>
+
+// Lazily evaluated CPSR condition flags.
+//
+// Instructions that set the flags only record the operation and its operands.  N, Z, C and V are
+// worked out from the record when a condition, MRS or the debugger asks for them.  A logical
+// operation keeps V, and sometimes C, so it moves the record before it aside rather than working
+// the old flags out.
+
+typedef enum {
+	FLAGS_NZCV,			// left holds the NZCV nibble itself
+	FLAGS_ADD,			// Result of left + right
+	FLAGS_SUB,			// Result of left - right
+	FLAGS_LOGICAL		// left is the result, right the shifter carry or FLAGS_CARRY_KEPT
+} flags_operation_t;
+
+typedef struct {
+	uint32_t operation;
+	uint32_t left;
+	uint32_t right;
+	uint32_t cv_operation;		// For FLAGS_LOGICAL, the record V and a kept C come from
+	uint32_t cv_left;
+	uint32_t cv_right;
+} lazy_flags_t;
+
+// Bits of the NZCV nibble
+enum {
+	FLAG_N = 8,
+	FLAG_Z = 4,
+	FLAG_C = 2,
+	FLAG_V = 1,
+
+	FLAGS_SHIFT = 28,	// Position of the nibble in the CPSR
+
+	FLAGS_CARRY_KEPT = 2	// A logical operation's right when the shifter left C alone
+};
+
+static inline uint32_t result_flags(uint32_t result) {
+	return (result >> 31) * FLAG_N | (result == 0) * FLAG_Z;
+}
+
+// Works out the NZCV nibble from an arithmetic operation or the nibble itself
+static inline uint32_t operation_flags(uint32_t operation, uint32_t left, uint32_t right) {
+	uint32_t result;
+
+	switch (operation) {
+		case FLAGS_ADD:
+			result = left + right;
+			return result_flags(result) | (result < left) * FLAG_C | ((~(left ^ right) & (left ^ result)) >> 31) * FLAG_V;
+
+		case FLAGS_SUB:
+			result = left - right;
+			return result_flags(result) | (left >= right) * FLAG_C | (((left ^ right) & (left ^ result)) >> 31) * FLAG_V;
+
+		default:
+			return left;
+	}
+}
+
+// Works out the NZCV nibble from the recorded operation
+static inline uint32_t compute_flags(const lazy_flags_t *flags) {
+	if (flags->operation != FLAGS_LOGICAL)
+		return operation_flags(flags->operation, flags->left, flags->right);
+
+	uint32_t cv = operation_flags(flags->cv_operation, flags->cv_left, flags->cv_right);
+
+	if (flags->right == FLAGS_CARRY_KEPT)
+		cv &= FLAG_C | FLAG_V;
+	else
+		cv = (cv & FLAG_V) | flags->right * FLAG_C;
+
+	return result_flags(flags->left) | cv;
+}
+
+// Returns the NZCV nibble.  It is kept so further reads before the next flag setting operation are a single load.
+static inline uint32_t evaluate_flags(lazy_flags_t *flags) {
+	if (flags->operation == FLAGS_NZCV)
+		return flags->left;
+
+	uint32_t nzcv = compute_flags(flags);
+	flags->operation = FLAGS_NZCV;
+	flags->left = nzcv;
+	return nzcv;
+}
+
+static inline void set_flags_nzcv(lazy_flags_t *flags, uint32_t nzcv) {
+	flags->operation = FLAGS_NZCV;
+	flags->left = nzcv;
+}
+
+static inline void set_flags_add(lazy_flags_t *flags, uint32_t left, uint32_t right) {
+	flags->operation = FLAGS_ADD;
+	flags->left = left;
+	flags->right = right;
+}
+
+static inline void set_flags_sub(lazy_flags_t *flags, uint32_t left, uint32_t right) {
+	flags->operation = FLAGS_SUB;
+	flags->left = left;
+	flags->right = right;
+}
+
+// Logical operations set N and Z from the result and C from the shifter.  A carry of -1 leaves C alone.  V is never changed.
+// After another logical operation the record C and V come from is already set aside.
+static inline void set_flags_logical(lazy_flags_t *flags, uint32_t result, int carry) {
+	if (flags->operation != FLAGS_LOGICAL) {
+		flags->cv_operation = flags->operation;
+		flags->cv_left = flags->left;
+		flags->cv_right = flags->right;
+		flags->operation = FLAGS_LOGICAL;
+		flags->right = FLAGS_CARRY_KEPT;
+	}
+
+	flags->left = result;
+
+	if (carry >= 0)
+		flags->right = carry;
+}
+
+// Shifter carry out of a rotated immediate, -1 if it isn't rotated
+static inline int immediate_carry(uint32_t immediate, int rotate) {
+	return rotate == 0 ? -1 : (int)(immediate >> 31);
+}
+
+// Shifter carry out of LSL by an immediate, -1 for a shift of zero
+static inline int lsl_carry(uint32_t value, int shift) {
+	return shift == 0 ? -1 : (int)(value >> (32 - shift) & 1);
+}
+
+#endif
@@ -0,0 +1,221 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Control flow recovery.
+//
+// The code of an image is found by recursive descent from its entry point:
+// each path is followed until an unconditional branch or write to the PC,
+// and the targets of branches are queued to be followed in turn.  Words that
+// are never reached are left as data.  The basic blocks found are labelled in
+// the disassembly and translated by the block engine before the image runs.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "decode.h"
+#include "flow.h"
+#include "machine.h"
+
+enum {
+	LOAD = 1 << 20,
+
+	OPCODE_TST = 8,
+	OPCODE_CMN = 11
+};
+
+// Index of the word at addr, or -1 if it is outside the image
+static int word_index(const code_map_t *map, uint32_t addr) {
+	uint32_t offset = addr - map->start;
+
+	if ((addr & 3) != 0 || offset >= (uint32_t)map->num_words * 4)
+		return -1;
+
+	return offset / 4;
+}
+
+static uint32_t branch_target(uint32_t addr, uint32_t instruction) {
+	int32_t signed_immed24 = instruction & 0x00ffffff;
+	return ((signed_immed24 << 8) >> 6) + addr + 8;					// 8 byte pipeline
+}
+
+// Includes the forms the CPU doesn't run yet, as real images are full of them
+static bool writes_pc(uint32_t instruction) {
+	int rd = instruction >> 12 & REGISTER_MASK;
+	int opcode = instruction >> 21 & OPCODE_MASK;
+
+	switch (instruction_class(instruction)) {
+		case CLASS_BX:
+			return true;
+
+		case CLASS_DATA_PROCESSING_LSL:
+		case CLASS_DATA_PROCESSING_SHIFT:
+		case CLASS_DATA_PROCESSING_REGISTER_SHIFT:
+		case CLASS_DATA_PROCESSING_IMMEDIATE:
+			return rd == pc && (opcode < OPCODE_TST || opcode > OPCODE_CMN);
+
+		case CLASS_LOAD_STORE_IMMEDIATE:
+		case CLASS_LOAD_STORE_REGISTER:
+			return (instruction & LOAD) != 0 && rd == pc;
+
+		case CLASS_LOAD_STORE_MULTIPLE:
+			return (instruction & LOAD) != 0 && (instruction >> pc & 1);
+
+		default:
+			return false;
+	}
+}
+
+// Marks the target of a branch and returns its index if it still has to be followed, otherwise -1
+static int mark_target(code_map_t *map, uint32_t target, bool call) {
+	int index = word_index(map, target);
+
+	if (index < 0)
+		return -1;
+
+	map->words[index] |= CODE_BLOCK_START | (call ? CODE_FUNCTION : CODE_TARGET);
+	return (map->words[index] & CODE_INSTRUCTION) == 0 ? index : -1;
+}
+
+// Follows every path from the entry point.  Each instruction queues at most one target so the queue
+// never holds more than one entry per word plus the entry point.
+static void follow_code(code_map_t *map, const uint32_t *words, int entry) {
+	int *queue = malloc((map->num_words + 1) * sizeof(int));
+	int queued = 0;
+
+	queue[queued++] = entry;
+
+	while (queued > 0) {
+		int index = queue[--queued];
+
+		while (index < map->num_words && (map->words[index] & CODE_INSTRUCTION) == 0) {
+			uint32_t instruction = words[index];
+			uint32_t addr = map->start + index * 4;
+			instruction_class_t class = instruction_class(instruction);
+			bool always = instruction >> CONDITION_SHIFT == COND_AL;
+
+			map->words[index] |= CODE_INSTRUCTION;
+
+			if (class == CLASS_BRANCH || class == CLASS_BRANCH_LINK) {
+				bool call = class == CLASS_BRANCH_LINK;
+				int target = mark_target(map, branch_target(addr, instruction), call);
+
+				if (target >= 0)
+					queue[queued++] = target;
+
+				// Calls return, so only a plain unconditional branch ends the path
+				map->words[index] |= CODE_BLOCK_END;
+
+				if (always && !call)
+					break;
+			} else if (writes_pc(instruction)) {
+				map->words[index] |= CODE_BLOCK_END;
+
+				if (always)
+					break;
+			}
+
+			if ((map->words[index] & CODE_BLOCK_END) != 0 && index + 1 < map->num_words)
+				map->words[index + 1] |= CODE_BLOCK_START;
+
+			index++;
+		}
+	}
+
+	free(queue);
+}
+
+// Splits the code into basic blocks.  A block starts at a target, after a block end or after data.
+static void find_blocks(code_map_t *map) {
+	int capacity = 64;
+
+	map->blocks = malloc(capacity * sizeof(code_block_t));
+
+	for (int index = 0; index < map->num_words; index++) {
+		uint8_t *word = &map->words[index];
+
+		if ((*word & CODE_INSTRUCTION) == 0)
+			continue;
+
+		if (index == 0 || (word[-1] & (CODE_INSTRUCTION | CODE_BLOCK_END)) != CODE_INSTRUCTION)
+			*word |= CODE_BLOCK_START;
+
+		if ((*word & CODE_FUNCTION) != 0)
+			map->num_functions++;
+
+		if ((*word & CODE_BLOCK_START) != 0) {
+			if (map->num_blocks == capacity) {
+				capacity *= 2;
+				map->blocks = realloc(map->blocks, capacity * sizeof(code_block_t));
+			}
+
+			map->blocks[map->num_blocks].addr = map->start + index * 4;
+			map->blocks[map->num_blocks].length = 0;
+			map->num_blocks++;
+		}
+
+		map->blocks[map->num_blocks - 1].length++;
+	}
+}
+
+// Finds the code in the image of num_words words at start by following it from entry.  The words are only
+// read, so any number of threads can map the same image at once.
+code_map_t *map_code(const uint32_t *words, uint32_t start, int num_words, uint32_t entry) {
+	code_map_t *map = calloc(1, sizeof(code_map_t));
+
+	map->start = start;
+	map->num_words = num_words;
+	map->words = calloc(num_words > 0 ? num_words : 1, sizeof(uint8_t));
+
+	int index = word_index(map, entry);
+
+	if (index >= 0) {
+		map->words[index] |= CODE_BLOCK_START | CODE_FUNCTION;
+		follow_code(map, words, index);
+	}
+
+	find_blocks(map);
+	return map;
+}
+
+void free_code_map(code_map_t *map) {
+	if (map == NULL)
+		return;
+
+	free(map->words);
+	free(map->blocks);
+	free(map);
+}
+
+// Returns the CODE_ bits of the word at addr, 0 if it is data or outside the image
+int code_at(const code_map_t *map, uint32_t addr) {
+	int index = word_index(map, addr);
+	return index < 0 ? 0 : map->words[index];
+}
+
+// Writes the label of addr, which must hold CODE_LABEL_LENGTH characters.  Returns false if addr isn't
+// the start of a function or a branch target.
+bool code_label(const code_map_t *map, uint32_t addr, char *label) {
+	int code = code_at(map, addr);
+
+	if ((code & CODE_FUNCTION) != 0)
+		sprintf(label, "sub_%x", addr);
+	else if ((code & CODE_TARGET) != 0)
+		sprintf(label, "loc_%x", addr);
+	else
+		return false;
+
+	return true;
+}
+
+// Maps the code just loaded at start, which is also the entry point, for the block engine to translate
+// before it runs anything
+void map_loaded_code(machine_t *m, uint32_t start, int num_words) {
+	free_code_map(m->code_map);
+	m->code_map = map_code((const uint32_t *)(m->ram + start), start, num_words, start);
+	m->code_map_translated = false;
+}
@@ -0,0 +1,42 @@
+#ifndef __FLOW_H
+#define __FLOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct machine machine_t;
+
+// What the control flow pass found at each word of an image
+enum {
+	CODE_INSTRUCTION = 1,			// Reached by following the code from the entry point
+	CODE_BLOCK_START = 2,
+	CODE_BLOCK_END   = 4,			// Branches or writes the PC
+	CODE_TARGET      = 8,			// Branched to
+	CODE_FUNCTION    = 16,			// Called with BL, or the entry point
+
+	CODE_LABEL_LENGTH = 16			// Room for a label and its terminator
+};
+
+// A basic block of the image
+typedef struct code_block {
+	uint32_t addr;
+	int length;						// Instructions
+} code_block_t;
+
+typedef struct code_map {
+	uint32_t start;					// Address of the first word of the image
+	int num_words;
+	uint8_t *words;					// CODE_ bits of every word
+	code_block_t *blocks;			// In address order
+	int num_blocks;
+	int num_functions;
+} code_map_t;
+
+// Public functions
+extern code_map_t *map_code(const uint32_t *words, uint32_t start, int num_words, uint32_t entry);
+extern void free_code_map(code_map_t *map);
+extern int code_at(const code_map_t *map, uint32_t addr);
+extern bool code_label(const code_map_t *map, uint32_t addr, char *label);
+extern void map_loaded_code(machine_t *m, uint32_t start, int num_words);
+
+#endif
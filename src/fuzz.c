@@ -0,0 +1,577 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Fuzzes an engine against single stepping with random instruction sequences.
+//
+// Each sequence is a random mix of the instructions the emulator implements,
+// weighted towards the cases the engines treat specially: loads and stores,
+// predicated and flag setting instructions, forward branches, mode and flag
+// changes, countdown loops the engines skip, and stores over the sequence's
+// own code.  It ends in a branch back to its start so it loops until its
+// instruction budget is spent.  The sequence runs in lockstep on a machine
+// using the engine under test and on a reference machine that single steps,
+// compared every instruction, every few or only at the end.  Everything about
+// a sequence comes from the seed and its index, so a divergence can be run
+// again on its own with -k.
+//
+///////////////////////////////////////
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "disassemble.h"
+#include "lockstep.h"
+#include "machine.h"
+#include "memory.h"
+
+enum {
+	FUZZ_CODE       = 0x100000,		// First of the pages sequences are written to in turn
+	FUZZ_CODE_SLOTS = 256,
+	FUZZ_DATA       = 0x80000,		// Page of random words the loads and stores use
+
+	DATA_BASE = 12,					// Register pointing at the middle of the data page
+	CODE_BASE = 11,					// Register pointing at the sequence
+	PATCH     = 10,					// Register holding an instruction to store over the sequence
+
+	DEFAULT_SEQUENCES = 1000000,
+	DEFAULT_LENGTH    = 32,
+	MAX_LENGTH        = 256,
+	DEFAULT_BUDGET    = 256			// Instructions each sequence runs for
+};
+
+static const char *engine_names[] = { "step", "blocks", "jit" };
+
+static const uint32_t modes[] = { MODE_USER, MODE_FIQ, MODE_IRQ, MODE_SUPERVISOR, MODE_ABORT, MODE_UNDEFINED, MODE_SYSTEM };
+
+// Values that are more likely to find a mistake with the flags than any others
+static const uint32_t edge_values[] = { 0, 1, 2, 0x7fffffff, 0x80000000, 0x80000001, 0xfffffffe, 0xffffffff };
+
+typedef struct sequence {
+	uint64_t index;
+	uint32_t addr;
+	int length;						// Instructions before the branch back to the start
+	uint32_t words[MAX_LENGTH + 1];
+	uint32_t registers[NUM_REGISTERS];
+	uint32_t banked_registers[NUM_BANKS][NUM_BANKED];
+	uint32_t spsr[NUM_BANKS];
+	uint32_t nzcv;
+	uint32_t data[PAGE_SIZE / 4];
+	uint64_t interval;
+} sequence_t;
+
+// A reference and a machine under test in lockstep, reused for every sequence a worker runs
+typedef struct pair {
+	machine_t *reference;
+	machine_t *test;
+	lockstep_t *lockstep;
+} pair_t;
+
+typedef struct fuzzer {
+	execution_engine_t engine;
+	uint64_t seed;
+	uint64_t num_sequences;
+	int max_length;
+	uint64_t budget;
+	double timeout;					// Wall clock seconds, 0 for no limit
+	double start;
+	uint64_t next_index;			// Taken by the workers atomically
+	bool stopping;					// Set by the worker that finds a divergence
+	pthread_mutex_t lock;			// Guards the totals and the report
+	uint64_t sequences;
+	uint64_t instructions;
+	uint64_t failed;
+	bool diverged;
+} fuzzer_t;
+
+static void usage() {
+	fprintf(stderr, "usage: piemu-fuzz [-e step|blocks|jit] [-n sequences] [-t seconds] [-s seed] [-k index] [-l length] [-m instructions] [-j threads]\n");
+	fprintf(stderr, "  -e  engine to check against single stepping (default the fastest there is)\n");
+	fprintf(stderr, "  -n  number of sequences (default %d)\n", DEFAULT_SEQUENCES);
+	fprintf(stderr, "  -t  stop after this many seconds\n");
+	fprintf(stderr, "  -s  seed to generate the sequences from (default from the time)\n");
+	fprintf(stderr, "  -k  only run the sequence with this index, and print it\n");
+	fprintf(stderr, "  -l  longest sequence (default %d, at most %d)\n", DEFAULT_LENGTH, MAX_LENGTH);
+	fprintf(stderr, "  -m  instructions each sequence runs for (default %d)\n", DEFAULT_BUDGET);
+	fprintf(stderr, "  -j  number of worker threads (default one per online CPU)\n\n");
+	fprintf(stderr, "Stops at the first sequence where the engine and the reference differ and prints it with\n");
+	fprintf(stderr, "the differences.  The exit status is 1 if there was one.\n\n");
+}
+
+static double seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+static uint32_t random_below(uint64_t *state, uint32_t n) {
+	return (uint32_t)((next_random(state) >> 32) * n >> 32);
+}
+
+static uint32_t random_value(uint64_t *state) {
+	switch (random_below(state, 4)) {
+		case 0:
+			return edge_values[random_below(state, sizeof(edge_values) / sizeof(edge_values[0]))];
+
+		case 1:
+			return random_below(state, 256);
+
+		default:
+			return (uint32_t)next_random(state);
+	}
+}
+
+// A quarter of the instructions are predicated
+static uint32_t random_condition(uint64_t *state) {
+	return (random_below(state, 4) == 0 ? random_below(state, COND_AL) : COND_AL) << CONDITION_SHIFT;
+}
+
+// Any register but the bases, the PC and the instruction to patch in
+static int random_destination(uint64_t *state) {
+	int reg = random_below(state, 12);
+	return reg < PATCH ? reg : reg - PATCH + sp;
+}
+
+// Mostly a general register, now and then the PC
+static int random_source(uint64_t *state) {
+	return random_below(state, 16) == 0 ? pc : (int)random_below(state, pc);
+}
+
+static uint32_t random_immediate(uint64_t *state) {
+	uint32_t rotate = random_below(state, 2) == 0 ? 0 : random_below(state, 16);
+	return rotate << 8 | random_below(state, 256);
+}
+
+static uint32_t data_processing(uint64_t *state, uint32_t cond, int rd) {
+	static const uint32_t opcodes[] = { OPCODE_MOV, OPCODE_ADD, OPCODE_SUB, OPCODE_CMP };
+	uint32_t opcode = opcodes[random_below(state, 4)];
+	uint32_t s = opcode == OPCODE_CMP ? 1 : random_below(state, 2);
+	uint32_t rn = opcode == OPCODE_MOV ? 0 : random_source(state);
+	uint32_t instruction = cond | opcode << 21 | s << 20 | rn << 16;
+
+	if (opcode != OPCODE_CMP)
+		instruction |= rd << 12;
+
+	if (random_below(state, 2) == 0)
+		return instruction | DATA_PROCESSING_IMMEDIATE_MASK | random_immediate(state);
+
+	return instruction | random_below(state, 32) << 7 | random_source(state);
+}
+
+static uint32_t load_store(uint32_t cond, bool load, int rd, int rn, int32_t offset) {
+	uint32_t up = offset >= 0;
+	uint32_t magnitude = up ? offset : -offset;
+
+	return cond | LOAD_STORE_WORD_OR_UNSIGNED_BYTE | 1 << 24 | up << 23 | load << 20 | rn << 16 | rd << 12 | magnitude;
+}
+
+// Offset of a word in the data page from the base register
+static int32_t random_data_offset(uint64_t *state) {
+	return ((int32_t)random_below(state, PAGE_SIZE / 4) - PAGE_SIZE / 8) * 4;
+}
+
+static uint32_t branch(uint32_t cond, int from, int to) {
+	return cond | BRANCH | ((to - from - 2) & 0xffffff);
+}
+
+// A loop counting a register down to zero, or up to a limit, which the engines skip in one go when they
+// can.  Returns the number of instructions written.
+static int countdown_loop(uint64_t *state, uint32_t *words, int i) {
+	uint32_t rx = random_below(state, PATCH);
+	uint32_t step = 1 + random_below(state, 4);
+	uint32_t count = 1 + random_below(state, 48);
+	uint32_t reg = rx << 16 | rx << 12;
+
+	if (random_below(state, 2) == 0) {
+		words[i] = COND_AL << CONDITION_SHIFT | DATA_PROCESSING_IMMEDIATE_MASK | OPCODE_MOV << 21 | rx << 12 | step * count;
+		words[i + 1] = COND_AL << CONDITION_SHIFT | DATA_PROCESSING_IMMEDIATE_MASK | OPCODE_SUB << 21 | 1 << 20 | reg | step;
+		words[i + 2] = branch(COND_NE << CONDITION_SHIFT, i + 2, i + 1);
+		return 3;
+	}
+
+	words[i] = COND_AL << CONDITION_SHIFT | DATA_PROCESSING_IMMEDIATE_MASK | OPCODE_MOV << 21 | rx << 12;
+	words[i + 1] = COND_AL << CONDITION_SHIFT | DATA_PROCESSING_IMMEDIATE_MASK | OPCODE_ADD << 21 | reg | step;
+	words[i + 2] = COND_AL << CONDITION_SHIFT | DATA_PROCESSING_IMMEDIATE_MASK | OPCODE_CMP << 21 | 1 << 20 | rx << 16 | step * count;
+	words[i + 3] = branch(COND_NE << CONDITION_SHIFT, i + 3, i + 1);
+	return 4;
+}
+
+// Changes the mode, the interrupt masks or the flags, or is a hint
+static uint32_t system_instruction(uint64_t *state, uint32_t cond, int rd) {
+	uint32_t mode = modes[random_below(state, sizeof(modes) / sizeof(modes[0]))];
+
+	switch (random_below(state, 6)) {
+		// Not of the SPSR, as user and system mode don't have one
+		case 0:
+			return cond | MRS | rd << 12;
+
+		case 1:
+			return cond | MSR_IMMEDIATE | 8 << 16 | random_immediate(state);
+
+		case 2:
+			return cond | MSR_REGISTER | 8 << 16 | random_source(state);
+
+		case 3:
+			return cond | MSR_IMMEDIATE | 1 << 16 | random_below(state, 4) << 6 | mode;
+
+		case 4: {
+			uint32_t imod = 2 + random_below(state, 2);
+			uint32_t change_mode = random_below(state, 2);
+
+			// Only the mode, or masks enabled or disabled, at least one of A, I and F, and maybe the mode
+			if (random_below(state, 4) == 0)
+				return CPS | 1 << 17 | mode;
+
+			return CPS | imod << 18 | change_mode << 17 | (1 + random_below(state, 7)) << 6 | (change_mode ? mode : 0);
+		}
+
+		default:
+			return cond | HINT | random_below(state, 5);
+	}
+}
+
+// Fills the sequence from the seed and its index alone
+static void generate_sequence(sequence_t *s, const fuzzer_t *fuzzer, uint64_t index) {
+	uint64_t state = fuzzer->seed ^ index * 0xd1342543de82ef95;
+	uint64_t budget = fuzzer->budget;
+
+	next_random(&state);
+	s->index = index;
+	s->addr = FUZZ_CODE + (index % FUZZ_CODE_SLOTS) * PAGE_SIZE;
+	s->length = 1 + random_below(&state, fuzzer->max_length);
+
+	for (int i = 0; i < s->length; ) {
+		uint32_t cond = random_condition(&state);
+		int rd = random_destination(&state);
+		uint32_t kind = random_below(&state, 32);
+
+		if (kind < 12)
+			s->words[i] = data_processing(&state, cond, rd);
+		else if (kind < 16)
+			s->words[i] = load_store(cond, true, rd, DATA_BASE, random_data_offset(&state));
+		else if (kind < 19)
+			s->words[i] = load_store(cond, false, random_source(&state), DATA_BASE, random_data_offset(&state));
+		else if (kind < 20)
+			s->words[i] = load_store(cond, true, rd, CODE_BASE, random_below(&state, s->length + 1) * 4);
+		else if (kind < 21) {
+			// The literal is somewhere in the sequence, which the PC is 8 past
+			int32_t offset = ((int32_t)random_below(&state, s->length + 1) - i - 2) * 4;
+			s->words[i] = load_store(cond, true, rd, pc, offset);
+		} else if (kind < 22) {
+			// Only over code already run, as a later instruction in the same block may have been fetched
+			s->words[i] = load_store(cond, false, PATCH, CODE_BASE, random_below(&state, i + 1) * 4);
+		} else if (kind < 25)
+			s->words[i] = branch(cond, i, i + 1 + random_below(&state, s->length - i));
+		else if (kind < 29)
+			s->words[i] = system_instruction(&state, cond, rd);
+		else if (i + 4 <= s->length) {
+			i += countdown_loop(&state, s->words, i);
+			continue;
+		} else
+			s->words[i] = data_processing(&state, cond, rd);
+
+		i++;
+	}
+
+	s->words[s->length] = branch(COND_AL << CONDITION_SHIFT, s->length, 0);
+
+	for (int reg = 0; reg < NUM_REGISTERS; reg++)
+		s->registers[reg] = random_value(&state);
+
+	for (int bank = 0; bank < NUM_BANKS; bank++) {
+		for (int i = 0; i < NUM_BANKED; i++)
+			s->banked_registers[bank][i] = random_value(&state);
+
+		s->spsr[bank] = ((uint32_t)next_random(&state) & PSR_FLAGS_MASK) | PSR_I | PSR_F | modes[random_below(&state, 7)];
+	}
+
+	// Always a valid data processing instruction so stores over the sequence don't make it undefined
+	s->registers[PATCH] = data_processing(&state, COND_AL << CONDITION_SHIFT, random_destination(&state)) & ~(pc << 16 | pc);
+	s->registers[CODE_BASE] = s->addr;
+	s->registers[DATA_BASE] = FUZZ_DATA + PAGE_SIZE / 2;
+
+	for (int reg = PATCH; reg <= DATA_BASE; reg++)
+		s->banked_registers[BANK_FIQ][reg - FIRST_BANKED] = s->registers[reg];
+
+	s->nzcv = random_below(&state, 16);
+
+	for (int i = 0; i < PAGE_SIZE / 4; i++)
+		s->data[i] = random_value(&state);
+
+	// Half compare every instruction, a quarter every few and a quarter only at the end
+	switch (random_below(&state, 4)) {
+		case 0:
+		case 1:
+			s->interval = 1;
+			break;
+
+		case 2:
+			s->interval = 2 + random_below(&state, 63);
+			break;
+
+		default:
+			s->interval = budget;
+	}
+}
+
+// Puts the sequence and its starting state in the machine as they would be after a reset
+static void load_sequence(machine_t *m, const sequence_t *s) {
+	memcpy(m->ram + FUZZ_DATA, s->data, PAGE_SIZE);
+
+	for (int i = 0; i <= s->length; i++)
+		write_word(m, s->addr + i * 4, s->words[i]);
+
+	m->cpsr = PSR_I | PSR_F | MODE_SYSTEM;
+	m->flags = (lazy_flags_t){ .operation = FLAGS_NZCV, .left = s->nzcv };
+	memcpy(m->registers, s->registers, sizeof(m->registers));
+	memcpy(m->banked_registers, s->banked_registers, sizeof(m->banked_registers));
+	memcpy(m->spsr, s->spsr, sizeof(m->spsr));
+	set_program_counter(m, s->addr + 8);				// 2 instruction pipeline
+	m->stop_reason = STOP_NONE;
+}
+
+static void open_pair(pair_t *pair, execution_engine_t engine) {
+	pair->reference = create_machine();
+	pair->test = create_machine();
+	pair->test->execution_engine = engine;
+	pair->test->skip_delay_loops = true;
+	pair->test->jit_threshold = 1;
+	pair->lockstep = start_lockstep(pair->reference, pair->test, 1);
+}
+
+static void close_pair(pair_t *pair) {
+	stop_lockstep(pair->lockstep);
+	destroy_machine(pair->reference);
+	destroy_machine(pair->test);
+}
+
+static lockstep_status_t run_sequence(pair_t *pair, const sequence_t *s, uint64_t budget, uint64_t *instructions) {
+	lockstep_t *l = pair->lockstep;
+
+	load_sequence(pair->reference, s);
+	load_sequence(pair->test, s);
+	l->interval = s->interval;
+	*instructions += execute_lockstep(l, budget);
+	return l->status;
+}
+
+static void print_sequence(FILE *f, const fuzzer_t *fuzzer, const sequence_t *s) {
+	char disassembly[DISASSEMBLY_LENGTH];
+
+	fprintf(f, "Sequence %llu of seed %llu on the %s engine, compared every %llu instructions\n", (unsigned long long)s->index,
+		(unsigned long long)fuzzer->seed, engine_names[fuzzer->engine], (unsigned long long)s->interval);
+
+	for (int i = 0; i <= s->length; i++)
+		fprintf(f, "  %s\n", disassemble_instruction(s->addr + i * 4, s->words[i], disassembly));
+
+	fprintf(f, "Starting in system mode with NZCV %x and\n", s->nzcv);
+
+	for (int reg = 0; reg < pc; reg++)
+		fprintf(f, "  %-4s %08x%s", register_names[reg], s->registers[reg], reg % 4 == 3 || reg == pc - 1 ? "\n" : "");
+}
+
+// Reports the first divergence any worker finds and stops the others
+static void report_divergence(fuzzer_t *fuzzer, const sequence_t *s, lockstep_t *l) {
+	pthread_mutex_lock(&fuzzer->lock);
+
+	if (!fuzzer->diverged) {
+		fuzzer->diverged = true;
+		print_sequence(stdout, fuzzer, s);
+		print_divergence(l, stdout);
+		fflush(stdout);
+	}
+
+	__atomic_store_n(&fuzzer->stopping, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&fuzzer->lock);
+}
+
+static void *run_worker(void *arg) {
+	fuzzer_t *fuzzer = arg;
+	sequence_t *s = malloc(sizeof(sequence_t));
+	uint64_t sequences = 0;
+	uint64_t instructions = 0;
+	uint64_t failed = 0;
+	pair_t pair;
+
+	if (s == NULL) {
+		perror("Fuzzer");
+		exit(2);
+	}
+
+	open_pair(&pair, fuzzer->engine);
+
+	while (!__atomic_load_n(&fuzzer->stopping, __ATOMIC_RELAXED)) {
+		uint64_t index = __atomic_fetch_add(&fuzzer->next_index, 1, __ATOMIC_RELAXED);
+
+		if (index >= fuzzer->num_sequences)
+			break;
+
+		if (fuzzer->timeout > 0 && seconds() - fuzzer->start >= fuzzer->timeout)
+			break;
+
+		generate_sequence(s, fuzzer, index);
+		lockstep_status_t status = run_sequence(&pair, s, fuzzer->budget, &instructions);
+		sequences++;
+
+		if (status == LOCKSTEP_DIVERGED) {
+			report_divergence(fuzzer, s, pair.lockstep);
+			break;
+		}
+
+		// Both machines stopped part way through something, so start again with new ones
+		if (status == LOCKSTEP_FAILED) {
+			failed++;
+			close_pair(&pair);
+			open_pair(&pair, fuzzer->engine);
+		}
+	}
+
+	close_pair(&pair);
+	free(s);
+
+	pthread_mutex_lock(&fuzzer->lock);
+	fuzzer->sequences += sequences;
+	fuzzer->instructions += instructions;
+	fuzzer->failed += failed;
+	pthread_mutex_unlock(&fuzzer->lock);
+	return NULL;
+}
+
+// Runs the one sequence and prints it whether or not it diverges
+static int run_one(fuzzer_t *fuzzer, uint64_t index) {
+	sequence_t *s = malloc(sizeof(sequence_t));
+	uint64_t instructions = 0;
+	pair_t pair;
+
+	generate_sequence(s, fuzzer, index);
+	print_sequence(stdout, fuzzer, s);
+	open_pair(&pair, fuzzer->engine);
+
+	lockstep_status_t status = run_sequence(&pair, s, fuzzer->budget, &instructions);
+
+	if (status == LOCKSTEP_DIVERGED)
+		print_divergence(pair.lockstep, stdout);
+	else
+		printf("%s after %llu instructions\n", status == LOCKSTEP_FAILED ? "Both hit something not implemented" : "Matched",
+			(unsigned long long)instructions);
+
+	close_pair(&pair);
+	free(s);
+	return status == LOCKSTEP_DIVERGED ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+	fuzzer_t fuzzer;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool one = false;
+	uint64_t index = 0;
+	int option;
+
+	memset(&fuzzer, 0, sizeof(fuzzer));
+	fuzzer.engine = DEFAULT_ENGINE;
+	fuzzer.seed = (uint64_t)time(NULL) << 16 ^ getpid();
+	fuzzer.num_sequences = DEFAULT_SEQUENCES;
+	fuzzer.max_length = DEFAULT_LENGTH;
+	fuzzer.budget = DEFAULT_BUDGET;
+
+	while ((option = getopt(argc, argv, "e:n:t:s:k:l:m:j:")) != -1) {
+		switch (option) {
+			case 'e': {
+				int engine;
+
+				for (engine = ENGINE_STEP; engine <= ENGINE_JIT; engine++)
+					if (strcmp(optarg, engine_names[engine]) == 0)
+						break;
+
+				if (engine > ENGINE_JIT) {
+					usage();
+					return 1;
+				}
+
+				fuzzer.engine = engine;
+				break;
+			}
+
+			case 'n':
+				fuzzer.num_sequences = strtoull(optarg, NULL, 0);
+				break;
+
+			case 't':
+				fuzzer.timeout = atof(optarg);
+				break;
+
+			case 's':
+				fuzzer.seed = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'k':
+				one = true;
+				index = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'l':
+				fuzzer.max_length = atoi(optarg);
+				break;
+
+			case 'm':
+				fuzzer.budget = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'j':
+				threads = atoi(optarg);
+				break;
+
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if (optind != argc || threads < 1 || fuzzer.max_length < 1 || fuzzer.max_length > MAX_LENGTH || fuzzer.budget == 0) {
+		usage();
+		return 1;
+	}
+
+	pthread_mutex_init(&fuzzer.lock, NULL);
+
+	if (one)
+		return run_one(&fuzzer, index);
+
+	fprintf(stderr, "Fuzzing the %s engine with seed %llu\n", engine_names[fuzzer.engine], (unsigned long long)fuzzer.seed);
+
+	if ((uint64_t)threads > fuzzer.num_sequences)
+		threads = fuzzer.num_sequences > 0 ? fuzzer.num_sequences : 1;
+
+	pthread_t *ids = malloc(threads * sizeof(pthread_t));
+	fuzzer.start = seconds();
+
+	for (int i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, run_worker, &fuzzer);
+
+	for (int i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	double elapsed = seconds() - fuzzer.start;
+
+	fprintf(stderr, "%llu sequences, %llu instructions on %d threads in %.3f s, %.0f sequences a minute, %llu stopped in both\n",
+		(unsigned long long)fuzzer.sequences, (unsigned long long)fuzzer.instructions, threads, elapsed,
+		elapsed > 0 ? fuzzer.sequences * 60 / elapsed : 0, (unsigned long long)fuzzer.failed);
+
+	free(ids);
+	return fuzzer.diverged ? 1 : 0;
+}
@@ -4,94 +4,215 @@
 //
 // (c) Mark Jackson	2019
 //
-// Represents the BCM2835.
+// Represents the BCM2835 GPIO.
+//
+// Every register the guest can read is kept up to date in a page that is
+// mapped for reads, so polling GPLEV or GPEDS runs at the speed of a RAM
+// load.  Writes come here and work on a whole bank of 32 pins at a time.
 //
 ///////////////////////////////////////
 
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
 #include "error.h"
 #include "gpio.h"
+#include "machine.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "shared.h"
+#include "vcd.h"
+
+enum { GPIO_START = 0x20200000 };
+
+// Bits of the pins in a bank
+static uint32_t bank_pins(int bank) {
+	return bank == 0 ? ~0u : (1u << (NUM_GPIO_LINES - 32)) - 1;
+}
+
+static uint32_t *gpio_word(machine_t *m, int offset) {
+	return &m->gpio_registers[offset / 4];
+}
+
+uint32_t gpio_register(machine_t *m, int offset) {
+	return *gpio_word(m, offset);
+}
+
+// Stops execution when the guest drives the pin to the level
+void stop_on_gpio_pin(machine_t *m, int pin, bool level) {
+	m->stop_pin = pin;
+	m->stop_level = level;
+}
+
+// Prints the OK LED messages when the guest sets or clears output pins
+void print_led_messages(machine_t *m, bool print) {
+	m->led_messages = print;
+}
+
+// Writes the changes of every pin to a Value Change Dump.  Returns false if the file can't be created.
+bool record_gpio(machine_t *m, const char *filename) {
+	m->vcd = open_vcd(filename, NUM_GPIO_LINES);
+	return m->vcd != NULL;
+}
+
+// Works out the levels of a bank after something that drives them has changed.  Outputs are at the
+// level the guest set and inputs at the level they are driven to from outside, or else pulled to.  Changes are recorded and latch
+// the edge detect status, then the level detect status is applied.
+static void update_levels(machine_t *m, int bank) {
+	uint32_t *levels = gpio_word(m, GPLEV0 + bank * 4);
+	uint32_t *status = gpio_word(m, GPEDS0 + bank * 4);
+	uint32_t inputs = (m->input_levels[bank] & m->input_pins[bank]) | (m->pull_ups[bank] & ~m->input_pins[bank]);
+	uint32_t level = (m->pin_outputs[bank] & m->output_pins[bank]) | (inputs & ~m->output_pins[bank]);
+	uint32_t changed = (*levels ^ level) & bank_pins(bank);
+
+	*levels = level & bank_pins(bank);
+	*status |= changed & level & (*gpio_word(m, GPREN0 + bank * 4) | *gpio_word(m, GPAREN0 + bank * 4));
+	*status |= changed & ~level & (*gpio_word(m, GPFEN0 + bank * 4) | *gpio_word(m, GPAFEN0 + bank * 4));
+	*status |= (*levels & *gpio_word(m, GPHEN0 + bank * 4)) | (~*levels & *gpio_word(m, GPLEN0 + bank * 4));
+
+	for (uint32_t pins = m->vcd != NULL ? changed : 0; pins != 0; pins &= pins - 1) {
+		int bit = __builtin_ctz(pins);
+		record_pin_change(m->vcd, current_time(m), bank * 32 + bit, level >> bit & 1);
+	}
+
+	if (m->shared_gpio != NULL)
+		publish_gpio(m);
+}
+
+// Drives the input pins of the bank in mask to levels from outside the machine.  The rest of the
+// bank's inputs go back to their pulls.
+void drive_gpio_inputs(machine_t *m, int bank, uint32_t mask, uint32_t levels) {
+	m->input_pins[bank] = mask & bank_pins(bank);
+	m->input_levels[bank] = levels;
+	update_levels(m, bank);
+}
+
+// Sets or clears the output levels of the pins of the bank in mask
+static void drive_pins(machine_t *m, int bank, uint32_t mask, bool level) {
+	mask &= bank_pins(bank);
+
+	if (level)
+		m->pin_outputs[bank] |= mask;
+	else
+		m->pin_outputs[bank] &= ~mask;
+
+	// Setting an output pin switches the OK LED off and clearing one switches it on
+	for (uint32_t pins = m->led_messages ? mask & m->output_pins[bank] : 0; pins != 0; pins &= pins - 1)
+		printf("*** OK LED: %s ***\n", level ? "OFF" : "ON");
+
+	if (m->stop_pin >= 0 && m->stop_pin / 32 == bank && (mask >> m->stop_pin % 32 & 1) && level == m->stop_level)
+		m->stop_reason = STOP_GPIO;
+
+	update_levels(m, bank);
+}
+
+// A function select register has a 3 bit field for each of 10 pins and a pin is an output when its
+// field is 001.  Picks out those fields and packs a bit for each into the low 10 bits.
+static uint32_t output_fields(uint32_t value) {
+	uint32_t outputs = value & ~(value >> 1) & ~(value >> 2) & 0x09249249;
+
+	outputs = (outputs | outputs >> 2) & 0x030c30c3;
+	outputs = (outputs | outputs >> 4) & 0x0300f00f;
+	outputs = (outputs | outputs >> 8) & 0x000300ff;
+	return (outputs | outputs >> 8) & 0x3ff;
+}
+
+static void select_functions(machine_t *m, int index, uint32_t value) {
+	uint64_t outputs = (uint64_t)m->output_pins[1] << 32 | m->output_pins[0];
+	uint64_t fields = 0x3ffull << (index * 10);
+
+	*gpio_word(m, GPFSEL0 + index * 4) = value;
+	outputs = (outputs & ~fields) | (uint64_t)output_fields(value) << (index * 10);
+	m->output_pins[0] = outputs;
+	m->output_pins[1] = outputs >> 32;
+
+	for (int bank = 0; bank < NUM_GPIO_BANKS; bank++)
+		update_levels(m, bank);
+}
+
+// Applies the pull in GPPUD to the pins of the bank in mask.  The hardware wants GPPUD held for
+// 150 cycles before the clock is written, which doesn't matter here.
+static void clock_pulls(machine_t *m, int bank, uint32_t mask) {
+	*gpio_word(m, GPPUDCLK0 + bank * 4) = mask;
+
+	if (mask == 0)
+		return;
+
+	switch (*gpio_word(m, GPPUD) & 3) {
+		case PULL_UP:
+			m->pull_ups[bank] |= mask;
+			break;
+
+		case PULL_DOWN:
+		case PULL_OFF:
+			m->pull_ups[bank] &= ~mask;
+			break;
+	}
+
+	update_levels(m, bank);
+}
+
+// Reads normally come straight from the mapped registers and only end up here if they don't
+uint32_t gpio_read_word(machine_t *m, uint32_t addr) {
+	assert(addr % 4 == 0);
+	return gpio_register(m, addr - GPIO_START);
+}
+
+void gpio_write_word(machine_t *m, uint32_t addr, uint32_t value) {
+	int offset = addr - GPIO_START;
+	int bank = offset >= GPEDS0 ? (offset - GPEDS0) % 12 / 4 : 0;
+
+	assert(addr % 4 == 0);
+
+	if (offset < GPFSEL0 + NUM_FUNCTION_SELECT_REGISTERS * 4)
+		select_functions(m, offset / 4, value);
+	else if (offset == GPSET0 || offset == GPSET0 + 4)
+		drive_pins(m, (offset - GPSET0) / 4, value, true);
+	else if (offset == GPCLR0 || offset == GPCLR0 + 4)
+		drive_pins(m, (offset - GPCLR0) / 4, value, false);
+	else if (offset == GPLEV0 || offset == GPLEV0 + 4)
+		return;								// Read only
+	else if (offset == GPEDS0 || offset == GPEDS0 + 4) {
+		*gpio_word(m, offset) &= ~value;
+		update_levels(m, bank);				// Level detect sets it again straight away
+	} else if (offset >= GPREN0 && offset < GPPUD && bank < NUM_GPIO_BANKS) {
+		*gpio_word(m, offset) = value & bank_pins(bank);
+		update_levels(m, bank);
+	} else if (offset == GPPUD)
+		*gpio_word(m, GPPUD) = value & 3;
+	else if (offset == GPPUDCLK0 || offset == GPPUDCLK0 + 4)
+		clock_pulls(m, (offset - GPPUDCLK0) / 4, value & bank_pins((offset - GPPUDCLK0) / 4));
+	else if (offset == GPIO_TEST)
+		*gpio_word(m, GPIO_TEST) = value;
+	else
+		not_implemented(__func__, "Write to 0x%08x with value 0x%08x", addr, value);
+}
+
+void init_gpio(machine_t *m) {
+	m->stop_pin = -1;
+	m->gpio_registers = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+	if (m->gpio_registers == NULL) {
+		perror("GPIO registers");
+		exit(2);
+	}
+
+	memset(m->gpio_registers, 0, PAGE_SIZE);
+	register_mmio(m, GPIO_START, GPIO_REGISTERS_SIZE, gpio_read_word, gpio_write_word);
+	map_mmio_reads(m, GPIO_START, m->gpio_registers);
+}
+
+void free_gpio(machine_t *m) {
+	if (m->vcd != NULL)
+		close_vcd(m->vcd);
+
+	if (m->shared_gpio != NULL)
+		unshare_gpio(m);
 
-// GPIO register start and end addresses
-enum {
-	FUNCTION_SELECT_START = 0x20200000,
-	FUNCTION_SELECT_END   = 0x20200014,
-
-	PIN_OUTPUT_SET_START = 0x2020001c,
-	PIN_OUTPUT_SET_END   = 0x20200020,
-
-	PIN_OUTPUT_CLEAR_START = 0x20200028,
-	PIN_OUTPUT_CLEAR_END   = 0x2020002c,
-
-	NUM_GPIO_LINES                = 54,
-	NUM_FUNCTION_SELECT_REGISTERS = 6
-};
-
-// Alternate functions
-typedef enum {
-	FUNCTION_SELECT_INPUT                = 0,
-	FUNCTION_SELECT_OUTPUT               = 1,
-	FUNCTION_SELECT_ALTERNATE_FUNCTION_0 = 4,
-	FUNCTION_SELECT_ALTERNATE_FUNCTION_1 = 5,
-	FUNCTION_SELECT_ALTERNATE_FUNCTION_2 = 6,
-	FUNCTION_SELECT_ALTERNATE_FUNCTION_3 = 7,
-	FUNCTION_SELECT_ALTERNATE_FUNCTION_4 = 3,
-	FUNCTION_SELECT_ALTERNATE_FUNCTION_5 = 2
-} function_select_t;
-
-function_select_t function_select[NUM_GPIO_LINES];
-bool pin_set[NUM_GPIO_LINES];
-
-uint32_t gpio_read_word(uint32_t addr) {
-    not_implemented(__func__, "Read from 0x%08x", addr);
-    assert(0);
-}
-
-void gpio_write_word(uint32_t addr, uint32_t value) {
-    assert(addr % 4 == 0);
-
-    if (FUNCTION_SELECT_START <= addr && addr <= FUNCTION_SELECT_END) {
-        int base = (addr - FUNCTION_SELECT_START) / 4 * 10;         // We are dealing with words so divide the address by the word length
-
-        for (int i = 0; i < 10; i++) {
-            function_select_t function = ((value >> (i * 3)) & 7);     // Each function is 3 bits
-            function_select[base + i] = function;
-
-            if (base + i == NUM_GPIO_LINES - 1)
-                break;
-        }
-    } else if (PIN_OUTPUT_SET_START <= addr && addr <= PIN_OUTPUT_SET_END) {
-        int base = (addr - PIN_OUTPUT_SET_START) / 4 * 32;
-
-        for (int i = 0; i < 32; i++) {
-            if (((value >> i) & 1) == 1) {
-                // When pin 16 is set and the function is output this switches the OK LED off
-                if (function_select[base + i] == FUNCTION_SELECT_OUTPUT)
-                    printf("*** OK LED: OFF ***\n");
-
-                pin_set[base + 1] = true;
-            }
-
-            if (base + i == NUM_GPIO_LINES - 1)
-                break;
-        }
-    } else if (PIN_OUTPUT_CLEAR_START <= addr && addr <= PIN_OUTPUT_CLEAR_END) {
-        int base = (addr - PIN_OUTPUT_CLEAR_START) / 4 * 32;
-
-        for (int i = 0; i < 32; i++) {
-            if (((value >> i) & 1) == 1) {
-                // When pin 16 is cleared and the function is output this switches the OK LED on
-                if (function_select[base + i] == FUNCTION_SELECT_OUTPUT)
-                    printf("*** OK LED: ON ***\n");
-
-                pin_set[base + 1] = false;
-            }
-
-            if (base + i == NUM_GPIO_LINES - 1)
-                break;
-        }
-    } else
-        not_implemented(__func__, "Write to 0x%08x with value 0x%08x", addr, value);
+	free(m->gpio_registers);
+	m->vcd = NULL;
+	m->gpio_registers = NULL;
 }
@@ -1,10 +1,65 @@
 #ifndef __GPIO_H
 #define __GPIO_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+typedef struct machine machine_t;
+
+enum {
+	NUM_GPIO_LINES = 54,
+	NUM_GPIO_BANKS = 2,				// Pins are set, cleared and read 32 to a word
+	NUM_FUNCTION_SELECT_REGISTERS = 6
+};
+
+// Offsets of the GPIO registers.  Those with a register for each bank are followed by the second.
+enum {
+	GPFSEL0   = 0x00,
+	GPSET0    = 0x1c,
+	GPCLR0    = 0x28,
+	GPLEV0    = 0x34,
+	GPEDS0    = 0x40,				// Event detect status, written with 1 to clear
+	GPREN0    = 0x4c,				// Rising edge detect enable
+	GPFEN0    = 0x58,				// Falling edge detect enable
+	GPHEN0    = 0x64,				// High level detect enable
+	GPLEN0    = 0x70,				// Low level detect enable
+	GPAREN0   = 0x7c,				// Asynchronous rising edge detect enable
+	GPAFEN0   = 0x88,				// Asynchronous falling edge detect enable
+	GPPUD     = 0x94,				// Pull-up/down to apply
+	GPPUDCLK0 = 0x98,				// Applies GPPUD to the pins written
+	GPIO_TEST = 0xb0,
+
+	GPIO_REGISTERS_SIZE = 0xb4
+};
+
+// GPPUD values
+enum {
+	PULL_OFF  = 0,
+	PULL_DOWN = 1,
+	PULL_UP   = 2
+};
+
+// Alternate functions
+typedef enum {
+	FUNCTION_SELECT_INPUT                = 0,
+	FUNCTION_SELECT_OUTPUT               = 1,
+	FUNCTION_SELECT_ALTERNATE_FUNCTION_0 = 4,
+	FUNCTION_SELECT_ALTERNATE_FUNCTION_1 = 5,
+	FUNCTION_SELECT_ALTERNATE_FUNCTION_2 = 6,
+	FUNCTION_SELECT_ALTERNATE_FUNCTION_3 = 7,
+	FUNCTION_SELECT_ALTERNATE_FUNCTION_4 = 3,
+	FUNCTION_SELECT_ALTERNATE_FUNCTION_5 = 2
+} function_select_t;
+
 // Public functions
-extern uint32_t gpio_read_word(uint32_t addr);
-extern void gpio_write_word(uint32_t addr, uint32_t value);
+extern void init_gpio(machine_t *m);
+extern void free_gpio(machine_t *m);
+extern void stop_on_gpio_pin(machine_t *m, int pin, bool level);
+extern void print_led_messages(machine_t *m, bool print);
+extern bool record_gpio(machine_t *m, const char *filename);
+extern uint32_t gpio_register(machine_t *m, int offset);
+extern void drive_gpio_inputs(machine_t *m, int bank, uint32_t mask, uint32_t levels);
+extern uint32_t gpio_read_word(machine_t *m, uint32_t addr);
+extern void gpio_write_word(machine_t *m, uint32_t addr, uint32_t value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,375 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Unattended runs.
+//
+// The image runs on the selected engine in large quanta.  The instruction
+// limit and timeout are only looked at between quanta, and the other stop
+// conditions are raised by the engine itself, so nothing is polled per
+// instruction.
+//
+///////////////////////////////////////
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block.h"
+#include "breakpoint.h"
+#include "cpu.h"
+#include "error.h"
+#include "flow.h"
+#include "gpio.h"
+#include "headless.h"
+#include "lockstep.h"
+#include "machine.h"
+#include "memory.h"
+#include "profile.h"
+#include "shared.h"
+#include "snapshot.h"
+#include "trace.h"
+
+// Instructions executed between checks of the limit and timeout
+enum { RUN_QUANTUM = 1024 * 1024 };
+
+static const char *exit_reason_names[] = { "instruction_limit", "timeout", "pc", "gpio", "self_branch", "error", "diverged" };
+
+static double seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void init_headless_options(headless_options_t *options) {
+	options->image = "kernel.img";
+	options->load_addr = 0x8000;
+	options->max_instructions = 0;
+	options->timeout = 0;
+	options->stop_at_pc = false;
+	options->stop_pc = 0;
+	options->stop_pin = -1;
+	options->stop_pin_level = false;
+
+	options->engine = DEFAULT_ENGINE;
+	options->decode_cache_enabled = true;
+	options->skip_delay_loops = true;
+	options->vcd_file = NULL;
+	options->shared_gpio_name = NULL;
+	options->restore_file = NULL;
+	options->save_file = NULL;
+	options->trace_file = NULL;
+	options->trace_first = 0;
+	options->trace_last = UINT32_MAX;
+	options->profile_file = NULL;
+	options->folded_file = NULL;
+	options->profile_interval = DEFAULT_PROFILE_INTERVAL;
+	options->profile_host_time = false;
+	options->lockstep_interval = 0;
+}
+
+// Sets one of the HEADLESS_OPTIONS from its getopt letter.  Returns false if the option or its argument isn't valid.
+bool parse_headless_option(headless_options_t *options, int option, char *arg) {
+	char *level;
+
+	switch (option) {
+		case 'i':
+			options->image = arg;
+			return true;
+
+		case 'a':
+			options->load_addr = strtoul(arg, NULL, 0);
+			return true;
+
+		case 'm':
+			options->max_instructions = strtoull(arg, NULL, 0);
+			return true;
+
+		case 't':
+			options->timeout = atof(arg);
+			return true;
+
+		case 'p':
+			options->stop_at_pc = true;
+			options->stop_pc = strtoul(arg, NULL, 0);
+			return true;
+
+		case 'g':
+			options->stop_pin = strtol(arg, &level, 10);
+
+			if (*level != '=' || (level[1] != '0' && level[1] != '1')) {
+				fprintf(stderr, "piemu: expected pin=level, not %s\n", arg);
+				return false;
+			}
+
+			options->stop_pin_level = level[1] == '1';
+			return true;
+
+		case 'w':
+			options->vcd_file = arg;
+			return true;
+
+		case 'x':
+			options->shared_gpio_name = arg;
+			return true;
+
+		case 'r':
+			options->restore_file = arg;
+			return true;
+
+		case 's':
+			options->save_file = arg;
+			return true;
+
+		case 'T':
+			options->trace_file = arg;
+			return true;
+
+		case 'R':
+			options->trace_first = strtoul(arg, &level, 0);
+
+			if (*level != ':') {
+				fprintf(stderr, "piemu: expected first:last, not %s\n", arg);
+				return false;
+			}
+
+			options->trace_last = strtoul(level + 1, NULL, 0);
+			return true;
+
+		case 'P':
+			options->profile_file = arg;
+			return true;
+
+		case 'F':
+			options->folded_file = arg;
+			return true;
+
+		case 'S':
+			options->profile_interval = strtoull(arg, &level, 0);
+
+			if (*level != '\0' && strcmp(level, "us") != 0) {
+				fprintf(stderr, "piemu: expected cycles, or microseconds ending in us, not %s\n", arg);
+				return false;
+			}
+
+			options->profile_host_time = *level != '\0';
+			return true;
+
+		case 'L':
+			options->lockstep_interval = strtoull(arg, NULL, 0);
+
+			if (options->lockstep_interval == 0) {
+				fprintf(stderr, "piemu: expected instructions between comparisons, not %s\n", arg);
+				return false;
+			}
+
+			return true;
+
+		case 'n':
+			options->decode_cache_enabled = false;
+			return true;
+
+		case 'l':
+			options->skip_delay_loops = false;
+			return true;
+
+		case 'e':
+			if (strcmp(arg, "step") == 0)
+				options->engine = ENGINE_STEP;
+			else if (strcmp(arg, "blocks") == 0)
+				options->engine = ENGINE_BLOCKS;
+			else if (strcmp(arg, "jit") == 0)
+				options->engine = ENGINE_JIT;
+			else {
+				fprintf(stderr, "piemu: unknown engine %s\n", arg);
+				return false;
+			}
+
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static exit_reason_t exit_reason(stop_reason_t reason) {
+	switch (reason) {
+		case STOP_BREAKPOINT:
+			return EXIT_PC;
+
+		case STOP_GPIO:
+			return EXIT_GPIO;
+
+		default:
+			return EXIT_SELF_BRANCH;
+	}
+}
+
+// Runs quanta until a stop condition is met, in lockstep with a reference unless l is NULL
+static void run_quanta(machine_t *m, lockstep_t *l, const headless_options_t *options, headless_result_t *result, double start) {
+	while (true) {
+		uint64_t quantum = RUN_QUANTUM;
+
+		if (options->max_instructions != 0) {
+			if (result->instructions >= options->max_instructions) {
+				result->reason = EXIT_INSTRUCTION_LIMIT;
+				return;
+			}
+
+			if (options->max_instructions - result->instructions < quantum)
+				quantum = options->max_instructions - result->instructions;
+		}
+
+		result->instructions += l != NULL ? execute_lockstep(l, quantum) : execute(m, quantum);
+
+		if (l != NULL && l->status != LOCKSTEP_MATCHING) {
+			result->reason = l->status == LOCKSTEP_DIVERGED ? EXIT_DIVERGED : EXIT_ERROR;
+			return;
+		}
+
+		if (m->stop_reason != STOP_NONE) {
+			result->reason = exit_reason(m->stop_reason);
+			return;
+		}
+
+		if (options->timeout > 0 && seconds() - start >= options->timeout) {
+			result->reason = EXIT_TIMEOUT;
+			return;
+		}
+	}
+}
+
+// Loads the image, or restores the snapshot, into the machine.  Returns false if it can't be loaded or restored.
+static bool load_machine(machine_t *m, const headless_options_t *options) {
+	if (options->restore_file != NULL)
+		return restore_snapshot(m, options->restore_file);
+
+	int size_in_words = load_memory_from_file(m, options->image, options->load_addr);
+
+	if (size_in_words < 0)
+		return false;
+
+	if (m->execution_engine != ENGINE_STEP)
+		map_loaded_code(m, options->load_addr, size_in_words);
+
+	set_program_counter(m, options->load_addr + 8);			// 2 instruction pipeline
+	return true;
+}
+
+// Loads the image into a new machine and runs it until one of the stop conditions is met.  Anything
+// the emulator doesn't implement ends the run rather than the process.
+headless_result_t run_headless(const headless_options_t *options) {
+	headless_result_t result = { .reason = EXIT_INSTRUCTION_LIMIT };
+	machine_t *m = create_machine();
+	jmp_buf error_handler;
+
+	m->execution_engine = options->engine;
+	m->decode_cache_enabled = options->decode_cache_enabled;
+	m->skip_delay_loops = options->skip_delay_loops;
+	m->stop_on_self_branch = true;
+	stop_on_gpio_pin(m, options->stop_pin, options->stop_pin_level);
+
+	bool ready = load_machine(m, options);
+	machine_t *reference = NULL;
+	lockstep_t *l = NULL;
+
+	// The reference can't be given the inputs other processes drive, so it would soon differ
+	if (ready && options->lockstep_interval > 0 && options->shared_gpio_name != NULL) {
+		fprintf(stderr, "Lockstep isn't available while the GPIO is shared\n");
+		ready = false;
+	} else if (ready && options->lockstep_interval > 0) {
+		reference = create_machine();
+		reference->execution_engine = ENGINE_STEP;
+		ready = load_machine(reference, options);
+
+		if (ready)
+			l = start_lockstep(reference, m, options->lockstep_interval);
+	}
+
+	if (options->stop_at_pc)
+		set_breakpoint(m, options->stop_pc);
+
+	double start = seconds();
+	uint64_t first_retired = m->retired;
+	set_error_handler(&error_handler);
+
+	if (!ready)
+		result.reason = EXIT_ERROR;
+	else if (options->vcd_file != NULL && !record_gpio(m, options->vcd_file))
+		result.reason = EXIT_ERROR;
+	else if (options->shared_gpio_name != NULL && !share_gpio(m, options->shared_gpio_name))
+		result.reason = EXIT_ERROR;
+	else if (options->trace_file != NULL && !start_trace(m, options->trace_file, options->trace_first, options->trace_last))
+		result.reason = EXIT_ERROR;
+	else if ((options->profile_file != NULL || options->folded_file != NULL) &&
+		!start_profile(m, options->profile_file, options->folded_file, options->profile_interval, options->profile_host_time))
+		result.reason = EXIT_ERROR;
+	else if (setjmp(error_handler) == 0)
+		run_quanta(m, l, options, &result, start);
+	else
+		result.reason = EXIT_ERROR;
+
+	// Counted from the machine so the instructions retired before a failure part way through a quantum are too
+	result.instructions = m->retired - first_retired;
+	set_error_handler(NULL);
+
+	if (result.reason == EXIT_DIVERGED)
+		print_divergence(l, stderr);
+
+	if (l != NULL)
+		stop_lockstep(l);
+
+	if (reference != NULL)
+		destroy_machine(reference);
+
+	// A run that failed stopped part way through an instruction so isn't worth saving
+	if (options->save_file != NULL && result.reason != EXIT_ERROR && !save_snapshot(m, options->save_file))
+		result.reason = EXIT_ERROR;
+
+	result.seconds = seconds() - start;
+	memcpy(result.registers, m->registers, sizeof(result.registers));
+	result.cpsr = read_cpsr(m);
+
+	destroy_machine(m);
+	return result;
+}
+
+void write_json_string(FILE *f, const char *s) {
+	fputc('"', f);
+
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < ' ')
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+
+	fputc('"', f);
+}
+
+// Writes the members of the summary object without its braces.  pc is the address of the next instruction to execute.
+void write_summary_fields(FILE *f, const headless_options_t *options, const headless_result_t *result) {
+	double mips = result->seconds > 0 ? result->instructions / result->seconds / 1e6 : 0;
+
+	fprintf(f, "\"image\":");
+	write_json_string(f, options->restore_file != NULL ? options->restore_file : options->image);
+	fprintf(f, ",\"exit\":\"%s\",\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f,\"registers\":{",
+		exit_reason_names[result->reason], (unsigned long long)result->instructions, result->seconds, mips);
+
+	for (int reg = 0; reg < pc; reg++)
+		fprintf(f, "\"%s\":%u,", register_names[reg], result->registers[reg]);
+
+	fprintf(f, "\"pc\":%u,\"cpsr\":%u}", result->registers[pc] - 8, result->cpsr);
+}
+
+// Writes the result as a single line of JSON
+void write_summary(FILE *f, const headless_options_t *options, const headless_result_t *result) {
+	fputc('{', f);
+	write_summary_fields(f, options, result);
+	fprintf(f, "}\n");
+}
@@ -0,0 +1,66 @@
+#ifndef __HEADLESS_H
+#define __HEADLESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+// How an unattended run is set up and when it stops
+typedef struct headless_options {
+	char *image;
+	uint32_t load_addr;
+	uint64_t max_instructions;		// 0 for no limit
+	double timeout;					// Wall clock seconds, 0 for no limit
+	bool stop_at_pc;
+	uint32_t stop_pc;				// Stop before executing the instruction at this address
+	int stop_pin;					// GPIO pin to wait for, -1 for none
+	bool stop_pin_level;
+	execution_engine_t engine;
+	bool decode_cache_enabled;
+	bool skip_delay_loops;
+	char *vcd_file;					// Records the GPIO pins, NULL for none
+	char *shared_gpio_name;			// Shared memory segment the GPIO is published in, NULL for none
+	char *restore_file;				// Snapshot to start from rather than the image, NULL for none
+	char *save_file;				// Snapshot written when the run stops, NULL for none
+	char *trace_file;				// Binary trace of the instructions, NULL for none
+	uint32_t trace_first;			// Addresses of the instructions traced
+	uint32_t trace_last;
+	char *profile_file;				// Hot block report, NULL for none
+	char *folded_file;				// Folded stacks of the samples for flamegraph.pl, NULL for none
+	uint64_t profile_interval;		// Cycles between samples, or microseconds with profile_host_time
+	bool profile_host_time;
+	uint64_t lockstep_interval;		// Instructions between comparisons with a single stepped reference, 0 for none
+} headless_options_t;
+
+// Why an unattended run finished
+typedef enum {
+	EXIT_INSTRUCTION_LIMIT,
+	EXIT_TIMEOUT,
+	EXIT_PC,
+	EXIT_GPIO,
+	EXIT_SELF_BRANCH,
+	EXIT_ERROR,						// Hit something the emulator doesn't implement
+	EXIT_DIVERGED					// The engine no longer matches the reference it runs in lockstep with
+} exit_reason_t;
+
+// getopt string of the options parse_headless_option understands
+#define HEADLESS_OPTIONS "nle:i:a:m:t:p:g:w:x:r:s:T:R:P:F:S:L:"
+
+typedef struct headless_result {
+	exit_reason_t reason;
+	uint64_t instructions;			// Retired, including those skipped by their condition
+	double seconds;
+	uint32_t registers[NUM_REGISTERS];	// Final state, the PC still includes the pipeline
+	uint32_t cpsr;
+} headless_result_t;
+
+// Public functions.  Each run has a machine of its own so runs can be made on many threads at once.
+extern void init_headless_options(headless_options_t *options);
+extern bool parse_headless_option(headless_options_t *options, int option, char *arg);
+extern headless_result_t run_headless(const headless_options_t *options);
+extern void write_json_string(FILE *f, const char *s);
+extern void write_summary_fields(FILE *f, const headless_options_t *options, const headless_result_t *result);
+extern void write_summary(FILE *f, const headless_options_t *options, const headless_result_t *result);
+
+#endif
@@ -0,0 +1,53 @@
+######################################
+#
+# Raspberry Pi Emulator for Model B+
+#
+# (c) Mark Jackson	2019
+#
+# Classes of the ARM instruction decode table.
+#
+# gendecode turns this into a 4096 entry table indexed by bits 27:20 and 7:4
+# of an instruction, which both the CPU and the disassembler dispatch on.
+# Each line is a class followed by the pattern of bits 27:20 and of bits
+# 7:4, with x for a bit that can be anything.  The first line that matches
+# an index wins and indexes that no line matches are UNDEFINED.  A class
+# whose patterns are - is outside the table, in the unconditional space.
+#
+######################################
+
+# class                           27:20     7:4
+
+# Multiplies and the loads and stores of halfwords, signed bytes and doublewords
+MULTIPLY                          0000xxxx  1001
+SWAP                              00010x00  1001
+EXTRA_LOAD_STORE                  000xxxxx  1xx1
+
+# Miscellaneous instructions in the space of the compares without S
+MRS                               00010x00  0000
+MSR_REGISTER                      00010x10  0000
+BX                                00010010  0001
+UNDEFINED                         00010xx0  xxxx
+
+DATA_PROCESSING_LSL               000xxxxx  x000
+DATA_PROCESSING_SHIFT             000xxxxx  xxx0
+DATA_PROCESSING_REGISTER_SHIFT    000xxxxx  0xx1
+
+# MSR immediate with no fields is a hint, which the decoders tell apart
+MSR_IMMEDIATE                     00110x10  xxxx
+UNDEFINED                         00110x00  xxxx
+DATA_PROCESSING_IMMEDIATE         001xxxxx  xxxx
+
+LOAD_STORE_IMMEDIATE              010xxxxx  xxxx
+LOAD_STORE_REGISTER               011xxxxx  xxx0
+MEDIA                             011xxxxx  xxx1
+LOAD_STORE_MULTIPLE               100xxxxx  xxxx
+
+BRANCH                            1010xxxx  xxxx
+BRANCH_LINK                       1011xxxx  xxxx
+
+COPROCESSOR                       110xxxxx  xxxx
+COPROCESSOR                       1110xxxx  xxxx
+SWI                               1111xxxx  xxxx
+
+# Unconditional instructions, matched on their masks in instruction_class
+CPS                               -         -
@@ -0,0 +1,483 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// x86-64 code generator for hot blocks.
+//
+// Compiled code keeps the machine pinned in rbx and reaches the registers and
+// the rest of the emulator state relative to it.  Flags set by CMP or SUBS stay
+// in the host flags for conditions later in the same block, and the operands
+// are recorded in the lazy flags for everything else.  Loads and stores go
+// through the page table inline.  Any access the fast path in machine.h wouldn't take,
+// such as MMIO or a store to a page holding code, leaves the block so the
+// interpreter can do it.
+//
+///////////////////////////////////////
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "block.h"
+#include "cpu.h"
+#include "flags.h"
+#include "jit.h"
+#include "machine.h"
+#include "memory.h"
+
+#if defined(__x86_64__)
+
+enum {
+	JIT_BUFFER_SIZE = 16 * 1024 * 1024,
+	MAX_BLOCK_CODE  = 16 * 1024,			// Enough host code for the longest block
+	MAX_PATCHES     = 4 * 64 + 4			// A load has four side exits
+};
+
+// x86 jcc opcodes
+enum {
+	X86_JE  = 0x84,
+	X86_JNE = 0x85
+};
+
+// The jcc taken when an ARM condition passes after cmp a, b on the host.  Negate by flipping bit 0.
+static const uint8_t condition_jumps[] = {
+	[COND_EQ] = 0x84,	// je
+	[COND_NE] = 0x85,	// jne
+	[COND_CS] = 0x83,	// jae, ARM carry is not borrow
+	[COND_CC] = 0x82,	// jb
+	[COND_MI] = 0x88,	// js
+	[COND_PL] = 0x89,	// jns
+	[COND_VS] = 0x80,	// jo
+	[COND_VC] = 0x81,	// jno
+	[COND_HI] = 0x87,	// ja
+	[COND_LS] = 0x86,	// jbe
+	[COND_GE] = 0x8d,	// jge
+	[COND_LT] = 0x8c,	// jl
+	[COND_GT] = 0x8f,	// jg
+	[COND_LE] = 0x8e	// jle
+};
+
+// rel32 fields waiting for the address of the epilogue or a side exit
+typedef struct {
+	uint8_t *field;
+	int exit;
+} patch_t;
+
+// State for the block being compiled
+typedef struct {
+	uint8_t *code;
+	bool flags_live;					// Host flags hold the result of the last CMP or SUBS
+	patch_t patches[MAX_PATCHES];
+	int num_patches;
+} assembler_t;
+
+static void emit8(assembler_t *a, uint8_t byte) {
+	*a->code++ = byte;
+}
+
+static void emit32(assembler_t *a, uint32_t value) {
+	memcpy(a->code, &value, sizeof(value));
+	a->code += sizeof(value);
+}
+
+static void patch_rel32(uint8_t *field, uint8_t *target) {
+	int32_t rel = (int32_t)(target - (field + 4));
+	memcpy(field, &rel, sizeof(rel));
+}
+
+// jcc rel32 to the side exit or epilogue for exit, patched once the block is complete
+static void emit_exit_jump(assembler_t *a, uint8_t opcode, int exit) {
+	if (opcode == 0xe9)
+		emit8(a, 0xe9);
+	else {
+		emit8(a, 0x0f);
+		emit8(a, opcode);
+	}
+
+	a->patches[a->num_patches].field = a->code;
+	a->patches[a->num_patches].exit = exit;
+	a->num_patches++;
+	emit32(a, 0);
+}
+
+// mov eax, [rbx + reg * 4]
+static void emit_load_eax(assembler_t *a, int reg) {
+	emit8(a, 0x8b);
+	emit8(a, 0x83);
+	emit32(a, reg * 4);
+}
+
+// mov ecx, [rbx + reg * 4]
+static void emit_load_ecx(assembler_t *a, int reg) {
+	emit8(a, 0x8b);
+	emit8(a, 0x8b);
+	emit32(a, reg * 4);
+}
+
+// mov [rbx + reg * 4], eax
+static void emit_store_eax(assembler_t *a, int reg) {
+	emit8(a, 0x89);
+	emit8(a, 0x83);
+	emit32(a, reg * 4);
+}
+
+// shl reg, shift where reg is 0 for eax and 1 for ecx
+static void emit_shift_left(assembler_t *a, int host_reg, int shift) {
+	if (shift == 0)
+		return;
+
+	emit8(a, 0xc1);
+	emit8(a, 0xe0 | host_reg);
+	emit8(a, shift);
+	a->flags_live = false;
+}
+
+// Records the operands of a flag setting operation in the lazy flags.  left is in eax, right in ecx unless it is an immediate.
+static void emit_record_flags(assembler_t *a, flags_operation_t operation, bool immediate, uint32_t right) {
+	emit8(a, 0xc7);							// mov dword [rbx + flags.operation], operation
+	emit8(a, 0x83);
+	emit32(a, offsetof(machine_t, flags.operation));
+	emit32(a, operation);
+	emit8(a, 0x89);							// mov [rbx + flags.left], eax
+	emit8(a, 0x83);
+	emit32(a, offsetof(machine_t, flags.left));
+
+	if (immediate) {
+		emit8(a, 0xc7);						// mov dword [rbx + flags.right], imm32
+		emit8(a, 0x83);
+		emit32(a, offsetof(machine_t, flags.right));
+		emit32(a, right);
+	} else {
+		emit8(a, 0x89);						// mov [rbx + flags.right], ecx
+		emit8(a, 0x8b);
+		emit32(a, offsetof(machine_t, flags.right));
+	}
+}
+
+// Emits a jump taken when the condition fails and returns its rel32 field
+static uint8_t *emit_condition_fails(assembler_t *a, int cond) {
+	if (a->flags_live) {
+		emit8(a, 0x0f);
+		emit8(a, condition_jumps[cond] ^ 1);
+	} else {
+		// The last flag setting operation was in another block so ask the interpreter
+		emit8(a, 0x48);						// mov rdi, rbx
+		emit8(a, 0x89);
+		emit8(a, 0xdf);
+		emit8(a, 0xbe);						// mov esi, cond
+		emit32(a, cond);
+		emit8(a, 0x48);						// mov rax, condition_passed
+		emit8(a, 0xb8);
+		uint64_t function = (uint64_t)(uintptr_t)condition_passed;
+		memcpy(a->code, &function, sizeof(function));
+		a->code += sizeof(function);
+		emit8(a, 0xff);						// call rax
+		emit8(a, 0xd0);
+		emit8(a, 0x84);						// test al, al
+		emit8(a, 0xc0);
+		emit8(a, 0x0f);
+		emit8(a, X86_JE);
+	}
+
+	uint8_t *field = a->code;
+	emit32(a, 0);
+	return field;
+}
+
+// With the guest address of a load or store in eax, leaves the page table entry in rdx.  Jumps to the
+// side exit if the address isn't aligned or the page traps the access.  Loads also clobber ecx.
+static void emit_page_lookup(assembler_t *a, int trap, int index) {
+	emit8(a, 0xa8);							// test al, 3
+	emit8(a, 3);
+	emit_exit_jump(a, X86_JNE, JIT_EXIT_INTERPRET + index);
+	emit8(a, 0x89);							// mov edx, eax
+	emit8(a, 0xc2);
+	emit8(a, 0xc1);							// shr edx, PAGE_SHIFT
+	emit8(a, 0xea);
+	emit8(a, PAGE_SHIFT);
+	emit8(a, 0x48);							// mov rdx, [rbx + rdx * 8 + page_table]
+	emit8(a, 0x8b);
+	emit8(a, 0x94);
+	emit8(a, 0xd3);
+	emit32(a, offsetof(machine_t, page_table));
+	emit8(a, 0xf6);							// test dl, trap
+	emit8(a, 0xc2);
+	emit8(a, trap);
+
+	// Registers mapped for reads are read from their copy up to the end of their region
+	if (trap & PAGE_MMIO_READS) {
+		_Static_assert(sizeof(mmio_region_t) == 24, "regions are indexed as 3 * index * 8");
+		emit8(a, 0x74);						// je ram
+		uint8_t *ram = a->code;
+		emit8(a, 0);
+		emit8(a, 0xf6);						// test dl, PAGE_READ_TRAP
+		emit8(a, 0xc2);
+		emit8(a, PAGE_READ_TRAP);
+		emit_exit_jump(a, X86_JNE, JIT_EXIT_INTERPRET + index);
+		emit8(a, 0x89);						// mov ecx, edx
+		emit8(a, 0xd1);
+		emit8(a, 0xc1);						// shr ecx, PAGE_REGION_SHIFT
+		emit8(a, 0xe9);
+		emit8(a, PAGE_REGION_SHIFT);
+		emit8(a, 0x83);						// and ecx, PAGE_REGION_MASK
+		emit8(a, 0xe1);
+		emit8(a, PAGE_REGION_MASK);
+		emit8(a, 0x8d);						// lea ecx, [rcx + rcx * 2]
+		emit8(a, 0x0c);
+		emit8(a, 0x49);
+		emit8(a, 0x3b);						// cmp eax, [rbx + rcx * 8 + mmio_regions.end]
+		emit8(a, 0x84);
+		emit8(a, 0xcb);
+		emit32(a, offsetof(machine_t, mmio_regions) + offsetof(mmio_region_t, end));
+		emit_exit_jump(a, 0x87, JIT_EXIT_INTERPRET + index);	// ja
+		*ram = (uint8_t)(a->code - ram - 1);
+	} else
+		emit_exit_jump(a, X86_JNE, JIT_EXIT_INTERPRET + index);
+
+	emit8(a, 0x48);							// and rdx, ~PAGE_FLAGS_MASK
+	emit8(a, 0x81);
+	emit8(a, 0xe2);
+	emit32(a, ~(uint32_t)PAGE_FLAGS_MASK);
+	a->flags_live = false;
+}
+
+// Leaves eax holding rn plus the offset
+static void emit_address(assembler_t *a, const decoded_instruction_t *decoded) {
+	emit_load_eax(a, decoded->rn);
+
+	if (decoded->immediate != 0) {
+		emit8(a, 0x05);						// add eax, imm32
+		emit32(a, decoded->immediate);
+		a->flags_live = false;
+	}
+}
+
+static void compile_op(assembler_t *a, const block_op_t *op, int index) {
+	const decoded_instruction_t *d = &op->decoded;
+
+	switch (op->kind) {
+		case OP_MOV_IMMEDIATE:
+			emit8(a, 0xc7);					// mov dword [rbx + rd * 4], imm32
+			emit8(a, 0x83);
+			emit32(a, d->rd * 4);
+			emit32(a, d->immediate);
+			break;
+
+		case OP_MOV_LSL:
+			emit_load_eax(a, d->rm);
+			emit_shift_left(a, 0, d->shift);
+			emit_store_eax(a, d->rd);
+			break;
+
+		case OP_SUB_IMMEDIATE:
+		case OP_ADD_IMMEDIATE:
+			emit_load_eax(a, d->rn);
+
+			if (d->s)
+				emit_record_flags(a, op->kind == OP_SUB_IMMEDIATE ? FLAGS_SUB : FLAGS_ADD, true, d->immediate);
+
+			emit8(a, op->kind == OP_SUB_IMMEDIATE ? 0x2d : 0x05);	// sub or add eax, imm32
+			emit32(a, d->immediate);
+			emit_store_eax(a, d->rd);
+			a->flags_live = d->s && op->kind == OP_SUB_IMMEDIATE;
+			break;
+
+		case OP_SUB_LSL:
+		case OP_ADD_LSL:
+			emit_load_ecx(a, d->rm);
+			emit_shift_left(a, 1, d->shift);
+			emit_load_eax(a, d->rn);
+
+			if (d->s)
+				emit_record_flags(a, op->kind == OP_SUB_LSL ? FLAGS_SUB : FLAGS_ADD, false, 0);
+
+			emit8(a, op->kind == OP_SUB_LSL ? 0x29 : 0x01);		// sub or add eax, ecx
+			emit8(a, 0xc8);
+			emit_store_eax(a, d->rd);
+			a->flags_live = d->s && op->kind == OP_SUB_LSL;
+			break;
+
+		case OP_CMP_IMMEDIATE:
+			emit_load_eax(a, d->rn);
+			emit_record_flags(a, FLAGS_SUB, true, d->immediate);
+			emit8(a, 0x3d);					// cmp eax, imm32
+			emit32(a, d->immediate);
+			a->flags_live = true;
+			break;
+
+		case OP_CMP_LSL:
+			emit_load_ecx(a, d->rm);
+			emit_shift_left(a, 1, d->shift);
+			emit_load_eax(a, d->rn);
+			emit_record_flags(a, FLAGS_SUB, false, 0);
+			emit8(a, 0x39);					// cmp eax, ecx
+			emit8(a, 0xc8);
+			a->flags_live = true;
+			break;
+
+		case OP_LOAD:
+		case OP_LOAD_ABSOLUTE:
+			if (op->kind == OP_LOAD)
+				emit_address(a, d);
+			else {
+				emit8(a, 0xb8);				// mov eax, addr
+				emit32(a, d->immediate);
+			}
+
+			emit_page_lookup(a, PAGE_READ_TRAP | PAGE_MMIO_READS, index);
+			emit8(a, 0x8b);					// mov eax, [rdx + rax]
+			emit8(a, 0x04);
+			emit8(a, 0x02);
+			emit_store_eax(a, d->rd);
+			break;
+
+		case OP_STORE:
+			emit_address(a, d);
+			emit_page_lookup(a, PAGE_WRITE_TRAP, index);
+			emit_load_ecx(a, d->rd);
+			emit8(a, 0x89);					// mov [rdx + rax], ecx
+			emit8(a, 0x0c);
+			emit8(a, 0x02);
+			break;
+
+		case OP_BRANCH:
+			emit_exit_jump(a, 0xe9, JIT_EXIT_TAKEN);
+			break;
+
+		default:
+			break;
+	}
+}
+
+static bool can_compile(const block_op_t *op) {
+	switch (op->kind) {
+		case OP_MOV_IMMEDIATE:
+		case OP_MOV_LSL:
+			return op->decoded.s == 0;		// MOVS needs the old C and V
+
+		case OP_SUB_IMMEDIATE:
+		case OP_SUB_LSL:
+		case OP_ADD_IMMEDIATE:
+		case OP_ADD_LSL:
+		case OP_CMP_IMMEDIATE:
+		case OP_CMP_LSL:
+		case OP_LOAD:
+		case OP_LOAD_ABSOLUTE:
+		case OP_STORE:
+		case OP_BRANCH:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+void init_jit(machine_t *m) {
+	void *mapping = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	m->jit_buffer = mapping != MAP_FAILED ? mapping : NULL;
+	m->jit_used = 0;
+}
+
+void free_jit(machine_t *m) {
+	if (m->jit_buffer != NULL)
+		munmap(m->jit_buffer, JIT_BUFFER_SIZE);
+
+	m->jit_buffer = NULL;
+}
+
+void flush_jit(machine_t *m) {
+	m->jit_used = 0;
+}
+
+// Compiles a block to host code.  Returns NULL if the block can't be compiled so must stay interpreted.
+jit_code_t jit_compile(machine_t *m, const block_t *block) {
+	// Loops polling the timer stay interpreted so the engine can skip their spinning.  Their loads from
+	// the timer would leave the compiled code on every pass anyway.
+	if (m->jit_buffer == NULL || m->jit_used + MAX_BLOCK_CODE > JIT_BUFFER_SIZE || (block->loop == LOOP_POLL && block->polls_timer))
+		return NULL;
+
+	for (int i = 0; i < block->length; i++)
+		if (!can_compile(&block->ops[i]))
+			return NULL;
+
+	assembler_t assembler;
+	assembler_t *a = &assembler;
+	uint8_t *start = m->jit_buffer + m->jit_used;
+	a->code = start;
+	a->num_patches = 0;
+	a->flags_live = false;
+	emit8(a, 0x53);							// push rbx, which also aligns the stack for calls
+	emit8(a, 0x48);							// mov rbx, rdi
+	emit8(a, 0x89);
+	emit8(a, 0xfb);
+
+	for (int i = 0; i < block->length; i++) {
+		const block_op_t *op = &block->ops[i];
+		int cond = op->decoded.cond;
+
+		if (cond == COND_AL) {
+			compile_op(a, op, i);
+			continue;
+		}
+
+		uint8_t *skip = emit_condition_fails(a, cond);
+		bool live_when_skipped = a->flags_live;
+		compile_op(a, op, i);
+		patch_rel32(skip, a->code);
+		a->flags_live = a->flags_live && live_when_skipped;
+	}
+
+	// Falling off the end of the block, either because the final branch wasn't taken or there wasn't one
+	emit_exit_jump(a, 0xe9, JIT_EXIT_FALLTHROUGH);
+
+	// Exits load the return value and share the epilogue
+	uint8_t *exits[JIT_EXIT_INTERPRET + MAX_PATCHES];
+	memset(exits, 0, sizeof(exits));
+
+	for (int i = 0; i < a->num_patches; i++) {
+		int exit = a->patches[i].exit;
+
+		if (exits[exit] == NULL) {
+			exits[exit] = a->code;
+			emit8(a, 0xb8);					// mov eax, exit
+			emit32(a, exit);
+			emit8(a, 0xe9);					// jmp epilogue
+			emit32(a, 0);
+		}
+
+		patch_rel32(a->patches[i].field, exits[exit]);
+	}
+
+	uint8_t *epilogue = a->code;
+	emit8(a, 0x5b);							// pop rbx
+	emit8(a, 0xc3);							// ret
+
+	for (int exit = 0; exit < JIT_EXIT_INTERPRET + MAX_PATCHES; exit++)
+		if (exits[exit] != NULL)
+			patch_rel32(exits[exit] + 6, epilogue);
+
+	m->jit_used = (a->code - m->jit_buffer + 15) & ~(size_t)15;
+	return (jit_code_t)start;
+}
+
+#else
+
+// No code generator for this host so every block stays interpreted
+void init_jit(machine_t *m) {
+	m->jit_buffer = NULL;
+}
+
+void free_jit(machine_t *m) {
+}
+
+void flush_jit(machine_t *m) {
+}
+
+jit_code_t jit_compile(machine_t *m, const block_t *block) {
+	return NULL;
+}
+
+#endif
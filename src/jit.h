@@ -0,0 +1,20 @@
+#ifndef __JIT_H
+#define __JIT_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Values returned by compiled blocks
+enum {
+	JIT_EXIT_TAKEN       = 0,		// The final branch was taken
+	JIT_EXIT_FALLTHROUGH = 1,		// Carry on at the instruction after the block
+	JIT_EXIT_INTERPRET   = 2		// Plus the index of the instruction the interpreter must execute next
+};
+
+// Public functions
+extern void init_jit(machine_t *m);
+extern void free_jit(machine_t *m);
+extern void flush_jit(machine_t *m);
+extern jit_code_t jit_compile(machine_t *m, const block_t *block);
+
+#endif
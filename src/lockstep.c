@@ -0,0 +1,432 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Differential execution of an engine against plain single stepping.
+//
+// The machine under test runs on its own engine for an interval, which the
+// block engines round up to the end of a block so even the shortest interval
+// checks whole blocks.  A reference machine holding the same state then single
+// steps, without the decode cache or any skipped loops, to the same retired
+// count and the two are compared: the registers of every mode, the CPSR and
+// SPSRs, the clock, the GPIO outputs and every page of RAM either machine
+// wrote.  Where the test engine skipped the time a poll loop spun for, the
+// reference spins through it, checking that no pass leaves the loop or changes
+// anything but what it read from the clock, before taking the same clock.
+// Writes are found by trapping the first write to each page after a
+// comparison, in the same way as checkpoints.
+// The first comparison that fails stops the run with the differences and the
+// instructions the reference ran since the machines last matched.
+//
+///////////////////////////////////////
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "disassemble.h"
+#include "error.h"
+#include "lockstep.h"
+#include "machine.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "timer.h"
+
+static const char *bank_names[NUM_BANKS] = { "usr", "fiq", "irq", "svc", "abt", "und" };
+
+static void track_written_pages(machine_t *m, lockstep_t *l) {
+	m->lockstep = l;
+
+	for (uint32_t addr = 0; addr < RAM_SIZE; addr += PAGE_SIZE)
+		set_page_trap(m, addr, PAGE_TRAP_COMPARE);
+}
+
+static void untrack_written_pages(machine_t *m, written_pages_t *written) {
+	for (uint32_t addr = 0; addr < RAM_SIZE; addr += PAGE_SIZE)
+		clear_page_trap(m, addr, PAGE_TRAP_COMPARE);
+
+	free(written->pages);
+	m->lockstep = NULL;
+}
+
+// Sets the two machines, which must hold the same state, running in lockstep.  The reference is switched
+// to single stepping without the decode cache and the test keeps its engine.
+lockstep_t *start_lockstep(machine_t *reference, machine_t *test, uint64_t interval) {
+	lockstep_t *l = calloc(1, sizeof(lockstep_t));
+
+	if (l == NULL) {
+		perror("Lockstep");
+		exit(2);
+	}
+
+	l->reference = reference;
+	l->test = test;
+	l->interval = interval > 0 ? interval : 1;
+	l->status = LOCKSTEP_MATCHING;
+	l->last_match = test->retired;
+
+	reference->execution_engine = ENGINE_STEP;
+	reference->decode_cache_enabled = false;
+	reference->skip_delay_loops = false;
+	reference->stop_on_self_branch = false;
+
+	track_written_pages(reference, l);
+	track_written_pages(test, l);
+	return l;
+}
+
+// Leaves both machines running on their own
+void stop_lockstep(lockstep_t *l) {
+	untrack_written_pages(l->reference, &l->reference_written);
+	untrack_written_pages(l->test, &l->test_written);
+	free(l->skips);
+	free(l);
+}
+
+// Lists the page for the next comparison.  Later writes to it aren't trapped until then.
+void note_written_page(machine_t *m, uint32_t addr) {
+	lockstep_t *l = m->lockstep;
+
+	if (l == NULL)
+		return;
+
+	written_pages_t *written = m == l->test ? &l->test_written : &l->reference_written;
+
+	if (written->count == written->capacity) {
+		written->capacity = written->capacity == 0 ? 16 : written->capacity * 2;
+		written->pages = realloc(written->pages, written->capacity * sizeof(uint32_t));
+	}
+
+	written->pages[written->count++] = addr >> PAGE_SHIFT;
+	clear_page_trap(m, addr, PAGE_TRAP_COMPARE);
+}
+
+// The test engine moved the clock on rather than spin in the poll loop.  The reference checks the skip
+// when it reaches the same retired count.
+void note_skipped_time(machine_t *m, uint32_t loop_addr, int loop_length, uint64_t cycles) {
+	lockstep_t *l = m->lockstep;
+
+	if (l == NULL || m != l->test)
+		return;
+
+	if (l->num_skips == l->skips_capacity) {
+		l->skips_capacity = l->skips_capacity == 0 ? 16 : l->skips_capacity * 2;
+		l->skips = realloc(l->skips, l->skips_capacity * sizeof(skipped_time_t));
+	}
+
+	l->skips[l->num_skips++] = (skipped_time_t){ m->retired, cycles, loop_addr, loop_length };
+}
+
+// Reads the word at addr without going near a peripheral, for the history.  0 if it isn't in memory.
+static uint32_t peek_word(machine_t *m, uint32_t addr) {
+	uintptr_t entry = m->page_table[addr >> PAGE_SHIFT];
+
+	if (entry & (PAGE_MMIO | PAGE_UNMAPPED))
+		return 0;
+
+	return *(uint32_t *)(page_host(entry) + (addr & ~3));
+}
+
+// Runs the test machine for the instructions.  Returns false if it hit something not implemented.
+static bool run_test(lockstep_t *l, uint64_t instructions) {
+	jmp_buf handler;
+	jmp_buf *previous = set_error_handler(&handler);
+	bool ran = true;
+
+	if (setjmp(handler) == 0)
+		execute(l->test, instructions);
+	else
+		ran = false;
+
+	set_error_handler(previous);
+	return ran;
+}
+
+// Single steps the reference, keeping the instruction in the history
+static void step_reference(lockstep_t *l) {
+	machine_t *m = l->reference;
+	lockstep_history_t *entry = &l->history[l->history_count++ % LOCKSTEP_HISTORY];
+
+	entry->addr = m->registers[pc] - 8;
+	entry->instruction = peek_word(m, entry->addr);
+	execute(m, 1);
+}
+
+// Single steps the reference through the time the test engine skipped, as it would have spun.  No pass
+// may leave the loop, and two passes run within the same microsecond must end with the same registers
+// and flags, so the loop changes nothing but what it reads from the clock.  Only LOCKSTEP_SPIN_TIME at
+// each end of a long skip is spun, the clock being moved on between, as a guest polling for seconds
+// would otherwise take minutes to check.  The test engine only finds the exit to the microsecond, so
+// spinning stops a microsecond short, and the reference is then put back at the loop with the clock
+// the test engine moved to.
+// Returns false, leaving the reference where it found the difference, if the skip was wrong.
+static bool check_skip(lockstep_t *l, const skipped_time_t *skip) {
+	machine_t *m = l->reference;
+	uint32_t registers[NUM_REGISTERS];
+	lazy_flags_t flags = m->flags;
+	uint64_t retired = m->retired;
+	uint64_t end = current_time(m) + skip->cycles;
+	uint64_t spin = LOCKSTEP_SPIN_TIME * CYCLES_PER_MICROSECOND;
+	uint64_t spun = current_time(m) + spin;			// Where the clock is moved on to the end
+	uint32_t loop_end = skip->loop_addr + skip->loop_length * 4;
+	uint32_t passed[NUM_REGISTERS];
+	uint32_t passed_cpsr = 0;
+	uint64_t pass_started = current_time(m) / CYCLES_PER_MICROSECOND;
+	uint64_t passed_started = 0;
+	bool have_passed = false;
+
+	memcpy(registers, m->registers, sizeof(registers));
+
+	while (current_time(m) + CYCLES_PER_MICROSECOND < end) {
+		step_reference(l);
+
+		uint32_t addr = m->registers[pc] - 8;
+
+		if (addr < skip->loop_addr || addr >= loop_end)
+			return false;
+
+		if (addr != skip->loop_addr)
+			continue;
+
+		uint64_t now = current_time(m) / CYCLES_PER_MICROSECOND;
+
+		if (have_passed && passed_started == now &&
+				(memcmp(passed, m->registers, sizeof(passed)) != 0 || read_cpsr(m) != passed_cpsr))
+			return false;
+
+		memcpy(passed, m->registers, sizeof(passed));
+		passed_cpsr = read_cpsr(m);
+		passed_started = pass_started;
+		pass_started = now;
+		have_passed = true;
+
+		if (current_time(m) >= spun && current_time(m) + spin < end) {
+			m->idle_cycles += end - spin - current_time(m);
+			pass_started = current_time(m) / CYCLES_PER_MICROSECOND;
+			have_passed = false;
+		}
+	}
+
+	memcpy(m->registers, registers, sizeof(registers));
+	m->flags = flags;
+	m->idle_cycles += end - current_time(m) + (m->retired - retired);
+	m->retired = retired;
+	return true;
+}
+
+// Single steps the reference until it has retired target instructions, checking the time the test engine
+// skipped on the way.  Returns false if it hit something not implemented or a skip was wrong.
+static bool catch_up(lockstep_t *l, uint64_t target) {
+	machine_t *m = l->reference;
+	jmp_buf handler;
+	jmp_buf *previous = set_error_handler(&handler);
+	int next_skip = 0;
+	bool ran = true;
+
+	if (setjmp(handler) == 0) {
+		for (;;) {
+			if (next_skip < l->num_skips && l->skips[next_skip].retired <= m->retired) {
+				const skipped_time_t *skip = &l->skips[next_skip++];
+
+				if (!check_skip(l, skip)) {
+					l->skip_failed = true;
+					l->failed_skip = *skip;
+					ran = false;
+					break;
+				}
+			} else if (m->retired < target)
+				step_reference(l);
+			else
+				break;
+		}
+	} else
+		ran = false;
+
+	set_error_handler(previous);
+	l->num_skips = 0;
+	return ran;
+}
+
+static bool pages_match(lockstep_t *l, const written_pages_t *written) {
+	for (int i = 0; i < written->count; i++) {
+		size_t offset = (size_t)written->pages[i] << PAGE_SHIFT;
+
+		if (memcmp(l->reference->ram + offset, l->test->ram + offset, PAGE_SIZE) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool machines_match(lockstep_t *l) {
+	machine_t *r = l->reference;
+	machine_t *t = l->test;
+
+	return memcmp(r->registers, t->registers, sizeof(r->registers)) == 0 &&
+		read_cpsr(r) == read_cpsr(t) &&
+		memcmp(r->banked_registers, t->banked_registers, sizeof(r->banked_registers)) == 0 &&
+		memcmp(r->spsr, t->spsr, sizeof(r->spsr)) == 0 &&
+		current_time(r) == current_time(t) &&
+		memcmp(r->pin_outputs, t->pin_outputs, sizeof(r->pin_outputs)) == 0 &&
+		memcmp(r->output_pins, t->output_pins, sizeof(r->output_pins)) == 0 &&
+		pages_match(l, &l->reference_written) && pages_match(l, &l->test_written);
+}
+
+// Traps the pages written since the last comparison again
+static void rearm_written_pages(machine_t *m, written_pages_t *written) {
+	for (int i = 0; i < written->count; i++)
+		set_page_trap(m, written->pages[i] << PAGE_SHIFT, PAGE_TRAP_COMPARE);
+
+	written->count = 0;
+}
+
+// Runs the test machine for max_instructions, comparing it with the reference after every interval
+// rounded up to the end of a block, and returns how many it executed.  Stops early if the test machine
+// stops or the status is no longer LOCKSTEP_MATCHING.
+uint64_t execute_lockstep(lockstep_t *l, uint64_t max_instructions) {
+	machine_t *reference = l->reference;
+	machine_t *test = l->test;
+	uint64_t start = test->retired;
+	uint64_t end = start + max_instructions;
+
+	test->overrun_limit = end;
+
+	while (test->retired < end && test->stop_reason == STOP_NONE && l->status == LOCKSTEP_MATCHING) {
+		uint64_t slice = end - test->retired < l->interval ? end - test->retired : l->interval;
+
+		l->test_failed = !run_test(l, slice);
+
+		// A failure leaves the retired count at the start of the block or instruction that failed, so
+		// the reference is given a block's worth of instructions to fail at the same place
+		if (l->test_failed) {
+			l->reference_failed = !catch_up(l, test->retired + LOCKSTEP_FAIL_WINDOW) && !l->skip_failed;
+			l->status = l->reference_failed ? LOCKSTEP_FAILED : LOCKSTEP_DIVERGED;
+			break;
+		}
+
+		if (!catch_up(l, test->retired)) {
+			l->reference_failed = !l->skip_failed;
+			l->status = LOCKSTEP_DIVERGED;
+			break;
+		}
+
+		l->comparisons++;
+
+		if (!machines_match(l)) {
+			l->status = LOCKSTEP_DIVERGED;
+			break;
+		}
+
+		rearm_written_pages(reference, &l->reference_written);
+		rearm_written_pages(test, &l->test_written);
+		l->last_match = test->retired;
+	}
+
+	test->overrun_limit = 0;
+	return test->retired - start;
+}
+
+static void print_difference(FILE *f, const char *name, uint32_t reference, uint32_t test) {
+	if (reference != test)
+		fprintf(f, "  %-12s %08x   %08x\n", name, reference, test);
+}
+
+static bool page_listed(const written_pages_t *written, uint32_t page) {
+	for (int i = 0; i < written->count; i++)
+		if (written->pages[i] == page)
+			return true;
+
+	return false;
+}
+
+static void print_page_differences(FILE *f, lockstep_t *l, uint32_t page) {
+	const uint32_t *reference = (const uint32_t *)(l->reference->ram + ((size_t)page << PAGE_SHIFT));
+	const uint32_t *test = (const uint32_t *)(l->test->ram + ((size_t)page << PAGE_SHIFT));
+	int reported = 0;
+
+	for (int i = 0; i < PAGE_SIZE / 4 && reported < MAX_REPORTED_WORDS; i++) {
+		if (reference[i] != test[i]) {
+			fprintf(f, "  [%08x]   %08x   %08x\n", (page << PAGE_SHIFT) + i * 4, reference[i], test[i]);
+			reported++;
+		}
+	}
+}
+
+// Describes the first comparison that failed: what the reference ran since the machines last matched
+// and everything that differs.  The PC is the address of the next instruction to execute.
+void print_divergence(lockstep_t *l, FILE *f) {
+	machine_t *r = l->reference;
+	machine_t *t = l->test;
+	char disassembly[DISASSEMBLY_LENGTH];
+	char name[16];
+
+	if (l->status != LOCKSTEP_DIVERGED)
+		return;
+
+	uint64_t since = r->retired - l->last_match;
+	uint64_t shown = since < LOCKSTEP_HISTORY ? since : LOCKSTEP_HISTORY;
+
+	fprintf(f, "Lockstep diverged at %llu instructions retired, %llu since the machines last matched\n",
+		(unsigned long long)r->retired, (unsigned long long)since);
+
+	if (l->skip_failed)
+		fprintf(f, "The test engine skipped %llu cycles of the loop at 0x%08x, which single stepping leaves or changes\n",
+			(unsigned long long)l->failed_skip.cycles, l->failed_skip.loop_addr);
+	else if (l->test_failed)
+		fprintf(f, "The test engine hit something not implemented that the reference ran\n");
+	else if (l->reference_failed)
+		fprintf(f, "The reference hit something not implemented that the test engine ran\n");
+
+	if (shown < since)
+		fprintf(f, "Last %llu instructions the reference ran:\n", (unsigned long long)shown);
+	else
+		fprintf(f, "Instructions the reference ran:\n");
+
+	for (uint64_t i = l->history_count - shown; i < l->history_count; i++) {
+		const lockstep_history_t *entry = &l->history[i % LOCKSTEP_HISTORY];
+		fprintf(f, "  %s\n", disassemble_instruction(entry->addr, entry->instruction, disassembly));
+	}
+
+	// After a failure the test machine stopped part way through, and after a wrong skip the reference
+	// did, so their states say nothing
+	if (l->test_failed || l->reference_failed || l->skip_failed)
+		return;
+
+	fprintf(f, "  %-12s %-10s %s\n", "", "reference", "test");
+
+	for (int reg = 0; reg < pc; reg++)
+		print_difference(f, register_names[reg], r->registers[reg], t->registers[reg]);
+
+	print_difference(f, "pc", r->registers[pc] - 8, t->registers[pc] - 8);
+	print_difference(f, "cpsr", read_cpsr(r), read_cpsr(t));
+
+	for (int bank = 0; bank < NUM_BANKS; bank++) {
+		for (int i = 0; i < NUM_BANKED; i++) {
+			snprintf(name, sizeof(name), "%s_%s", register_names[FIRST_BANKED + i], bank_names[bank]);
+			print_difference(f, name, r->banked_registers[bank][i], t->banked_registers[bank][i]);
+		}
+
+		snprintf(name, sizeof(name), "spsr_%s", bank_names[bank]);
+		print_difference(f, name, r->spsr[bank], t->spsr[bank]);
+	}
+
+	if (current_time(r) != current_time(t))
+		fprintf(f, "  %-12s %-10llu %llu\n", "time", (unsigned long long)current_time(r), (unsigned long long)current_time(t));
+
+	for (int bank = 0; bank < NUM_GPIO_BANKS; bank++) {
+		snprintf(name, sizeof(name), "gpio_out%d", bank);
+		print_difference(f, name, r->pin_outputs[bank], t->pin_outputs[bank]);
+		snprintf(name, sizeof(name), "gpio_fsel%d", bank);
+		print_difference(f, name, r->output_pins[bank], t->output_pins[bank]);
+	}
+
+	for (int i = 0; i < l->reference_written.count; i++)
+		print_page_differences(f, l, l->reference_written.pages[i]);
+
+	for (int i = 0; i < l->test_written.count; i++)
+		if (!page_listed(&l->reference_written, l->test_written.pages[i]))
+			print_page_differences(f, l, l->test_written.pages[i]);
+}
@@ -0,0 +1,74 @@
+#ifndef __LOCKSTEP_H
+#define __LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct machine machine_t;
+
+enum {
+	LOCKSTEP_HISTORY = 32,			// Reference instructions kept for the report of a divergence
+	LOCKSTEP_FAIL_WINDOW = 64,		// Instructions the reference may run on to fail where the test did, a block's worth
+	LOCKSTEP_SPIN_TIME = 2,			// Microseconds at each end of a skipped poll loop the reference spins through
+	MAX_REPORTED_WORDS = 8			// Differing words reported for each page
+};
+
+// RAM pages a machine has written since the last comparison, each once
+typedef struct written_pages {
+	uint32_t *pages;
+	int count;
+	int capacity;
+} written_pages_t;
+
+typedef enum {
+	LOCKSTEP_MATCHING,
+	LOCKSTEP_DIVERGED,				// The machines differ, see print_divergence
+	LOCKSTEP_FAILED					// Both hit the same thing the emulator doesn't implement
+} lockstep_status_t;
+
+typedef struct lockstep_history {
+	uint32_t addr;
+	uint32_t instruction;
+} lockstep_history_t;
+
+// Time the test engine skipped while a poll loop waited for the timer
+typedef struct skipped_time {
+	uint64_t retired;				// Retired count when it was skipped
+	uint64_t cycles;
+	uint32_t loop_addr;				// The loop, which was about to go round again
+	int loop_length;
+} skipped_time_t;
+
+// A machine under test run alongside a reference machine that only single steps.  The test runs on its
+// own engine for interval instructions, then the reference is stepped to the same retired count
+// and the two are compared.
+typedef struct lockstep {
+	machine_t *reference;
+	machine_t *test;
+	uint64_t interval;
+	lockstep_status_t status;
+	uint64_t comparisons;
+	uint64_t last_match;			// Retired count the machines last matched at
+	bool reference_failed;			// Hit something not implemented
+	bool test_failed;
+	bool skip_failed;				// Single stepping the time the test skipped left or changed the loop
+	skipped_time_t failed_skip;
+	written_pages_t reference_written;
+	written_pages_t test_written;
+	skipped_time_t *skips;			// Since the last comparison, for the reference to check as it gets there
+	int num_skips;
+	int skips_capacity;
+	lockstep_history_t history[LOCKSTEP_HISTORY];	// Ring of the last instructions the reference ran
+	uint64_t history_count;
+} lockstep_t;
+
+// Public functions
+extern lockstep_t *start_lockstep(machine_t *reference, machine_t *test, uint64_t interval);
+extern void stop_lockstep(lockstep_t *l);
+extern uint64_t execute_lockstep(lockstep_t *l, uint64_t max_instructions);
+extern void print_divergence(lockstep_t *l, FILE *f);
+extern void note_written_page(machine_t *m, uint32_t addr);
+extern void note_skipped_time(machine_t *m, uint32_t loop_addr, int loop_length, uint64_t cycles);
+
+#endif
@@ -0,0 +1,55 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// A complete emulated machine.
+//
+// All of the emulator's state lives in a machine_t so a process can run
+// as many machines as it likes, each on its own thread.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "block.h"
+#include "breakpoint.h"
+#include "checkpoint.h"
+#include "cpu.h"
+#include "gpio.h"
+#include "machine.h"
+#include "memory.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "trace.h"
+
+// Returns a powered up machine with nothing loaded into memory
+machine_t *create_machine() {
+	machine_t *m = calloc(1, sizeof(machine_t));
+
+	if (m == NULL) {
+		perror("Machine");
+		exit(2);
+	}
+
+	init_cpu(m);
+	init_memory(m);
+	init_gpio(m);
+	init_timer(m);
+	init_decode_cache(m);
+	init_blocks(m);
+	return m;
+}
+
+void destroy_machine(machine_t *m) {
+	stop_trace(m);
+	stop_profile(m);
+	free_checkpoints(m);
+	free_gpio(m);
+	free_blocks(m);
+	free_breakpoints(m);
+	free_memory(m);
+	free(m);
+}
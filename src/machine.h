@@ -0,0 +1,162 @@
+#ifndef __MACHINE_H
+#define __MACHINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "block.h"
+#include "breakpoint.h"
+#include "checkpoint.h"
+#include "cpu.h"
+#include "flags.h"
+#include "flow.h"
+#include "gpio.h"
+#include "lockstep.h"
+#include "memory.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "shared.h"
+#include "timer.h"
+#include "trace.h"
+#include "vcd.h"
+
+// Everything one emulated Raspberry Pi needs.  Nothing in the emulator is global, so any number of
+// machines can run at once as long as each is only used by one thread at a time.
+struct machine {
+	// CPU.  The registers come first as the compiled blocks reach everything from them.
+	uint32_t registers[NUM_REGISTERS];		// The registers visible in the current mode
+	lazy_flags_t flags;						// CPSR condition flags
+	uint32_t cpsr;							// CPSR apart from the condition flags
+	uint32_t banked_registers[NUM_BANKS][NUM_BANKED];	// r8 to r14 of the banks that aren't current
+	uint32_t spsr[NUM_BANKS];				// User and system mode don't have one
+	execution_engine_t execution_engine;
+	bool decode_cache_enabled;
+	bool skip_delay_loops;					// Run countdown loops in one go, see skip_countdown_loop
+	stop_reason_t stop_reason;
+	bool stop_on_self_branch;
+	trace_writer_t *trace;					// NULL unless instructions are being traced
+	profile_t *profile;						// NULL unless the guest is being profiled
+	lockstep_t *lockstep;					// NULL unless it runs in lockstep with another machine
+	uint8_t code_pages[NUM_CODE_PAGES];		// CODE_PAGE_ flags of every page
+	decoded_instruction_t decode_cache[DECODE_CACHE_SIZE];
+
+	// Virtual clock
+	uint64_t retired;						// Instructions retired since power on
+	uint64_t idle_cycles;					// Cycles skipped while the guest had nothing to do
+	event_t events[MAX_EVENTS];				// Min-heap on time
+	int num_events;
+	uint64_t next_event;					// Time of the earliest event, NO_EVENT if there are none
+	uint64_t slice_end;						// Retired count the engine is running to, 0 outside execute()
+	uint64_t overrun_limit;					// Retired count the block engines may finish a block past the slice to
+
+	// Memory
+	uint8_t *ram;
+	uint64_t slow_access_count;				// Accesses that didn't take the fast path
+	uint64_t mmio_access_count;				// Of those, the ones to peripheral registers
+	bool mmio_reads_trapped;				// Reads of the pages map_mmio_reads mapped are all counted
+	mmio_region_t mmio_regions[MAX_MMIO_REGIONS];
+	int num_mmio_regions;
+	uintptr_t page_table[NUM_PAGES];		// One entry for every page of the 4GB guest address space
+	uint8_t page_traps[NUM_PAGES];			// Why each RAM page is trapped, PAGE_TRAP_ bits
+	uint32_t file_pages[RAM_PAGES / 32];	// RAM pages mapped from a file, which may not be resident
+	checkpoints_t *checkpoints;				// NULL unless the debugger can go back
+
+	// Translated blocks
+	uint8_t *block_arena;
+	size_t arena_used;
+	block_t *block_hash[BLOCK_HASH_SIZE];
+	unsigned flush_count;					// Incremented whenever translations are thrown away
+	uint32_t first_translated_page;			// Code pages blocks were translated from are all in this range,
+	uint32_t last_translated_page;			// which is empty when first is past last
+	code_map_t *code_map;					// Code found in the image, NULL if it hasn't been mapped
+	bool code_map_translated;				// Its blocks have been translated ahead of running
+
+	// Compiled blocks
+	uint8_t *jit_buffer;					// NULL if there is no code generator for the host
+	size_t jit_used;
+	uint64_t jit_threshold;					// Times a block is interpreted before it is compiled
+
+	// Breakpoints and watchpoints
+	uint32_t *breakpoint_chunks[NUM_BREAKPOINT_CHUNKS];
+	int num_breakpoints;
+	watchpoint_t watchpoints[MAX_WATCHPOINTS];
+	uint32_t hit_addr;						// Last watchpoint hit
+	uint32_t hit_value;
+	bool hit_write;
+
+	// GPIO
+	uint32_t *gpio_registers;				// Page the guest reads the registers from, by offset / 4
+	uint32_t pin_outputs[NUM_GPIO_BANKS];	// Levels the guest has set and cleared
+	uint32_t output_pins[NUM_GPIO_BANKS];	// Pins whose function is output, from GPFSEL
+	uint32_t pull_ups[NUM_GPIO_BANKS];		// Inputs read high
+	uint32_t input_pins[NUM_GPIO_BANKS];	// Inputs driven from outside, which override the pulls
+	uint32_t input_levels[NUM_GPIO_BANKS];
+	bool led_messages;
+	vcd_writer_t *vcd;						// NULL unless pin changes are being recorded
+	shared_gpio_t *shared_gpio;				// NULL unless the state is shared with other processes
+	char *shared_gpio_name;
+	unsigned shared_inputs_sequence;		// Last version of the shared inputs applied
+	int stop_pin;							// Pin whose output level stops execution, -1 for none
+	bool stop_level;
+
+	// System timer
+	uint32_t timer_status;
+	uint32_t timer_compare[NUM_TIMER_COMPARES];
+	bool timer_read;						// Set by every read so loops polling the timer can be spotted
+};
+
+// Last byte of the registers a PAGE_MMIO_READS entry maps.  The region starts at the page.
+static inline uint32_t mmio_reads_end(machine_t *m, uintptr_t entry) {
+	return m->mmio_regions[entry >> PAGE_REGION_SHIFT & PAGE_REGION_MASK].end;
+}
+
+// Fast path for an aligned access to RAM that isn't trapped: one table load plus an offset.  Registers
+// mapped for reads are read from their copy the same way once the address is known to be one of them.
+static inline uint32_t read_word(machine_t *m, uint32_t addr) {
+	uintptr_t entry = m->page_table[addr >> PAGE_SHIFT];
+
+	if (((entry & (PAGE_READ_TRAP | PAGE_MMIO_READS)) | (addr & 3)) == 0)
+		return *(uint32_t *)(page_host(entry) + addr);
+
+	if (((entry & PAGE_READ_TRAP) | (addr & 3)) == 0 && addr <= mmio_reads_end(m, entry))
+		return *(uint32_t *)(page_host(entry) + addr);
+
+	return read_word_slow(m, addr);
+}
+
+static inline void write_word(machine_t *m, uint32_t addr, uint32_t value) {
+	uintptr_t entry = m->page_table[addr >> PAGE_SHIFT];
+
+	if (((entry & PAGE_WRITE_TRAP) | (addr & 3)) == 0)
+		*(uint32_t *)(page_host(entry) + addr) = value;
+	else
+		write_word_slow(m, addr, value);
+}
+
+// Instruction fetch.  Traps on RAM pages are only for loads and stores, so RAM is always read
+// directly and watchpoints only see the data the guest loads.
+static inline uint32_t fetch_word(machine_t *m, uint32_t addr) {
+	uintptr_t entry = m->page_table[addr >> PAGE_SHIFT];
+
+	if (((entry & (PAGE_MMIO | PAGE_MMIO_READS | PAGE_UNMAPPED)) | (addr & 3)) == 0)
+		return *(uint32_t *)(page_host(entry) + addr);
+
+	return read_word_slow(m, addr);
+}
+
+// True if there is a breakpoint on the instruction at addr
+static inline bool breakpoint_at(machine_t *m, uint32_t addr) {
+	if (m->num_breakpoints == 0)
+		return false;
+
+	uint32_t *chunk = m->breakpoint_chunks[addr >> BREAKPOINT_CHUNK_SHIFT];
+	uint32_t word = (addr & BREAKPOINT_CHUNK_MASK) >> 2;
+
+	return chunk != NULL && (chunk[word >> 5] >> (word & 31) & 1);
+}
+
+// Public functions
+extern machine_t *create_machine();
+extern void destroy_machine(machine_t *m);
+
+#endif
@@ -9,65 +9,333 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "breakpoint.h"
+#include "checkpoint.h"
+#include "cpu.h"
 #include "error.h"
-#include "gpio.h"
+#include "lockstep.h"
+#include "machine.h"
 #include "memory.h"
 
-enum { MEMORY_SIZE_WORDS = 1024 * 16 };
+static uintptr_t ram_entry(machine_t *m, uint32_t page_addr) {
+    return (uintptr_t)(m->ram + page_addr) - page_addr;
+}
+
+static void map_ram(machine_t *m) {
+    if (m->ram != NULL)
+        munmap(m->ram, RAM_SIZE);
+
+    m->ram = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (m->ram == MAP_FAILED) {
+        perror("Guest RAM");
+        exit(2);
+    }
 
-static uint32_t memory[MEMORY_SIZE_WORDS];
+    memset(m->file_pages, 0, sizeof(m->file_pages));
+}
+
+void init_memory(machine_t *m) {
+    map_ram(m);
+
+    for (uint32_t page = 0; page < NUM_PAGES; page++)
+        m->page_table[page] = PAGE_UNMAPPED | PAGE_READ_TRAP | PAGE_WRITE_TRAP;
 
-enum {
-    GPIO_START = 0x20200000,
-    GPIO_END   = 0x202000b0
-};
+    for (uint32_t addr = 0; addr < RAM_SIZE; addr += PAGE_SIZE)
+        m->page_table[addr >> PAGE_SHIFT] = ram_entry(m, addr);
 
-uint32_t read_word(uint32_t addr) {
-    if (GPIO_START <= addr && addr <= GPIO_END)
-        return gpio_read_word(addr);
+    memset(m->page_traps, 0, sizeof(m->page_traps));
+    m->num_mmio_regions = 0;
+}
+
+void free_memory(machine_t *m) {
+    if (m->ram != NULL)
+        munmap(m->ram, RAM_SIZE);
 
-    assert(addr / 4 < MEMORY_SIZE_WORDS);
+    m->ram = NULL;
+}
 
-    if ((addr & 3) == 0) {
-        return memory[addr >> 2];
+// Puts zeros back in all of RAM by mapping fresh pages over it.  The host addresses don't change.
+void clear_ram(machine_t *m) {
+    if (mmap(m->ram, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        perror("Guest RAM");
+        exit(2);
     }
 
-    not_implemented(__func__, "Unaligned read word");
-    assert(0);
+    memset(m->file_pages, 0, sizeof(m->file_pages));
+}
+
+// Maps part of a file over RAM copy-on-write, so nothing is read until the guest touches it.  addr
+// and offset must be host page aligned.  Returns false if it can't be mapped.
+bool map_ram_from_file(machine_t *m, uint32_t addr, size_t size, int fd, off_t offset) {
+    if (mmap(m->ram + addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+        return false;
+
+    for (uint32_t page = addr >> PAGE_SHIFT; page < (addr + size + PAGE_MASK) >> PAGE_SHIFT; page++)
+        m->file_pages[page >> 5] |= 1u << (page & 31);
+
+    return true;
 }
 
-void write_word(uint32_t addr, uint32_t value) {
-    if (GPIO_START <= addr && addr <= GPIO_END)
-        return gpio_write_word(addr, value);
+// Peripherals call this to have accesses to their registers passed to them
+void register_mmio(machine_t *m, uint32_t start, uint32_t size, uint32_t (*read_word)(machine_t *m, uint32_t addr), void (*write_word)(machine_t *m, uint32_t addr, uint32_t value)) {
+    assert(m->num_mmio_regions < MAX_MMIO_REGIONS);
+    assert((start & PAGE_MASK) == 0);
+
+    mmio_region_t *region = &m->mmio_regions[m->num_mmio_regions++];
+    region->start = start;
+    region->end = start + size - 1;
+    region->read_word = read_word;
+    region->write_word = write_word;
 
-    assert(addr / 4 < MEMORY_SIZE_WORDS);
+    for (uint32_t page = start >> PAGE_SHIFT; page <= region->end >> PAGE_SHIFT; page++)
+        m->page_table[page] = (uintptr_t)(region - m->mmio_regions) << PAGE_SHIFT | PAGE_MMIO | PAGE_READ_TRAP | PAGE_WRITE_TRAP;
+}
+
+// Has reads from the page of a registered region served from a page aligned copy of its registers,
+// which the peripheral keeps up to date, so polling a register costs little more than reading RAM.
+// The fast paths check reads against the end of the region, so the rest of the page isn't read
+// from the copy.  Writes are still passed to the peripheral.
+void map_mmio_reads(machine_t *m, uint32_t start, uint32_t *registers) {
+    assert((start & PAGE_MASK) == 0 && ((uintptr_t)registers & PAGE_MASK) == 0);
+    int index = 0;
+
+    while (index < m->num_mmio_regions && m->mmio_regions[index].start != start)
+        index++;
+
+    assert(index < m->num_mmio_regions);
+    m->page_table[start >> PAGE_SHIFT] = ((uintptr_t)registers - start) | (uintptr_t)index << PAGE_REGION_SHIFT | PAGE_MMIO_READS | PAGE_WRITE_TRAP;
+}
+
+// Works out the trap bits of a RAM page's entry from the reasons it is trapped.  Writes to the pages
+// map_mmio_reads mapped are always trapped and their reads are trapped to be watched or counted.
+static void update_traps(machine_t *m, uint32_t page) {
+    uintptr_t entry = m->page_table[page];
+
+    if (entry & (PAGE_MMIO | PAGE_UNMAPPED))
+        return;
+
+    if (entry & PAGE_MMIO_READS) {
+        if (m->mmio_reads_trapped || (m->page_traps[page] & PAGE_TRAPS_READS))
+            m->page_table[page] = entry | PAGE_READ_TRAP;
+        else
+            m->page_table[page] = entry & ~(uintptr_t)PAGE_READ_TRAP;
 
-    if ((addr & 3) == 0) {
-        memory[addr >> 2] = value;
         return;
     }
 
-    not_implemented(__func__, "Unaligned write word");
-    assert(0);
+    entry = page_host(entry);
+
+    if (m->page_traps[page] != 0)
+        entry |= PAGE_WRITE_TRAP;
+
+    if (m->page_traps[page] & PAGE_TRAPS_READS)
+        entry |= PAGE_READ_TRAP;
+
+    m->page_table[page] = entry;
+}
+
+// Sends reads of the pages map_mmio_reads has mapped down the slow path, or back to the copy, so
+// every access to a peripheral can be counted
+void trap_mmio_reads(machine_t *m, bool trapped) {
+    m->mmio_reads_trapped = trapped;
+
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        if (m->page_table[page] & PAGE_MMIO_READS)
+            update_traps(m, page);
+    }
+}
+
+void set_page_trap(machine_t *m, uint32_t addr, int reason) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    m->page_traps[page] |= reason;
+    update_traps(m, page);
+}
+
+void clear_page_trap(machine_t *m, uint32_t addr, int reason) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    m->page_traps[page] &= ~reason;
+    update_traps(m, page);
+}
+
+uint64_t slow_accesses(machine_t *m) {
+    return m->slow_access_count;
 }
 
-int load_memory_from_file(char *filename, uint32_t addr) {
+uint64_t addressable_memory() {
+    return RAM_SIZE;
+}
+
+// Bytes of guest RAM the host has actually committed
+uint64_t resident_memory(machine_t *m) {
+    long host_page_size = sysconf(_SC_PAGESIZE);
+    size_t host_pages = (RAM_SIZE + host_page_size - 1) / host_page_size;
+    unsigned char *residency = malloc(host_pages);
+    uint64_t resident = 0;
+
+    if (m->ram == NULL || residency == NULL || mincore(m->ram, RAM_SIZE, residency) != 0) {
+        free(residency);
+        return 0;
+    }
+
+    for (size_t page = 0; page < host_pages; page++)
+        resident += residency[page] & 1;
+
+    free(residency);
+    return resident * host_page_size;
+}
+
+// Returns a byte for every host page of RAM, set if the page may hold something other than zeros,
+// and the host page size.  Pages that have been written are resident and pages mapped from a file
+// are counted whether they are resident or not.  Returns NULL if it can't be worked out.
+uint8_t *touched_ram(machine_t *m, long *host_page_size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t host_pages = (RAM_SIZE + page_size - 1) / page_size;
+    uint8_t *touched = malloc(host_pages);
+
+    if (touched == NULL || mincore(m->ram, RAM_SIZE, touched) != 0) {
+        free(touched);
+        return NULL;
+    }
+
+    for (size_t page = 0; page < host_pages; page++)
+        touched[page] &= 1;
+
+    for (uint32_t page = 0; page < RAM_PAGES; page++) {
+        if (m->file_pages[page >> 5] >> (page & 31) & 1)
+            touched[((size_t)page << PAGE_SHIFT) / page_size] = 1;
+    }
+
+    *host_page_size = page_size;
+    return touched;
+}
+
+void print_memory_usage(machine_t *m) {
+    fprintf(stderr, "Guest RAM: %llu KB resident of %llu KB addressable\n", (unsigned long long)resident_memory(m) / 1024, (unsigned long long)addressable_memory() / 1024);
+}
+
+// The entry of a page that reads are mapped for holds the copy, so the region's index is kept in the
+// flag bits below it
+static mmio_region_t *mmio_region(machine_t *m, uintptr_t entry, uint32_t addr) {
+    size_t index = entry & PAGE_MMIO_READS ? entry >> PAGE_REGION_SHIFT & PAGE_REGION_MASK : entry >> PAGE_SHIFT;
+    mmio_region_t *region = &m->mmio_regions[index];
+
+    if (addr < region->start || addr > region->end)
+        return NULL;
+
+    return region;
+}
+
+uint32_t read_word_slow(machine_t *m, uint32_t addr) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    uintptr_t entry = m->page_table[page];
+    uint32_t value;
+    m->slow_access_count++;
+
+    if ((addr & 3) != 0)
+        not_implemented(__func__, "Unaligned read word");
+
+    if (entry & (PAGE_MMIO | PAGE_MMIO_READS))
+        m->mmio_access_count++;
+
+    if (entry & PAGE_MMIO) {
+        mmio_region_t *region = mmio_region(m, entry, addr);
+
+        if (region == NULL)
+            not_implemented(__func__, "Read from 0x%08x", addr);
+
+        value = region->read_word(m, addr);
+    } else if (entry & PAGE_MMIO_READS) {
+        if (mmio_region(m, entry, addr) == NULL)
+            not_implemented(__func__, "Read from 0x%08x", addr);
+
+        value = *(uint32_t *)(page_host(entry) + addr);
+    } else if ((entry & PAGE_UNMAPPED) == 0)
+        value = *(uint32_t *)(page_host(entry) + addr);
+    else
+        not_implemented(__func__, "Read from 0x%08x", addr);
+
+    if (m->page_traps[page] & PAGE_TRAP_WATCH)
+        watchpoint_access(m, addr, value, false);
+
+    return value;
+}
+
+void write_word_slow(machine_t *m, uint32_t addr, uint32_t value) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    uintptr_t entry = m->page_table[page];
+    m->slow_access_count++;
+
+    if ((addr & 3) != 0)
+        not_implemented(__func__, "Unaligned write word");
+
+    if (entry & (PAGE_MMIO | PAGE_MMIO_READS)) {
+        mmio_region_t *region = mmio_region(m, entry, addr);
+        m->mmio_access_count++;
+
+        if (region == NULL)
+            not_implemented(__func__, "Write to 0x%08x with value 0x%08x", addr, value);
+
+        region->write_word(m, addr, value);
+    } else if ((entry & PAGE_UNMAPPED) == 0) {
+        if (m->page_traps[page] & PAGE_TRAP_DIRTY)
+            save_written_page(m, addr);
+
+        if (m->page_traps[page] & PAGE_TRAP_COMPARE)
+            note_written_page(m, addr);
+
+        *(uint32_t *)(page_host(entry) + addr) = value;
+
+        if (m->page_traps[page] & PAGE_TRAP_CODE)
+            invalidate_decoded_instruction(m, addr);
+    } else
+        not_implemented(__func__, "Write to 0x%08x with value 0x%08x", addr, value);
+
+    if (m->page_traps[page] & PAGE_TRAP_WATCH)
+        watchpoint_access(m, addr, value, true);
+}
+
+// The image is mapped copy-on-write over guest RAM so nothing is read until the guest touches it.
+// Returns the size of the image in words, or -1 if it can't be loaded.
+int load_memory_from_file(machine_t *m, char *filename, uint32_t addr) {
 	FILE *f = fopen(filename, "rb");
 
-	if (f == NULL) { 
+	if (f == NULL) {
 		perror(filename);
-		exit(2);
+		return -1;
 	}
 
 	fseek(f, 0, SEEK_END);
-	int size = ftell(f);
+	long size = ftell(f);
 	fseek(f, 0, SEEK_SET);
 
-	if (size != fread(memory + addr / 4, sizeof(uint8_t), size, f)) {
-		fprintf(stderr, "Problem reading reading file '%s'.", filename);
-        exit(2);
+	if (size < 0) {
+		perror(filename);
+		fclose(f);
+		return -1;
+	}
+
+	if (addr > RAM_SIZE || size > RAM_SIZE - addr) {
+		fprintf(stderr, "'%s' doesn't fit in memory at 0x%x.\n", filename, addr);
+		fclose(f);
+		return -1;
+	}
+
+	if (size > 0 && (addr % sysconf(_SC_PAGESIZE)) == 0) {
+		if (!map_ram_from_file(m, addr, size, fileno(f), 0)) {
+			perror(filename);
+			fclose(f);
+			return -1;
+		}
+	} else if ((size_t)size != fread(m->ram + addr, sizeof(uint8_t), size, f)) {
+		fprintf(stderr, "Problem reading file '%s'.\n", filename);
+		fclose(f);
+		return -1;
 	}
 
 	fclose(f);
-    return size / 4;
-}
\ No newline at end of file
+	return size / 4;
+}
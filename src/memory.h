@@ -1,12 +1,81 @@
 #ifndef __MEMORY_H
 #define __MEMORY_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-// Public functions
-extern int load_memory_from_file(char *filename, uint32_t addr);
+typedef struct machine machine_t;
 
-extern uint32_t read_word(uint32_t addr);
-extern void write_word(uint32_t addr, uint32_t value);
+// Guest memory is looked up a 4K page at a time
+enum {
+	PAGE_SHIFT = 12,
+	PAGE_SIZE  = 1 << PAGE_SHIFT,
+	PAGE_MASK  = PAGE_SIZE - 1,
+	NUM_PAGES  = 1 << (32 - PAGE_SHIFT),
 
-#endif
\ No newline at end of file
+	MAX_MMIO_REGIONS = 16,
+
+	RAM_SIZE  = 512 * 1024 * 1024,
+	RAM_PAGES = RAM_SIZE >> PAGE_SHIFT
+};
+
+// Low bits of a page table entry.  The rest of a RAM entry is the host address of the page minus
+// the guest address of the page, so the host address of a guest address is page_host(entry) + addr.
+enum {
+	PAGE_READ_TRAP  = 1,			// Reads take the slow path
+	PAGE_WRITE_TRAP = 2,			// Writes take the slow path
+	PAGE_MMIO       = 4,			// Rest of the entry is the index of the page's mmio_region_t
+	PAGE_UNMAPPED   = 8,			// Nothing is at this address
+	PAGE_MMIO_READS = 16,			// Peripheral registers read from a host copy up to the end of their region
+
+	PAGE_REGION_SHIFT = 5,			// Index of the mmio_region_t of a PAGE_MMIO_READS page, below the host address
+	PAGE_REGION_MASK  = 15,
+
+	PAGE_FLAGS_MASK = PAGE_MASK
+};
+
+// Reasons a RAM page can be trapped
+enum {
+	PAGE_TRAP_CODE    = 1,			// Writes must drop decoded copies of instructions on the page
+	PAGE_TRAP_WATCH   = 2,			// Reads and writes are checked against watchpoints
+	PAGE_TRAP_DIRTY   = 4,			// The first write saves the page for the latest checkpoint
+	PAGE_TRAP_COMPARE = 8,			// The first write lists the page for lockstep to compare
+
+	PAGE_TRAPS_READS = PAGE_TRAP_WATCH
+};
+
+// A peripheral's registers
+typedef struct mmio_region {
+	uint32_t start;
+	uint32_t end;					// Last byte of the region
+	uint32_t (*read_word)(machine_t *m, uint32_t addr);
+	void (*write_word)(machine_t *m, uint32_t addr, uint32_t value);
+} mmio_region_t;
+
+static inline uintptr_t page_host(uintptr_t entry) {
+	return entry & ~(uintptr_t)PAGE_FLAGS_MASK;
+}
+
+// Public functions.  The read_word and write_word fast paths are in machine.h as they need the page table.
+extern void init_memory(machine_t *m);
+extern void free_memory(machine_t *m);
+extern int load_memory_from_file(machine_t *m, char *filename, uint32_t addr);
+extern void clear_ram(machine_t *m);
+extern bool map_ram_from_file(machine_t *m, uint32_t addr, size_t size, int fd, off_t offset);
+extern uint8_t *touched_ram(machine_t *m, long *host_page_size);
+extern void register_mmio(machine_t *m, uint32_t start, uint32_t size, uint32_t (*read_word)(machine_t *m, uint32_t addr), void (*write_word)(machine_t *m, uint32_t addr, uint32_t value));
+extern void map_mmio_reads(machine_t *m, uint32_t start, uint32_t *registers);
+extern void trap_mmio_reads(machine_t *m, bool trapped);
+extern void set_page_trap(machine_t *m, uint32_t addr, int reason);
+extern void clear_page_trap(machine_t *m, uint32_t addr, int reason);
+extern uint64_t slow_accesses(machine_t *m);
+extern uint64_t addressable_memory();
+extern uint64_t resident_memory(machine_t *m);
+extern void print_memory_usage(machine_t *m);
+
+extern uint32_t read_word_slow(machine_t *m, uint32_t addr);
+extern void write_word_slow(machine_t *m, uint32_t addr, uint32_t value);
+
+#endif
@@ -8,34 +8,188 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "block.h"
+#include "checkpoint.h"
 #include "cpu.h"
 #include "debugger.h"
 #include "disassemble.h"
+#include "flow.h"
+#include "gpio.h"
+#include "headless.h"
+#include "machine.h"
 #include "memory.h"
+#include "profile.h"
+#include "shared.h"
+#include "snapshot.h"
+#include "trace.h"
 
-enum { START_ADDR = 0x8000 };
+static void usage() {
+	fprintf(stderr, "usage: piemu [-d] [-n] [-q] [-e step|blocks|jit] [-i image] [-a addr] [-r file] [-k instructions] [-K MB] [-P file] [-F file] [-S interval] [-w file] [-x name]\n");
+	fprintf(stderr, "       piemu -H [-m instructions] [-t seconds] [-p addr] [-g pin=level] [-l] [-s file] [-T file [-R first:last]] [-L instructions] [-w file] [-o file] ...\n");
+	fprintf(stderr, "  -d  disassemble the image, labelling the functions and branch targets reached from its start\n");
+	fprintf(stderr, "  -n  disable the decoded instruction cache\n");
+	fprintf(stderr, "  -q  don't print the OK LED messages\n");
+	fprintf(stderr, "  -e  execution engine used when running freely (default jit)\n");
+	fprintf(stderr, "  -i  kernel image (default kernel.img)\n");
+	fprintf(stderr, "  -a  address the image is loaded at (default 0x8000)\n");
+	fprintf(stderr, "  -r  start from a snapshot rather than the image\n");
+	fprintf(stderr, "  -k  checkpoint this often so the debugger can go back with rs and rc (default 100000 with -K)\n");
+	fprintf(stderr, "  -K  memory kept for checkpoints before the oldest are dropped (default 64)\n");
+	fprintf(stderr, "  -T  trace the instructions to a file for piemu-trace.  This runs the step engine, about 1.6 to 1.9\n");
+	fprintf(stderr, "      times slower traced than not, and 3 to 70 times slower than the jit engine.\n");
+	fprintf(stderr, "  -R  only trace the instructions from first to last, e.g. 0x8000:0x9000\n");
+	fprintf(stderr, "  -P  profile the guest on the block engine and write the hot blocks to a file when it stops\n");
+	fprintf(stderr, "  -F  profile the guest and write the samples to a file as folded stacks for flamegraph.pl\n");
+	fprintf(stderr, "  -S  sample the PC every this many cycles, or microseconds of host time ending in us (default 10000)\n");
+	fprintf(stderr, "  -w  record the GPIO pins to a Value Change Dump file for GTKWave\n");
+	fprintf(stderr, "  -x  share the GPIO with other processes in the POSIX shared memory segment, e.g. /piemu\n");
+	fprintf(stderr, "  -H  run headless without the debugger and print a JSON summary\n");
+	fprintf(stderr, "  -m  stop after this many instructions\n");
+	fprintf(stderr, "  -t  stop after this many seconds\n");
+	fprintf(stderr, "  -p  stop when the PC reaches this address\n");
+	fprintf(stderr, "  -g  stop when the GPIO pin is driven to the level, e.g. 16=0\n");
+	fprintf(stderr, "  -l  run delay loops instruction by instruction rather than skipping to their end\n");
+	fprintf(stderr, "  -s  save a snapshot of the machine when it stops, unless it hit something not implemented\n");
+	fprintf(stderr, "  -L  compare the engine with a single stepped reference every this many instructions or block\n");
+	fprintf(stderr, "  -o  write the summary to a file rather than stdout\n\n");
+	fprintf(stderr, "Headless runs don't print the OK LED messages.  They also stop at an unconditional branch\n");
+	fprintf(stderr, "to itself, or with exit status 1 at an instruction or access the emulator doesn't implement or,\n");
+	fprintf(stderr, "with -L, where the engine no longer matches the reference.\n\n");
+}
+
+// Simulate the Raspberry Pi being powered up.  Returns false if the image can't be loaded.
+bool power_on(machine_t *m, char *image, uint32_t load_addr) {
+	int size_in_words = load_memory_from_file(m, image, load_addr);
+
+	if (size_in_words < 0)
+		return false;
+
+	if (m->execution_engine != ENGINE_STEP)
+		map_loaded_code(m, load_addr, size_in_words);
+
+	set_program_counter(m, load_addr + 8);							// 2 instruction pipeline.  PC is 8 bytes greater than currently executing instruction.
+	run(m);
+	return true;
+}
+
+// Runs without the debugger and writes the summary.  Returns the exit status.
+static int headless(const headless_options_t *options, char *summary_file) {
+	FILE *f = stdout;
+
+	if (summary_file != NULL && (f = fopen(summary_file, "w")) == NULL) {
+		perror(summary_file);
+		return 2;
+	}
 
-// Simulate the Raspberry Pi being powered up
-void power_on() {
-	load_memory_from_file("kernel.img", START_ADDR);
-	set_program_counter(START_ADDR + 8);						// 2 instruction pipeline.  PC is 8 bytes greater than currently executing instruction.
-	run();
+	headless_result_t result = run_headless(options);
+	write_summary(f, options, &result);
+
+	if (f != stdout)
+		fclose(f);
+
+	return result.reason == EXIT_ERROR || result.reason == EXIT_DIVERGED ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
-	if (argc > 1) {
-		if (strcmp(argv[1], "-d") == 0) {
-			int size_in_words = load_memory_from_file("kernel.img", START_ADDR);
-
-			for (int i = 0; i < size_in_words; i++) {
-				printf("%s\n", disassemble(START_ADDR + i * 4));
-			}
-		} else {
-			fprintf(stderr, "piemu: illegal option %s\n", argv[1]);
-			fprintf(stderr, "usage: piemu [-d]\n\n");
+	bool disassemble_only = false;
+	bool headless_mode = false;
+	bool led_messages = true;
+	char *summary_file = NULL;
+	uint64_t checkpoint_interval = 0;
+	size_t checkpoint_budget = 0;
+	headless_options_t options;
+	int option;
+
+	init_headless_options(&options);
+
+	while ((option = getopt(argc, argv, "dHqo:k:K:" HEADLESS_OPTIONS)) != -1) {
+		switch (option) {
+			case 'd':
+				disassemble_only = true;
+				break;
+
+			case 'H':
+				headless_mode = true;
+				break;
+
+			case 'q':
+				led_messages = false;
+				break;
+
+			case 'o':
+				summary_file = optarg;
+				break;
+
+			case 'k':
+				checkpoint_interval = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'K':
+				checkpoint_budget = strtoull(optarg, NULL, 0) * 1024 * 1024;
+				break;
+
+			default:
+				if (!parse_headless_option(&options, option, optarg)) {
+					usage();
+					return 1;
+				}
+
+				break;
 		}
+	}
+
+	if (headless_mode)
+		return headless(&options, summary_file);
+
+	machine_t *m = create_machine();
+	m->execution_engine = options.engine;
+	m->decode_cache_enabled = options.decode_cache_enabled;
+	print_led_messages(m, led_messages);
+
+	// Before recording or sharing so they start from the snapshot
+	if (options.restore_file != NULL && !disassemble_only && !restore_snapshot(m, options.restore_file))
+		return 2;
+
+	if (options.vcd_file != NULL && !record_gpio(m, options.vcd_file))
+		return 2;
+
+	if (options.shared_gpio_name != NULL && !share_gpio(m, options.shared_gpio_name))
+		return 2;
+
+	if (options.trace_file != NULL && !disassemble_only && !start_trace(m, options.trace_file, options.trace_first, options.trace_last))
+		return 2;
+
+	if ((checkpoint_interval > 0 || checkpoint_budget > 0) && !disassemble_only &&
+		!enable_checkpoints(m, checkpoint_interval > 0 ? checkpoint_interval : DEFAULT_CHECKPOINT_INTERVAL,
+			checkpoint_budget > 0 ? checkpoint_budget : DEFAULT_CHECKPOINT_BUDGET))
+		return 2;
+
+	if ((options.profile_file != NULL || options.folded_file != NULL) && !disassemble_only &&
+		!start_profile(m, options.profile_file, options.folded_file, options.profile_interval, options.profile_host_time))
+		return 2;
+
+	if (disassemble_only) {
+		int size_in_words = load_memory_from_file(m, options.image, options.load_addr);
+
+		if (size_in_words < 0)
+			return 2;
+
+		const uint32_t *words = (const uint32_t *)(m->ram + options.load_addr);
+		code_map_t *map = map_code(words, options.load_addr, size_in_words, options.load_addr);
+
+		disassemble_image(stdout, words, options.load_addr, size_in_words, map, sysconf(_SC_NPROCESSORS_ONLN));
+		free_code_map(map);
 	} else {
-		power_on();
+		if (options.restore_file != NULL)
+			run(m);
+		else if (!power_on(m, options.image, options.load_addr))
+			return 2;
+
+		print_memory_usage(m);
 	}
-}
\ No newline at end of file
+
+	destroy_machine(m);
+}
@@ -0,0 +1,367 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Guest profiler.
+//
+// Translated blocks count the times they run, so profiling switches to the
+// block engine and gathers the counts whenever translations are thrown away.
+// The PC is sampled by an event every so many cycles of the virtual clock or,
+// to measure host time, by an event that looks at the host clock every
+// HOST_POLL_INTERVAL cycles and takes a sample once the period has passed.
+// Events run between blocks, so a sample is of the block about to run.  They
+// are passive, so a guest waiting in WFI sleeps through them as it would
+// without the profiler.  Nothing is scheduled, trapped or written when the
+// profiler is off.
+//
+// When the machine is destroyed the hottest blocks are written out with their
+// disassembly, and every sampled block as a folded stack for flamegraph.pl.
+// BL isn't implemented, so a stack is the processor mode, the function the
+// code map puts the block in and the block.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block.h"
+#include "cpu.h"
+#include "disassemble.h"
+#include "flow.h"
+#include "machine.h"
+#include "memory.h"
+#include "profile.h"
+#include "scheduler.h"
+
+enum {
+	HOST_POLL_INTERVAL = 10000,		// Cycles between looks at the host clock
+	INITIAL_BLOCKS     = 1024,		// A power of two
+	NO_BLOCK           = 1			// Blocks are word aligned so this never matches
+};
+
+static const char *type_names[NUM_INSTRUCTION_TYPES] = {
+	[INSTRUCTION_UNKNOWN]                   = "not implemented",
+	[INSTRUCTION_DATA_PROCESSING_IMMEDIATE] = "data processing immediate",
+	[INSTRUCTION_DATA_PROCESSING_LSL]       = "data processing register",
+	[INSTRUCTION_LOAD_WORD]                 = "load word",
+	[INSTRUCTION_STORE_WORD]                = "store word",
+	[INSTRUCTION_BRANCH]                    = "branch",
+	[INSTRUCTION_MRS]                       = "mrs",
+	[INSTRUCTION_MSR]                       = "msr",
+	[INSTRUCTION_HINT]                      = "hint",
+	[INSTRUCTION_CPS]                       = "cps",
+	[INSTRUCTION_SWI]                       = "swi"
+};
+
+// What was seen of the code starting at an address.  A sample that isn't at the start of a block,
+// as when single stepping, gets one of its own with no length.
+typedef struct profile_block {
+	uint32_t addr;
+	int length;
+	uint64_t executions;
+	uint64_t samples;
+	const char *mode;				// Processor mode of the last sample
+} profile_block_t;
+
+struct profile {
+	FILE *report;					// NULL for no report
+	FILE *folded;					// NULL for no folded stacks
+	uint64_t interval;				// Cycles, or microseconds of host time
+	bool host_time;
+	uint64_t next_sample;			// Host microseconds the next sample is due at
+	uint64_t start_retired;
+	uint64_t start_mmio_accesses;
+	uint64_t num_samples;
+	uint64_t type_counts[NUM_INSTRUCTION_TYPES];	// Instructions retired, including those skipped by their condition
+	profile_block_t *blocks;		// Open addressed on the address
+	int capacity;
+	int num_blocks;
+};
+
+static uint64_t host_microseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+static void alloc_blocks(profile_t *profile, int capacity) {
+	profile->blocks = malloc(capacity * sizeof(profile_block_t));
+	profile->capacity = capacity;
+	profile->num_blocks = 0;
+
+	for (int i = 0; i < capacity; i++)
+		profile->blocks[i].addr = NO_BLOCK;
+}
+
+static profile_block_t *profile_block(profile_t *profile, uint32_t addr);
+
+// Doubles the table once it is half full
+static void grow_blocks(profile_t *profile) {
+	profile_block_t *old = profile->blocks;
+	int old_capacity = profile->capacity;
+
+	alloc_blocks(profile, old_capacity * 2);
+
+	for (int i = 0; i < old_capacity; i++)
+		if (old[i].addr != NO_BLOCK)
+			*profile_block(profile, old[i].addr) = old[i];
+
+	free(old);
+}
+
+// Finds the entry for addr, adding an empty one if there isn't one
+static profile_block_t *profile_block(profile_t *profile, uint32_t addr) {
+	if (profile->num_blocks * 2 >= profile->capacity)
+		grow_blocks(profile);
+
+	int mask = profile->capacity - 1;
+	int index = (addr >> 2) & mask;
+
+	while (profile->blocks[index].addr != addr && profile->blocks[index].addr != NO_BLOCK)
+		index = (index + 1) & mask;
+
+	profile_block_t *block = &profile->blocks[index];
+
+	if (block->addr == NO_BLOCK) {
+		memset(block, 0, sizeof(*block));
+		block->addr = addr;
+		profile->num_blocks++;
+	}
+
+	return block;
+}
+
+static void take_sample(machine_t *m, int data) {
+	(void)data;
+	profile_t *profile = m->profile;
+	uint64_t now = profile->host_time ? host_microseconds() : 0;
+
+	if (!profile->host_time || now >= profile->next_sample) {
+		profile_block_t *block = profile_block(profile, program_counter(m) - 8);
+
+		block->samples++;
+		block->mode = current_mode_name(m);
+		profile->num_samples++;
+		profile->next_sample = now + profile->interval;
+	}
+
+	schedule_passive_event(m, current_time(m) + (profile->host_time ? HOST_POLL_INTERVAL : profile->interval), take_sample, 0);
+}
+
+static FILE *open_output(const char *filename) {
+	FILE *f = fopen(filename, "w");
+
+	if (f == NULL)
+		perror(filename);
+
+	return f;
+}
+
+// Starts profiling, sampling every interval cycles or, with host_time, microseconds.  Either file may be
+// NULL.  Returns false if one can't be opened, or if the step engine has to be used for tracing or
+// checkpoints, as it doesn't count blocks.
+bool start_profile(machine_t *m, const char *report_file, const char *folded_file, uint64_t interval, bool host_time) {
+	if (m->trace != NULL || m->checkpoints != NULL) {
+		fprintf(stderr, "The profiler counts translated blocks so can't be used while instructions are traced or checkpointed\n");
+		return false;
+	}
+
+	profile_t *profile = calloc(1, sizeof(profile_t));
+
+	if ((report_file != NULL && (profile->report = open_output(report_file)) == NULL) ||
+		(folded_file != NULL && (profile->folded = open_output(folded_file)) == NULL)) {
+		if (profile->report != NULL)
+			fclose(profile->report);
+
+		free(profile);
+		return false;
+	}
+
+	profile->interval = interval > 0 ? interval : 1;
+	profile->host_time = host_time;
+	profile->next_sample = host_microseconds() + profile->interval;
+	profile->start_retired = m->retired;
+	profile->start_mmio_accesses = m->mmio_access_count;
+	alloc_blocks(profile, INITIAL_BLOCKS);
+
+	// Counts start from the blocks translated from here on
+	invalidate_blocks(m, 0);
+
+	m->profile = profile;
+	m->execution_engine = ENGINE_BLOCKS;
+	trap_mmio_reads(m, true);
+	schedule_passive_event(m, current_time(m) + (host_time ? HOST_POLL_INTERVAL : profile->interval), take_sample, 0);
+	return true;
+}
+
+// Adds what the translated blocks have counted to the profile.  Called before they are thrown away.
+void count_block_executions(machine_t *m) {
+	profile_t *profile = m->profile;
+
+	if (profile == NULL)
+		return;
+
+	for (int i = 0; i < BLOCK_HASH_SIZE; i++) {
+		for (block_t *block = m->block_hash[i]; block != NULL; block = block->hash_next) {
+			if (block->executions == 0)
+				continue;
+
+			profile_block_t *entry = profile_block(profile, block->addr);
+			entry->length = block->length;
+			entry->executions += block->executions;
+
+			for (int op = 0; op < block->length; op++)
+				profile->type_counts[block->ops[op].decoded.type] += block->executions;
+
+			block->executions = 0;
+		}
+	}
+}
+
+static double percent(uint64_t count, uint64_t total) {
+	return total > 0 ? 100.0 * count / total : 0;
+}
+
+// Hottest first: most samples, then most instructions
+static int compare_heat(const void *a, const void *b) {
+	const profile_block_t *x = a;
+	const profile_block_t *y = b;
+	uint64_t x_instructions = x->executions * x->length;
+	uint64_t y_instructions = y->executions * y->length;
+
+	if (x->samples != y->samples)
+		return x->samples < y->samples ? 1 : -1;
+
+	if (x_instructions != y_instructions)
+		return x_instructions < y_instructions ? 1 : -1;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// Writes the label of the function the code map puts addr in.  Returns false if there is no map or
+// addr isn't in a function.
+static bool function_label(const code_map_t *map, uint32_t addr, char *label) {
+	if (map == NULL)
+		return false;
+
+	for (uint32_t at = addr & ~3; at >= map->start && at - map->start < (uint32_t)map->num_words * 4; at -= 4) {
+		if (code_at(map, at) & CODE_FUNCTION)
+			return code_label(map, at, label);
+
+		if (at == 0)
+			break;
+	}
+
+	return false;
+}
+
+// The label of the block if it has one, otherwise its address
+static void block_label(const code_map_t *map, uint32_t addr, char *label) {
+	if (map == NULL || !code_label(map, addr, label))
+		sprintf(label, "%x", addr);
+}
+
+static void write_report(machine_t *m, profile_t *profile, profile_block_t *sorted, int num_sorted) {
+	FILE *f = profile->report;
+	uint64_t mmio_accesses = m->mmio_access_count - profile->start_mmio_accesses;
+	uint64_t loads_stores = profile->type_counts[INSTRUCTION_LOAD_WORD] + profile->type_counts[INSTRUCTION_STORE_WORD];
+	uint64_t counted = 0;
+	char function[CODE_LABEL_LENGTH];
+	char label[CODE_LABEL_LENGTH];
+	char disassembly[DISASSEMBLY_LENGTH];
+
+	for (int type = 0; type < NUM_INSTRUCTION_TYPES; type++)
+		counted += profile->type_counts[type];
+
+	fprintf(f, "%llu instructions retired, %llu samples every %llu %s\n\n", (unsigned long long)(m->retired - profile->start_retired),
+		(unsigned long long)profile->num_samples, (unsigned long long)profile->interval, profile->host_time ? "microseconds" : "cycles");
+
+	fprintf(f, "Instructions by class:\n");
+
+	for (int type = 0; type < NUM_INSTRUCTION_TYPES; type++)
+		if (profile->type_counts[type] > 0)
+			fprintf(f, "  %-28s %14llu  %6.2f%%\n", type_names[type], (unsigned long long)profile->type_counts[type], percent(profile->type_counts[type], counted));
+
+	fprintf(f, "\nLoads and stores: %llu, %llu of them to peripheral registers\n\n", (unsigned long long)loads_stores, (unsigned long long)mmio_accesses);
+
+	fprintf(f, "Hot blocks:\n");
+	fprintf(f, "   samples        %%    executions  instructions\n");
+
+	for (int i = 0; i < num_sorted && i < PROFILE_HOT_BLOCKS; i++) {
+		const profile_block_t *block = &sorted[i];
+
+		block_label(m->code_map, block->addr, label);
+		fprintf(f, "%10llu  %6.2f%%  %12llu  %12llu  %s", (unsigned long long)block->samples, percent(block->samples, profile->num_samples),
+			(unsigned long long)block->executions, (unsigned long long)(block->executions * block->length), label);
+
+		if (function_label(m->code_map, block->addr, function) && strcmp(function, label) != 0)
+			fprintf(f, " in %s", function);
+
+		if (block->mode != NULL)
+			fprintf(f, ", %s mode", block->mode);
+
+		fprintf(f, "\n");
+
+		for (int op = 0; op < (block->length > 0 ? block->length : 1); op++)
+			fprintf(f, "    %s\n", disassemble(m, block->addr + op * 4, disassembly));
+
+		fprintf(f, "\n");
+	}
+}
+
+// One line per sampled block of mode;function;block and the samples, as flamegraph.pl reads
+static void write_folded(machine_t *m, profile_t *profile, const profile_block_t *sorted, int num_sorted) {
+	char function[CODE_LABEL_LENGTH];
+	char label[CODE_LABEL_LENGTH];
+
+	for (int i = 0; i < num_sorted && sorted[i].samples > 0; i++) {
+		const profile_block_t *block = &sorted[i];
+
+		block_label(m->code_map, block->addr, label);
+		fprintf(profile->folded, "%s", block->mode);
+
+		if (function_label(m->code_map, block->addr, function) && strcmp(function, label) != 0)
+			fprintf(profile->folded, ";%s", function);
+
+		fprintf(profile->folded, ";%s %llu\n", label, (unsigned long long)block->samples);
+	}
+}
+
+// Stops profiling and writes out what it found
+void stop_profile(machine_t *m) {
+	profile_t *profile = m->profile;
+
+	if (profile == NULL)
+		return;
+
+	count_block_executions(m);
+	cancel_event(m, take_sample, 0);
+	trap_mmio_reads(m, false);
+
+	profile_block_t *sorted = malloc(profile->num_blocks * sizeof(profile_block_t));
+	int num_sorted = 0;
+
+	for (int i = 0; i < profile->capacity; i++)
+		if (profile->blocks[i].addr != NO_BLOCK)
+			sorted[num_sorted++] = profile->blocks[i];
+
+	qsort(sorted, num_sorted, sizeof(profile_block_t), compare_heat);
+
+	if (profile->report != NULL) {
+		write_report(m, profile, sorted, num_sorted);
+		fclose(profile->report);
+	}
+
+	if (profile->folded != NULL) {
+		write_folded(m, profile, sorted, num_sorted);
+		fclose(profile->folded);
+	}
+
+	free(sorted);
+	free(profile->blocks);
+	free(profile);
+	m->profile = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct machine machine_t;
+typedef struct profile profile_t;
+
+enum {
+	DEFAULT_PROFILE_INTERVAL = 10000,	// Cycles of the virtual clock between samples
+	PROFILE_HOT_BLOCKS       = 20		// Blocks listed in the report
+};
+
+// Public functions
+extern bool start_profile(machine_t *m, const char *report_file, const char *folded_file, uint64_t interval, bool host_time);
+extern void stop_profile(machine_t *m);
+extern void count_block_executions(machine_t *m);
+
+#endif
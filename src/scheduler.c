@@ -0,0 +1,164 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Event scheduler for the virtual clock.
+//
+// Peripherals schedule an event for the time something happens rather than
+// checking the clock as the guest runs.  Events are kept in a min-heap and
+// execute() stops the engines at the earliest one, so nothing is polled per
+// instruction.
+//
+///////////////////////////////////////
+
+#include <assert.h>
+#include "cpu.h"
+#include "machine.h"
+#include "scheduler.h"
+
+uint64_t current_time(machine_t *m) {
+	return m->retired + m->idle_cycles;
+}
+
+static void swap_events(machine_t *m, int a, int b) {
+	event_t event = m->events[a];
+	m->events[a] = m->events[b];
+	m->events[b] = event;
+}
+
+static void sift_up(machine_t *m, int i) {
+	while (i > 0 && m->events[(i - 1) / 2].time > m->events[i].time) {
+		swap_events(m, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(machine_t *m, int i) {
+	while (true) {
+		int earliest = i;
+
+		for (int child = 2 * i + 1; child <= 2 * i + 2 && child < m->num_events; child++)
+			if (m->events[child].time < m->events[earliest].time)
+				earliest = child;
+
+		if (earliest == i)
+			return;
+
+		swap_events(m, i, earliest);
+		i = earliest;
+	}
+}
+
+static void remove_event(machine_t *m, int i) {
+	m->events[i] = m->events[--m->num_events];
+
+	if (i < m->num_events) {
+		sift_up(m, i);
+		sift_down(m, i);
+	}
+
+	m->next_event = m->num_events > 0 ? m->events[0].time : (uint64_t)NO_EVENT;
+}
+
+// Stops the engine if the earliest event is due before the end of the slice it is running
+static void stop_for_event(machine_t *m) {
+	if (m->next_event < m->slice_end + m->idle_cycles && m->stop_reason == STOP_NONE)
+		m->stop_reason = STOP_EVENT;
+}
+
+static void add_event(machine_t *m, uint64_t time, event_handler_t handler, int data, bool passive) {
+	assert(m->num_events < MAX_EVENTS);
+
+	event_t *event = &m->events[m->num_events];
+	event->time = time;
+	event->handler = handler;
+	event->data = data;
+	event->passive = passive;
+	sift_up(m, m->num_events++);
+	m->next_event = m->events[0].time;
+
+	stop_for_event(m);
+}
+
+// Has the handler called with data once the virtual clock reaches time.  If the engines are
+// already running past that time they are stopped so it isn't missed.
+void schedule_event(machine_t *m, uint64_t time, event_handler_t handler, int data) {
+	add_event(m, time, handler, data, false);
+}
+
+// The same for a handler that only looks at the machine, which a guest waiting in WFI sleeps through
+void schedule_passive_event(machine_t *m, uint64_t time, event_handler_t handler, int data) {
+	add_event(m, time, handler, data, true);
+}
+
+void cancel_event(machine_t *m, event_handler_t handler, int data) {
+	for (int i = 0; i < m->num_events; i++) {
+		if (m->events[i].handler == handler && m->events[i].data == data) {
+			remove_event(m, i);
+			return;
+		}
+	}
+}
+
+// Returns the time the handler is next called with data, NO_EVENT if it isn't scheduled
+uint64_t event_time(machine_t *m, event_handler_t handler, int data) {
+	for (int i = 0; i < m->num_events; i++) {
+		if (m->events[i].handler == handler && m->events[i].data == data)
+			return m->events[i].time;
+	}
+
+	return NO_EVENT;
+}
+
+// Forgets every event, for when the clock is replaced
+void clear_events(machine_t *m) {
+	m->num_events = 0;
+	m->next_event = NO_EVENT;
+}
+
+static void run_first_event(machine_t *m) {
+	event_t event = m->events[0];
+	remove_event(m, 0);
+	event.handler(m, event.data);
+}
+
+void run_due_events(machine_t *m) {
+	while (m->num_events > 0 && m->events[0].time <= current_time(m))
+		run_first_event(m);
+}
+
+// Lets time pass without executing anything
+void advance_time(machine_t *m, uint64_t cycles) {
+	m->idle_cycles += cycles;
+	stop_for_event(m);
+}
+
+// The guest has nothing to do until something happens, so skip to the next event.  Does nothing
+// if no event is scheduled.
+void idle_until_next_event(machine_t *m) {
+	if (m->next_event != (uint64_t)NO_EVENT && m->next_event > current_time(m))
+		advance_time(m, m->next_event - current_time(m));
+}
+
+static bool waking_event_scheduled(machine_t *m) {
+	for (int i = 0; i < m->num_events; i++)
+		if (!m->events[i].passive)
+			return true;
+
+	return false;
+}
+
+// The guest has executed WFI, so skip to the next event that can wake it.  Passive events on the way
+// are run as the clock reaches them.
+void wait_for_interrupt(machine_t *m) {
+	while (m->num_events > 0 && m->events[0].passive && waking_event_scheduled(m)) {
+		if (m->events[0].time > current_time(m))
+			advance_time(m, m->events[0].time - current_time(m));
+
+		run_first_event(m);
+	}
+
+	idle_until_next_event(m);
+}
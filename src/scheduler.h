@@ -0,0 +1,37 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct machine machine_t;
+
+// Time is counted in cycles of the virtual clock.  A cycle passes for every instruction retired, and
+// whole stretches of cycles pass at once when the guest is idle.
+enum {
+	MAX_EVENTS = 16,
+	NO_EVENT   = -1				// next_event when nothing is scheduled, as a uint64_t
+};
+
+typedef void (*event_handler_t)(machine_t *m, int data);
+
+typedef struct event {
+	uint64_t time;
+	event_handler_t handler;
+	int data;
+	bool passive;				// Only watches the machine, so doesn't wake the guest from WFI
+} event_t;
+
+// Public functions
+extern uint64_t current_time(machine_t *m);
+extern void schedule_event(machine_t *m, uint64_t time, event_handler_t handler, int data);
+extern void schedule_passive_event(machine_t *m, uint64_t time, event_handler_t handler, int data);
+extern void cancel_event(machine_t *m, event_handler_t handler, int data);
+extern uint64_t event_time(machine_t *m, event_handler_t handler, int data);
+extern void clear_events(machine_t *m);
+extern void run_due_events(machine_t *m);
+extern void advance_time(machine_t *m, uint64_t cycles);
+extern void idle_until_next_event(machine_t *m);
+extern void wait_for_interrupt(machine_t *m);
+
+#endif
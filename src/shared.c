@@ -0,0 +1,120 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// GPIO state shared with other processes.
+//
+// The pin levels, function selects and event status are published into a
+// POSIX shared memory segment whenever they change, under a seqlock so a
+// harness can take consistent snapshots without a system call.  Input
+// levels come back the same way and are picked up by an event every
+// 100 microseconds of virtual time, so GPLEV sees them without the emulator
+// checking on every access.
+//
+///////////////////////////////////////
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "gpio.h"
+#include "machine.h"
+#include "scheduler.h"
+#include "shared.h"
+#include "timer.h"
+
+enum { INPUT_POLL_INTERVAL = 100 * CYCLES_PER_MICROSECOND };
+
+void publish_gpio(machine_t *m) {
+	shared_gpio_t *shared = m->shared_gpio;
+	unsigned sequence = atomic_load_explicit(&shared->state_sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&shared->state_sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (int bank = 0; bank < SHARED_GPIO_BANKS; bank++) {
+		shared->state.levels[bank] = gpio_register(m, GPLEV0 + bank * 4);
+		shared->state.outputs[bank] = m->output_pins[bank];
+		shared->state.event_status[bank] = gpio_register(m, GPEDS0 + bank * 4);
+	}
+
+	for (int i = 0; i < SHARED_GPIO_FSELS; i++)
+		shared->state.function_select[i] = gpio_register(m, GPFSEL0 + i * 4);
+
+	shared->state.changes++;
+	shared->state.time = current_time(m);
+	atomic_store_explicit(&shared->state_sequence, sequence + 2, memory_order_release);
+}
+
+// Applies the inputs if the harness has changed them.  If it is part way through a change, or
+// changes them while they are copied, they are picked up next time rather than waited for.
+static void poll_inputs(machine_t *m, int data) {
+	(void)data;
+	shared_gpio_t *shared = m->shared_gpio;
+	unsigned sequence = atomic_load_explicit(&shared->inputs_sequence, memory_order_acquire);
+
+	schedule_event(m, current_time(m) + INPUT_POLL_INTERVAL, poll_inputs, 0);
+
+	if (sequence == m->shared_inputs_sequence || (sequence & 1))
+		return;
+
+	shared_gpio_inputs_t inputs;
+	memcpy(&inputs, &shared->inputs, sizeof(inputs));
+	atomic_thread_fence(memory_order_acquire);
+
+	if (atomic_load_explicit(&shared->inputs_sequence, memory_order_relaxed) != sequence)
+		return;
+
+	m->shared_inputs_sequence = sequence;
+
+	for (int bank = 0; bank < SHARED_GPIO_BANKS; bank++)
+		drive_gpio_inputs(m, bank, inputs.mask[bank], inputs.levels[bank]);
+}
+
+// Creates the segment, or opens it if the harness already has, and starts publishing to it.
+// Returns false if it can't be created.
+bool share_gpio(machine_t *m, const char *name) {
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+
+	if (fd < 0 || ftruncate(fd, sizeof(shared_gpio_t)) != 0) {
+		perror(name);
+
+		if (fd >= 0)
+			close(fd);
+
+		return false;
+	}
+
+	shared_gpio_t *shared = mmap(NULL, sizeof(shared_gpio_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shared == MAP_FAILED) {
+		perror(name);
+		return false;
+	}
+
+	// Inputs the harness set before the emulator started are kept
+	shared->magic = SHARED_GPIO_MAGIC;
+	shared->version = SHARED_GPIO_VERSION;
+	m->shared_gpio = shared;
+	m->shared_gpio_name = strdup(name);
+	m->shared_inputs_sequence = 0;
+
+	publish_gpio(m);
+	poll_inputs(m, 0);
+	return true;
+}
+
+// Stops publishing and removes the segment.  Harnesses that have it mapped keep the last state.
+void unshare_gpio(machine_t *m) {
+	cancel_event(m, poll_inputs, 0);
+	munmap(m->shared_gpio, sizeof(shared_gpio_t));
+	shm_unlink(m->shared_gpio_name);
+	free(m->shared_gpio_name);
+	m->shared_gpio = NULL;
+	m->shared_gpio_name = NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef __SHARED_H
+#define __SHARED_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct machine machine_t;
+
+// The segment piemu -x publishes the GPIO in.  A harness maps it read/write with shm_open and mmap,
+// takes snapshots with read_shared_gpio and drives input pins with drive_shared_inputs.  Neither
+// side makes a system call to exchange state.
+enum {
+	SHARED_GPIO_MAGIC   = 0x4f495047,	// "GPIO"
+	SHARED_GPIO_VERSION = 1,
+	SHARED_GPIO_BANKS   = 2,
+	SHARED_GPIO_FSELS   = 6
+};
+
+// What the emulator publishes
+typedef struct shared_gpio_state {
+	uint32_t levels[SHARED_GPIO_BANKS];		// GPLEV
+	uint32_t outputs[SHARED_GPIO_BANKS];		// Pins whose function is output
+	uint32_t event_status[SHARED_GPIO_BANKS];	// GPEDS
+	uint32_t function_select[SHARED_GPIO_FSELS];	// GPFSEL
+	uint64_t changes;						// Incremented every time the state is published
+	uint64_t time;							// Virtual clock cycles when it was published
+} shared_gpio_state_t;
+
+// Levels the harness drives input pins to.  Pins not in mask are left to their pull-up or pull-down.
+typedef struct shared_gpio_inputs {
+	uint32_t mask[SHARED_GPIO_BANKS];
+	uint32_t levels[SHARED_GPIO_BANKS];
+} shared_gpio_inputs_t;
+
+// Each half has a seqlock written by one side only.  The sequence is odd while its writer is
+// changing the half and readers retry if it changed while they copied.
+typedef struct shared_gpio {
+	uint32_t magic;
+	uint32_t version;
+	alignas(64) atomic_uint state_sequence;
+	shared_gpio_state_t state;
+	alignas(64) atomic_uint inputs_sequence;
+	shared_gpio_inputs_t inputs;
+} shared_gpio_t;
+
+// Takes a consistent copy of the state the emulator last published
+static inline void read_shared_gpio(shared_gpio_t *shared, shared_gpio_state_t *state) {
+	unsigned before, after;
+
+	do {
+		before = atomic_load_explicit(&shared->state_sequence, memory_order_acquire);
+		memcpy(state, &shared->state, sizeof(*state));
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&shared->state_sequence, memory_order_relaxed);
+	} while (before != after || (before & 1));
+}
+
+// Sets the levels of the input pins driven from outside.  Only one process may drive inputs.
+static inline void drive_shared_inputs(shared_gpio_t *shared, const shared_gpio_inputs_t *inputs) {
+	unsigned sequence = atomic_load_explicit(&shared->inputs_sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&shared->inputs_sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&shared->inputs, inputs, sizeof(*inputs));
+	atomic_store_explicit(&shared->inputs_sequence, sequence + 2, memory_order_release);
+}
+
+// Public functions
+extern bool share_gpio(machine_t *m, const char *name);
+extern void unshare_gpio(machine_t *m);
+extern void publish_gpio(machine_t *m);
+
+#endif
@@ -0,0 +1,273 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Machine snapshots.
+//
+// A snapshot holds the CPU, the virtual clock and its events, the GPIO and
+// the system timer, followed by the RAM pages that have been touched.  The
+// pages start on a host page boundary so a restore maps them copy-on-write
+// straight from the file rather than reading them, and pages that are still
+// zero aren't stored at all.  Restoring a warm machine is a handful of mmap
+// calls whatever the size of its RAM.
+//
+///////////////////////////////////////
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "block.h"
+#include "cpu.h"
+#include "flags.h"
+#include "flow.h"
+#include "gpio.h"
+#include "machine.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "trace.h"
+
+enum { SNAPSHOT_VERSION = 1 };
+
+static const char snapshot_magic[8] = "PIEMUSNP";
+
+typedef struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t state_size;			// sizeof(snapshot_state_t)
+	uint64_t ram_size;
+	uint32_t page_size;				// Host page size the pages are stored in
+	uint32_t num_pages;				// Pages stored, each listed by its index after the state
+	uint64_t ram_offset;			// Where the first page starts, page aligned
+} snapshot_header_t;
+
+// Copies everything but memory out of the machine
+void save_machine_state(machine_t *m, snapshot_state_t *state) {
+	memset(state, 0, sizeof(*state));
+	memcpy(state->registers, m->registers, sizeof(state->registers));
+	state->cpsr = read_cpsr(m);
+	memcpy(state->banked_registers, m->banked_registers, sizeof(state->banked_registers));
+	memcpy(state->spsr, m->spsr, sizeof(state->spsr));
+
+	state->retired = m->retired;
+	state->idle_cycles = m->idle_cycles;
+
+	memcpy(state->gpio_registers, m->gpio_registers, sizeof(state->gpio_registers));
+	memcpy(state->pin_outputs, m->pin_outputs, sizeof(state->pin_outputs));
+	memcpy(state->output_pins, m->output_pins, sizeof(state->output_pins));
+	memcpy(state->pull_ups, m->pull_ups, sizeof(state->pull_ups));
+	memcpy(state->input_pins, m->input_pins, sizeof(state->input_pins));
+	memcpy(state->input_levels, m->input_levels, sizeof(state->input_levels));
+
+	state->timer_status = m->timer_status;
+	memcpy(state->timer_compare, m->timer_compare, sizeof(state->timer_compare));
+
+	for (int compare = 0; compare < NUM_TIMER_COMPARES; compare++)
+		state->timer_matches[compare] = compare_event_time(m, compare);
+}
+
+// Puts everything but memory back.  Decoded and translated copies of the code are left to the caller.
+void load_machine_state(machine_t *m, const snapshot_state_t *state) {
+	memcpy(m->registers, state->registers, sizeof(state->registers));
+	m->cpsr = state->cpsr & ~PSR_FLAGS_MASK;
+	set_flags_nzcv(&m->flags, state->cpsr >> FLAGS_SHIFT);
+	memcpy(m->banked_registers, state->banked_registers, sizeof(state->banked_registers));
+	memcpy(m->spsr, state->spsr, sizeof(state->spsr));
+	m->stop_reason = STOP_NONE;
+
+	m->retired = state->retired;
+	m->idle_cycles = state->idle_cycles;
+	clear_events(m);
+
+	memcpy(m->gpio_registers, state->gpio_registers, sizeof(state->gpio_registers));
+	memcpy(m->pin_outputs, state->pin_outputs, sizeof(state->pin_outputs));
+	memcpy(m->output_pins, state->output_pins, sizeof(state->output_pins));
+	memcpy(m->pull_ups, state->pull_ups, sizeof(state->pull_ups));
+	memcpy(m->input_pins, state->input_pins, sizeof(state->input_pins));
+	memcpy(m->input_levels, state->input_levels, sizeof(state->input_levels));
+
+	m->timer_status = state->timer_status;
+	memcpy(m->timer_compare, state->timer_compare, sizeof(state->timer_compare));
+
+	for (int compare = 0; compare < NUM_TIMER_COMPARES; compare++)
+		restore_compare_event(m, compare, state->timer_matches[compare]);
+
+	resync_trace(m);
+}
+
+static bool zero_page(const uint8_t *page, long size) {
+	const uint64_t *word = (const uint64_t *)page;
+
+	for (long i = 0; i < size / 8; i++)
+		if (word[i] != 0)
+			return false;
+
+	return true;
+}
+
+// Lists the host pages of RAM that aren't zero.  Returns the number or -1 if it can't be worked out.
+static int64_t list_pages(machine_t *m, uint32_t **pages, long *page_size) {
+	uint8_t *touched = touched_ram(m, page_size);
+
+	if (touched == NULL)
+		return -1;
+
+	size_t host_pages = RAM_SIZE / *page_size;
+	int64_t num_pages = 0;
+
+	*pages = malloc(host_pages * sizeof(uint32_t));
+
+	for (size_t page = 0; page < host_pages; page++)
+		if (touched[page] && !zero_page(m->ram + page * *page_size, *page_size))
+			(*pages)[num_pages++] = page;
+
+	free(touched);
+	return num_pages;
+}
+
+static bool write_snapshot(machine_t *m, FILE *f, const uint32_t *pages, uint32_t num_pages, long page_size) {
+	snapshot_header_t header;
+	snapshot_state_t state;
+
+	memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.state_size = sizeof(state);
+	header.ram_size = RAM_SIZE;
+	header.page_size = page_size;
+	header.num_pages = num_pages;
+	header.ram_offset = (sizeof(header) + sizeof(state) + num_pages * sizeof(uint32_t) + page_size - 1) / page_size * page_size;
+
+	save_machine_state(m, &state);
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(&state, sizeof(state), 1, f) != 1 ||
+		fwrite(pages, sizeof(uint32_t), num_pages, f) != num_pages || fseeko(f, header.ram_offset, SEEK_SET) != 0)
+		return false;
+
+	// Runs of neighbouring pages are written in one go
+	for (uint32_t i = 0, run; i < num_pages; i += run) {
+		for (run = 1; i + run < num_pages && pages[i + run] == pages[i] + run; run++)
+			;
+
+		if (fwrite(m->ram + (size_t)pages[i] * page_size, page_size, run, f) != run)
+			return false;
+	}
+
+	return true;
+}
+
+// Writes the machine to the file.  It is written alongside and renamed over the file at the end, so a
+// machine restored from the file it is saved to keeps the pages it has mapped.  Returns false if it
+// can't be saved.
+bool save_snapshot(machine_t *m, const char *filename) {
+	uint32_t *pages = NULL;
+	long page_size;
+	int64_t num_pages = list_pages(m, &pages, &page_size);
+	size_t length = strlen(filename);
+	char *temporary = malloc(length + 5);
+
+	sprintf(temporary, "%s.new", filename);
+
+	FILE *f = num_pages < 0 ? NULL : fopen(temporary, "wb");
+	bool saved = f != NULL && write_snapshot(m, f, pages, num_pages, page_size);
+
+	if (f != NULL && fclose(f) != 0)
+		saved = false;
+
+	if (saved && rename(temporary, filename) != 0)
+		saved = false;
+
+	if (!saved) {
+		perror(filename);
+		remove(temporary);
+	}
+
+	free(temporary);
+	free(pages);
+	return saved;
+}
+
+// Checks the header belongs to a snapshot this emulator can restore
+static bool valid_header(const snapshot_header_t *header, off_t file_size) {
+	return memcmp(header->magic, snapshot_magic, sizeof(header->magic)) == 0 &&
+		header->version == SNAPSHOT_VERSION &&
+		header->state_size == sizeof(snapshot_state_t) &&
+		header->ram_size == RAM_SIZE &&
+		header->page_size == sysconf(_SC_PAGESIZE) &&
+		header->ram_offset % header->page_size == 0 &&
+		header->num_pages <= RAM_SIZE / header->page_size &&
+		header->ram_offset + (uint64_t)header->num_pages * header->page_size <= (uint64_t)file_size;
+}
+
+// Maps the stored pages over zeroed RAM, a run of neighbouring pages at a time
+static bool map_pages(machine_t *m, int fd, const snapshot_header_t *header, const uint32_t *pages) {
+	uint64_t page_size = header->page_size;
+
+	clear_ram(m);
+
+	for (uint32_t i = 0, run; i < header->num_pages; i += run) {
+		if (pages[i] >= RAM_SIZE / page_size || (i > 0 && pages[i] <= pages[i - 1]))
+			return false;
+
+		for (run = 1; i + run < header->num_pages && pages[i + run] == pages[i] + run; run++)
+			;
+
+		if (!map_ram_from_file(m, pages[i] * page_size, run * page_size, fd, header->ram_offset + i * page_size))
+			return false;
+	}
+
+	return true;
+}
+
+// Replaces the machine's state with the snapshot's.  It must be restored before the GPIO is recorded
+// or shared.  Returns false if the file isn't a snapshot of this emulator, in which case the machine
+// may be left part restored.
+bool restore_snapshot(machine_t *m, const char *filename) {
+	snapshot_header_t header;
+	snapshot_state_t state;
+	uint32_t *pages = NULL;
+	struct stat file;
+	bool restored = false;
+
+	if (m->vcd != NULL || m->shared_gpio != NULL) {
+		fprintf(stderr, "%s: snapshots must be restored before the GPIO is recorded or shared\n", filename);
+		return false;
+	}
+
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &file) != 0) {
+		perror(filename);
+
+		if (fd >= 0)
+			close(fd);
+
+		return false;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && valid_header(&header, file.st_size) &&
+		pread(fd, &state, sizeof(state), sizeof(header)) == sizeof(state)) {
+		size_t pages_size = header.num_pages * sizeof(uint32_t);
+		pages = malloc(pages_size + 1);
+		restored = pread(fd, pages, pages_size, sizeof(header) + sizeof(state)) == (ssize_t)pages_size && map_pages(m, fd, &header, pages);
+	}
+
+	// Everything translated or decoded came from the old memory so it is all thrown away
+	if (restored) {
+		load_machine_state(m, &state);
+		flush_decoded_instructions(m);
+		invalidate_blocks(m, 0);
+		free_code_map(m->code_map);
+		m->code_map = NULL;
+	} else
+		fprintf(stderr, "%s: not a snapshot this emulator can restore\n", filename);
+
+	free(pages);
+	close(fd);				// The mapped pages keep the file open
+	return restored;
+}
@@ -0,0 +1,40 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "gpio.h"
+#include "timer.h"
+
+typedef struct machine machine_t;
+
+// Everything in a machine but its memory
+typedef struct snapshot_state {
+	uint32_t registers[NUM_REGISTERS];
+	uint32_t cpsr;
+	uint32_t banked_registers[NUM_BANKS][NUM_BANKED];
+	uint32_t spsr[NUM_BANKS];
+
+	uint64_t retired;
+	uint64_t idle_cycles;
+
+	uint32_t gpio_registers[GPIO_REGISTERS_SIZE / 4];
+	uint32_t pin_outputs[NUM_GPIO_BANKS];
+	uint32_t output_pins[NUM_GPIO_BANKS];
+	uint32_t pull_ups[NUM_GPIO_BANKS];
+	uint32_t input_pins[NUM_GPIO_BANKS];
+	uint32_t input_levels[NUM_GPIO_BANKS];
+
+	uint32_t timer_status;
+	uint32_t timer_compare[NUM_TIMER_COMPARES];
+	uint64_t timer_matches[NUM_TIMER_COMPARES];	// Times of the compare events, NO_EVENT if none
+} snapshot_state_t;
+
+// Public functions
+extern bool save_snapshot(machine_t *m, const char *filename);
+extern bool restore_snapshot(machine_t *m, const char *filename);
+extern void save_machine_state(machine_t *m, snapshot_state_t *state);
+extern void load_machine_state(machine_t *m, const snapshot_state_t *state);
+
+#endif
@@ -0,0 +1,107 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// BCM2835 system timer.
+//
+// A free running 1MHz counter with four compare registers.  The counter is
+// worked out from the virtual clock when it is read, and writing a compare
+// register schedules an event for the microsecond the counter reaches it,
+// which sets the match bit in the status register.
+//
+///////////////////////////////////////
+
+#include <assert.h>
+#include "machine.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "timer.h"
+
+// System timer registers
+enum {
+	TIMER_START = 0x20003000,
+	TIMER_SIZE  = 0x1c,
+
+	TIMER_CS  = 0x20003000,			// Match bits, written with 1 to clear
+	TIMER_CLO = 0x20003004,
+	TIMER_CHI = 0x20003008,
+	TIMER_C0  = 0x2000300c			// C0 to C3 follow on
+};
+
+void init_timer(machine_t *m) {
+	register_mmio(m, TIMER_START, TIMER_SIZE, timer_read_word, timer_write_word);
+}
+
+static uint64_t microseconds(machine_t *m) {
+	return current_time(m) / CYCLES_PER_MICROSECOND;
+}
+
+static void compare_matched(machine_t *m, int compare) {
+	m->timer_status |= 1 << compare;
+}
+
+// Schedules the next time the low 32 bits of the counter equal the compare register.  If they are
+// equal now that is after the counter wraps.
+static void schedule_compare(machine_t *m, int compare) {
+	uint64_t now = microseconds(m);
+	uint32_t until = m->timer_compare[compare] - (uint32_t)now;
+	uint64_t match = now + (until == 0 ? 1ull << 32 : until);
+
+	cancel_event(m, compare_matched, compare);
+	schedule_event(m, match * CYCLES_PER_MICROSECOND, compare_matched, compare);
+}
+
+// Time the compare next matches, NO_EVENT if it isn't waiting to.  Snapshots save this rather than
+// working it out again from the compare register, as a match can be due without having happened yet.
+uint64_t compare_event_time(machine_t *m, int compare) {
+	return event_time(m, compare_matched, compare);
+}
+
+void restore_compare_event(machine_t *m, int compare, uint64_t time) {
+	cancel_event(m, compare_matched, compare);
+
+	if (time != (uint64_t)NO_EVENT)
+		schedule_event(m, time, compare_matched, compare);
+}
+
+uint32_t timer_read_word(machine_t *m, uint32_t addr) {
+	assert(addr % 4 == 0);
+	m->timer_read = true;
+
+	switch (addr) {
+		case TIMER_CS:
+			return m->timer_status;
+
+		case TIMER_CLO:
+			return microseconds(m);
+
+		case TIMER_CHI:
+			return microseconds(m) >> 32;
+
+		default:
+			return m->timer_compare[(addr - TIMER_C0) / 4];
+	}
+}
+
+void timer_write_word(machine_t *m, uint32_t addr, uint32_t value) {
+	assert(addr % 4 == 0);
+
+	switch (addr) {
+		case TIMER_CS:
+			m->timer_status &= ~value;
+			break;
+
+		case TIMER_CLO:
+		case TIMER_CHI:
+			break;						// Read only
+
+		default: {
+			int compare = (addr - TIMER_C0) / 4;
+			m->timer_compare[compare] = value;
+			schedule_compare(m, compare);
+			break;
+		}
+	}
+}
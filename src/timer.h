@@ -0,0 +1,22 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <stdint.h>
+
+typedef struct machine machine_t;
+
+enum {
+	NUM_TIMER_COMPARES = 4,
+
+	// The ARM1176 runs at 700MHz and is counted as retiring an instruction every cycle
+	CYCLES_PER_MICROSECOND = 700
+};
+
+// Public functions
+extern void init_timer(machine_t *m);
+extern uint64_t compare_event_time(machine_t *m, int compare);
+extern void restore_compare_event(machine_t *m, int compare, uint64_t time);
+extern uint32_t timer_read_word(machine_t *m, uint32_t addr);
+extern void timer_write_word(machine_t *m, uint32_t addr, uint32_t value);
+
+#endif
@@ -0,0 +1,522 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Binary instruction trace.
+//
+// Each traced instruction is delta encoded straight into a chunk of a ring
+// that belongs to the machine, so machines on different threads never share
+// one.  A full chunk is handed to a thread of the writer's own, which writes
+// it to the file while the emulator fills the next.  Most instructions follow
+// the last, are already in the word cache and write one register, so they
+// take three or four bytes.  The format is described in trace.h and the file
+// is read back by piemu-trace.
+//
+///////////////////////////////////////
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "condition.h"
+#include "cpu.h"
+#include "machine.h"
+#include "trace.h"
+
+enum {
+	TRACE_CHUNK_SIZE = 64 * 1024,
+	TRACE_CHUNKS     = 64,				// A power of two so positions can be masked
+	TRACE_BUFFER_SIZE = 1024 * 1024,
+
+	ALL_TRACED_REGISTERS = (1 << TRACED_REGISTERS) - 1,
+	ALL_GENERAL_REGISTERS = (1 << TRACE_CPSR) - 1
+};
+
+static const char trace_magic[8] = "PIEMUTRC";
+
+typedef struct trace_chunk {
+	uint32_t size;
+	uint8_t data[TRACE_CHUNK_SIZE];
+} trace_chunk_t;
+
+// The last word seen at each address, kept the same way by the writer and the reader
+typedef struct trace_word {
+	uint32_t addr;
+	uint32_t instruction;
+} trace_word_t;
+
+// What the last record left the reader knowing, kept by both ends
+typedef struct trace_state {
+	uint32_t next_addr;					// Address after the last instruction
+	uint32_t registers[TRACED_REGISTERS];
+	uint32_t access_addr;
+	trace_word_t words[TRACE_WORD_CACHE_SIZE];
+} trace_state_t;
+
+struct trace_writer {
+	FILE *f;
+	pthread_t thread;
+	atomic_bool closing;
+	uint32_t first_addr;
+	uint32_t last_addr;
+
+	// Only used on the emulator's thread
+	trace_state_t state;
+	lazy_flags_t flags;					// The flags the traced CPSR was worked out from
+	uint32_t cpsr;
+	bool synced;						// The last instruction was traced
+	uint8_t *out;						// Where the next record goes in the chunk being filled
+	uint8_t *limit;						// Past the last place a record can start
+
+	// Chunks are filled at head and written out at tail.  They count up forever and are masked to index.
+	alignas(64) atomic_uint_fast64_t head;
+	alignas(64) atomic_uint_fast64_t tail;
+	trace_chunk_t chunks[TRACE_CHUNKS];
+};
+
+struct trace_reader {
+	FILE *f;
+	trace_state_t state;
+	uint64_t retired;
+	bool corrupt;						// Reading stopped part way through a record
+};
+
+static void init_trace_state(trace_state_t *state) {
+	memset(state, 0, sizeof(*state));
+
+	for (int i = 0; i < TRACE_WORD_CACHE_SIZE; i++)
+		state->words[i].addr = 1;		// Instructions are word aligned so this never matches
+}
+
+static trace_word_t *trace_word(trace_state_t *state, uint32_t addr) {
+	return &state->words[(addr >> 2) & (TRACE_WORD_CACHE_SIZE - 1)];
+}
+
+static uint32_t zigzag(uint32_t delta) {
+	return delta << 1 ^ -(delta >> 31);
+}
+
+static uint32_t unzigzag(uint32_t value) {
+	return value >> 1 ^ -(value & 1);
+}
+
+static uint8_t *put_varint(uint8_t *out, uint64_t value) {
+	while (value >= 0x80) {
+		*out++ = value | 0x80;
+		value >>= 7;
+	}
+
+	*out++ = value;
+	return out;
+}
+
+// Waits for the chunk at head to be written out if the ring is full and starts filling it
+static void begin_chunk(trace_writer_t *trace) {
+	uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+	while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_CHUNKS)
+		sched_yield();
+
+	trace->out = trace->chunks[head & (TRACE_CHUNKS - 1)].data;
+	trace->limit = trace->out + TRACE_CHUNK_SIZE - MAX_TRACE_RECORDS;
+}
+
+static void publish_chunk(trace_writer_t *trace) {
+	uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+	trace_chunk_t *chunk = &trace->chunks[head & (TRACE_CHUNKS - 1)];
+
+	chunk->size = trace->out - chunk->data;
+	atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+// Writes everything in the ring.  Returns false if it was empty.
+static bool drain(trace_writer_t *trace) {
+	uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	for (; tail != head; tail++) {
+		const trace_chunk_t *chunk = &trace->chunks[tail & (TRACE_CHUNKS - 1)];
+		fwrite(chunk->data, 1, chunk->size, trace->f);
+	}
+
+	atomic_store_explicit(&trace->tail, tail, memory_order_release);
+	return true;
+}
+
+static void *run_writer(void *arg) {
+	trace_writer_t *trace = arg;
+	const struct timespec pause = { 0, 1000000 };
+
+	while (true) {
+		// Check before draining so chunks published just before closing aren't missed
+		bool closing = atomic_load_explicit(&trace->closing, memory_order_acquire);
+
+		if (!drain(trace)) {
+			if (closing)
+				return NULL;
+
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+// Starts tracing the instructions from first_addr to last_addr into the file.  Tracing is done a step
+// at a time, so the step engine is switched to.  The block and jit engines run specialised code for a
+// block at once and skip over delay and poll loops, so have no point between instructions to record
+// from.  Returns false if the file can't be created.
+bool start_trace(machine_t *m, const char *filename, uint32_t first_addr, uint32_t last_addr) {
+	trace_writer_t *trace = calloc(1, sizeof(trace_writer_t));
+	trace_header_t header = { .version = TRACE_VERSION, .first_addr = first_addr, .last_addr = last_addr };
+
+	if (trace == NULL || (trace->f = fopen(filename, "wb")) == NULL) {
+		perror(filename);
+		free(trace);
+		return false;
+	}
+
+	memcpy(header.magic, trace_magic, sizeof(header.magic));
+	setvbuf(trace->f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+	fwrite(&header, sizeof(header), 1, trace->f);
+
+	trace->first_addr = first_addr;
+	trace->last_addr = last_addr;
+	init_trace_state(&trace->state);
+	begin_chunk(trace);
+	pthread_create(&trace->thread, NULL, run_writer, trace);
+
+	m->trace = trace;
+	m->execution_engine = ENGINE_STEP;
+	return true;
+}
+
+// Writes out what has been traced and closes the file
+void stop_trace(machine_t *m) {
+	trace_writer_t *trace = m->trace;
+
+	if (trace == NULL)
+		return;
+
+	publish_chunk(trace);
+	atomic_store_explicit(&trace->closing, true, memory_order_release);
+	pthread_join(trace->thread, NULL);
+	fclose(trace->f);
+	free(trace);
+	m->trace = NULL;
+}
+
+// Registers other than the CPSR that the instruction can write, from its type, so most instructions
+// are checked with a single compare.  Anything that can change mode and bank registers is checked in full.
+static uint32_t writable_registers(const decoded_instruction_t *decoded) {
+	switch (decoded->type) {
+		case INSTRUCTION_DATA_PROCESSING_IMMEDIATE:
+		case INSTRUCTION_DATA_PROCESSING_LSL:
+		case INSTRUCTION_LOAD_WORD:
+		case INSTRUCTION_MRS:
+			return decoded->rd == pc ? ALL_GENERAL_REGISTERS : 1u << decoded->rd;
+
+		case INSTRUCTION_STORE_WORD:
+			return 0;
+
+		case INSTRUCTION_BRANCH:
+			return 1u << lr;
+
+		default:
+			return ALL_GENERAL_REGISTERS;
+	}
+}
+
+// Gives the reader everything about to be executed at addr, as nothing before it was traced
+static void write_sync(trace_writer_t *trace, machine_t *m, uint32_t addr) {
+	trace_state_t *state = &trace->state;
+	uint8_t *out = trace->out;
+
+	memcpy(state->registers, m->registers, TRACE_CPSR * sizeof(uint32_t));
+	state->registers[TRACE_CPSR] = read_cpsr(m);
+	trace->flags = m->flags;
+	trace->cpsr = m->cpsr;
+
+	*out++ = TRACE_SYNC;
+	out = put_varint(out, m->retired);
+	out = put_varint(out, addr);
+
+	for (int reg = 0; reg < TRACED_REGISTERS; reg++)
+		out = put_varint(out, state->registers[reg]);
+
+	state->next_addr = addr;
+	trace->out = out;
+	trace->synced = true;
+}
+
+// Executes the instruction at the PC like step(), recording it if it is in the traced addresses
+void trace_step(machine_t *m) {
+	trace_writer_t *trace = m->trace;
+	trace_state_t *state = &trace->state;
+	uint32_t addr = m->registers[pc] - 8;				// 2 instruction pipeline
+	decoded_instruction_t scratch;
+	const decoded_instruction_t *decoded = fetch_decoded(m, addr, &scratch);
+
+	if (addr < trace->first_addr || addr > trace->last_addr) {
+		execute_decoded(m, decoded);
+		trace->synced = false;
+		return;
+	}
+
+	if (!trace->synced)
+		write_sync(trace, m, addr);
+
+	// The address and stored value come from the registers before the instruction changes them
+	int access = 0;
+	uint32_t access_addr = 0;
+	uint32_t access_value = 0;
+	uint32_t instruction = decoded->instruction;
+	uint32_t writable = writable_registers(decoded);
+	int rd = decoded->rd;
+
+	if ((decoded->type == INSTRUCTION_LOAD_WORD || decoded->type == INSTRUCTION_STORE_WORD) &&
+		(decoded->cond == COND_AL || condition_passed(m, decoded->cond))) {
+		access = decoded->type == INSTRUCTION_LOAD_WORD ? TRACE_LOAD : TRACE_STORE;
+		access_addr = m->registers[decoded->rn] + decoded->immediate;
+		access_value = m->registers[rd];
+	}
+
+	execute_decoded(m, decoded);
+
+	// A load to the PC branches, which leaves the PC ahead for the pipeline
+	if (access == TRACE_LOAD)
+		access_value = rd == pc ? m->registers[pc] - 8 : m->registers[rd];
+
+	// Bytes are only stored once everything has been read, as they could alias anything
+	trace_word_t *word = trace_word(state, addr);
+	bool sequential = addr == state->next_addr;
+	bool known = word->addr == addr && word->instruction == instruction;
+	uint32_t written = 0;
+
+	for (uint32_t registers = writable; registers != 0; registers &= registers - 1) {
+		int reg = __builtin_ctz(registers);
+		written |= (uint32_t)(m->registers[reg] != state->registers[reg]) << reg;
+	}
+
+	// The CPSR is only worked out when the lazy flags behind it have changed
+	if (memcmp(&m->flags, &trace->flags, sizeof(lazy_flags_t)) != 0 || m->cpsr != trace->cpsr) {
+		uint32_t cpsr = read_cpsr(m);
+
+		trace->flags = m->flags;
+		trace->cpsr = m->cpsr;
+		written |= (uint32_t)(cpsr != state->registers[TRACE_CPSR]) << TRACE_CPSR;
+	}
+
+	uint8_t *out = trace->out + 1;
+	int tag = sequential * TRACE_SEQUENTIAL | known * TRACE_WORD_KNOWN | (written != 0) * TRACE_REGISTERS | access;
+
+	if (!sequential)
+		out = put_varint(out, zigzag((int32_t)(addr - state->next_addr) >> 2));
+
+	if (!known) {
+		for (int i = 0; i < 4; i++)
+			*out++ = instruction >> (i * 8);
+
+		word->addr = addr;
+		word->instruction = instruction;
+	}
+
+	if (written != 0) {
+		out = put_varint(out, written);
+
+		for (uint32_t registers = written; registers != 0; registers &= registers - 1) {
+			int reg = __builtin_ctz(registers);
+			uint32_t value = reg == TRACE_CPSR ? read_cpsr(m) : m->registers[reg];
+
+			out = put_varint(out, zigzag(value - state->registers[reg]));
+			state->registers[reg] = value;
+		}
+	}
+
+	if (access != 0) {
+		out = put_varint(out, zigzag(access_addr - state->access_addr));
+		out = put_varint(out, access_value);
+		state->access_addr = access_addr;
+	}
+
+	*trace->out = tag;
+	state->next_addr = addr + 4;
+	trace->out = out;
+
+	if (out > trace->limit) {
+		publish_chunk(trace);
+		begin_chunk(trace);
+	}
+}
+
+// The machine state has been replaced, by a checkpoint or snapshot, so the next instruction traced
+// starts with a sync rather than following on from the last
+void resync_trace(machine_t *m) {
+	if (m->trace != NULL)
+		m->trace->synced = false;
+}
+
+// Opens a trace written by start_trace and reads its header.  Returns NULL if it isn't one.
+trace_reader_t *open_trace(const char *filename, trace_header_t *header) {
+	trace_reader_t *reader = calloc(1, sizeof(trace_reader_t));
+
+	if (reader == NULL || (reader->f = fopen(filename, "rb")) == NULL) {
+		perror(filename);
+		free(reader);
+		return NULL;
+	}
+
+	if (fread(header, sizeof(*header), 1, reader->f) != 1 || memcmp(header->magic, trace_magic, sizeof(header->magic)) != 0 ||
+		header->version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace this version of piemu can read\n", filename);
+		close_trace(reader);
+		return NULL;
+	}
+
+	setvbuf(reader->f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+	init_trace_state(&reader->state);
+	return reader;
+}
+
+// True if reading stopped before the end of the trace
+bool trace_corrupt(const trace_reader_t *reader) {
+	return reader->corrupt;
+}
+
+void close_trace(trace_reader_t *reader) {
+	fclose(reader->f);
+	free(reader);
+}
+
+static bool get_varint(FILE *f, uint64_t *value) {
+	*value = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = getc_unlocked(f);
+
+		if (byte == EOF)
+			return false;
+
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static bool get_word(FILE *f, uint32_t *word) {
+	uint64_t value;
+	bool ok = get_varint(f, &value) && value <= UINT32_MAX;
+
+	*word = value;
+	return ok;
+}
+
+static bool read_sync(trace_reader_t *reader, trace_record_t *record) {
+	trace_state_t *state = &reader->state;
+
+	if (!get_varint(reader->f, &reader->retired) || !get_word(reader->f, &state->next_addr))
+		return false;
+
+	for (int reg = 0; reg < TRACED_REGISTERS; reg++)
+		if (!get_word(reader->f, &state->registers[reg]))
+			return false;
+
+	record->sync = true;
+	record->retired = reader->retired;
+	record->addr = state->next_addr;
+	record->written = ALL_TRACED_REGISTERS;
+	return true;
+}
+
+static bool read_instruction(trace_reader_t *reader, int tag, trace_record_t *record) {
+	trace_state_t *state = &reader->state;
+	uint32_t value;
+
+	record->sync = false;
+	record->retired = reader->retired++;
+	record->addr = state->next_addr;
+
+	if ((tag & TRACE_SEQUENTIAL) == 0) {
+		if (!get_word(reader->f, &value))
+			return false;
+
+		record->addr += (int32_t)unzigzag(value) * 4;
+	}
+
+	trace_word_t *word = trace_word(state, record->addr);
+
+	if (tag & TRACE_WORD_KNOWN)
+		record->instruction = word->instruction;
+	else {
+		uint8_t bytes[4];
+
+		if (fread(bytes, 1, 4, reader->f) != 4)
+			return false;
+
+		record->instruction = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+		word->addr = record->addr;
+		word->instruction = record->instruction;
+	}
+
+	record->written = 0;
+
+	if ((tag & TRACE_REGISTERS) && (!get_word(reader->f, &record->written) || record->written > ALL_TRACED_REGISTERS))
+		return false;
+
+	for (int reg = 0; reg < TRACED_REGISTERS; reg++) {
+		if (record->written >> reg & 1) {
+			if (!get_word(reader->f, &value))
+				return false;
+
+			state->registers[reg] += unzigzag(value);
+		}
+	}
+
+	record->access = tag & (TRACE_LOAD | TRACE_STORE);
+
+	if (record->access != 0) {
+		if (record->access == (TRACE_LOAD | TRACE_STORE) || !get_word(reader->f, &value) || !get_word(reader->f, &record->access_value))
+			return false;
+
+		state->access_addr += unzigzag(value);
+		record->access_addr = state->access_addr;
+	}
+
+	state->next_addr = record->addr + 4;
+	return true;
+}
+
+// Reads the next record.  Returns false at the end of the trace, or after saying so if it is cut short.
+bool read_trace_record(trace_reader_t *reader, trace_record_t *record) {
+	int tag = getc_unlocked(reader->f);
+
+	if (tag == EOF)
+		return false;
+
+	bool read;
+
+	if (tag == TRACE_SYNC)
+		read = read_sync(reader, record);
+	else if ((tag & ~(TRACE_SEQUENTIAL | TRACE_WORD_KNOWN | TRACE_REGISTERS | TRACE_LOAD | TRACE_STORE)) == 0)
+		read = read_instruction(reader, tag, record);
+	else
+		read = false;
+
+	if (!read) {
+		reader->corrupt = true;
+		fprintf(stderr, "Trace is cut short or corrupt after instruction %llu\n", (unsigned long long)reader->retired);
+		return false;
+	}
+
+	memcpy(record->registers, reader->state.registers, sizeof(record->registers));
+	return true;
+}
@@ -0,0 +1,72 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct machine machine_t;
+typedef struct trace_writer trace_writer_t;
+
+// A trace file is a trace_header_t followed by records.  Numbers in records are LEB128 varints and
+// deltas are zigzag encoded first.  Every record starts with a tag byte.
+//
+// A sync record gives the retired count, the address of the next instruction and every traced register.
+// One starts the trace and another follows every gap left by the address filter.
+//
+// Any other tag is an instruction, the one after the last.  It is followed by:
+//   - unless TRACE_SEQUENTIAL, the delta in words of its address from the word after the last
+//   - unless TRACE_WORD_KNOWN, the instruction word as 4 little endian bytes.  The word is known when it is
+//     in the trace word cache, which both ends keep by address in the same way.
+//   - with TRACE_REGISTERS, a mask of the registers written then the delta of each from its old value
+//   - with TRACE_LOAD or TRACE_STORE, the delta of the address from the last access, then the value
+enum {
+	TRACE_VERSION = 1,
+
+	TRACE_SEQUENTIAL = 1,
+	TRACE_WORD_KNOWN = 2,
+	TRACE_REGISTERS  = 4,
+	TRACE_LOAD       = 8,
+	TRACE_STORE      = 16,
+	TRACE_SYNC       = 128,
+
+	TRACED_REGISTERS = 16,				// r0 to r14 then the CPSR.  The PC is given by the addresses.
+	TRACE_CPSR       = 15,
+	TRACE_WORD_CACHE_SIZE = 4096,		// Direct mapped on the word address
+	MAX_TRACE_RECORDS = 256				// Bytes a sync and the instruction after it can take
+};
+
+typedef struct trace_header {
+	char magic[8];						// PIEMUTRC
+	uint32_t version;
+	uint32_t first_addr;				// Instructions traced, from the address filter
+	uint32_t last_addr;
+} trace_header_t;
+
+// An instruction or sync record read back
+typedef struct trace_record {
+	bool sync;
+	uint64_t retired;					// Instructions retired before this one
+	uint32_t addr;
+	uint32_t instruction;				// Not set for a sync
+	uint32_t written;					// Mask of registers written, every one for a sync
+	uint32_t registers[TRACED_REGISTERS];	// Values after the instruction
+	int access;							// TRACE_LOAD, TRACE_STORE or 0
+	uint32_t access_addr;
+	uint32_t access_value;
+} trace_record_t;
+
+typedef struct trace_reader trace_reader_t;
+
+// Public functions
+extern bool start_trace(machine_t *m, const char *filename, uint32_t first_addr, uint32_t last_addr);
+extern void stop_trace(machine_t *m);
+extern void trace_step(machine_t *m);
+extern void resync_trace(machine_t *m);
+
+extern trace_reader_t *open_trace(const char *filename, trace_header_t *header);
+extern bool read_trace_record(trace_reader_t *reader, trace_record_t *record);
+extern bool trace_corrupt(const trace_reader_t *reader);
+extern void close_trace(trace_reader_t *reader);
+
+#endif
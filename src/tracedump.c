@@ -0,0 +1,81 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Prints a trace written by piemu -T.
+//
+// Each instruction is printed on a line of its own with the count of
+// instructions retired before it, its disassembly, the registers it wrote
+// and the word it loaded or stored.  A line starting with -- marks where the
+// trace starts and each place the address filter left a gap.
+//
+///////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "disassemble.h"
+#include "trace.h"
+
+static void usage() {
+	fprintf(stderr, "usage: piemu-trace trace\n");
+}
+
+static void print_register(int reg, uint32_t value) {
+	printf(" %s=%08x", reg == TRACE_CPSR ? "cpsr" : register_names[reg], value);
+}
+
+static void print_record(const trace_record_t *record) {
+	char disassembly[DISASSEMBLY_LENGTH];
+
+	if (record->sync) {
+		printf("-- %llu instructions retired\n", (unsigned long long)record->retired);
+		printf("%*s", 12, "");
+
+		for (int reg = 0; reg < TRACED_REGISTERS; reg++)
+			print_register(reg, record->registers[reg]);
+
+		printf("\n");
+		return;
+	}
+
+	printf("%12llu  %-48s", (unsigned long long)record->retired, disassemble_instruction(record->addr, record->instruction, disassembly));
+
+	for (int reg = 0; reg < TRACED_REGISTERS; reg++)
+		if (record->written >> reg & 1)
+			print_register(reg, record->registers[reg]);
+
+	if (record->access == TRACE_LOAD)
+		printf(" [%08x] -> %08x", record->access_addr, record->access_value);
+	else if (record->access == TRACE_STORE)
+		printf(" [%08x] <- %08x", record->access_addr, record->access_value);
+
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	trace_header_t header;
+	trace_record_t record;
+
+	if (argc != 2) {
+		usage();
+		return 1;
+	}
+
+	trace_reader_t *reader = open_trace(argv[1], &header);
+
+	if (reader == NULL)
+		return 2;
+
+	printf("-- instructions from 0x%08x to 0x%08x\n", header.first_addr, header.last_addr);
+
+	while (read_trace_record(reader, &record))
+		print_record(&record);
+
+	bool corrupt = trace_corrupt(reader);
+
+	close_trace(reader);
+	return corrupt ? 1 : 0;
+}
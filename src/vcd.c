@@ -0,0 +1,166 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Value Change Dump of the GPIO pins, for viewing in GTKWave.
+//
+// The emulator only puts each change into a single producer, single consumer
+// ring.  A thread of the writer's own takes them out and formats the file,
+// so toggling a pin costs a few stores rather than a call into stdio.  If
+// the ring fills the emulator waits for the writer rather than lose changes.
+//
+///////////////////////////////////////
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "timer.h"
+#include "vcd.h"
+
+enum { VCD_BUFFER_SIZE = 1024 * 1024 };
+
+typedef struct pin_change {
+	uint64_t time;					// Cycles of the virtual clock
+	uint8_t pin;
+	bool level;
+} pin_change_t;
+
+struct vcd_writer {
+	FILE *f;
+	int num_pins;
+	pthread_t thread;
+	atomic_bool closing;
+	uint64_t last_time;				// Last time written, only used by the writer thread
+
+	// Changes are put in at head and taken out at tail.  They count up forever and are masked to index.
+	alignas(64) atomic_uint_fast64_t head;
+	alignas(64) atomic_uint_fast64_t tail;
+	pin_change_t changes[VCD_RING_SIZE];
+};
+
+// Identifier codes are printable characters from !
+static char pin_code(int pin) {
+	return '!' + pin;
+}
+
+static void write_header(vcd_writer_t *vcd) {
+	time_t now = time(NULL);
+
+	fprintf(vcd->f, "$date %.24s $end\n", ctime(&now));
+	fprintf(vcd->f, "$version piemu $end\n");
+	fprintf(vcd->f, "$timescale 1 ns $end\n");
+	fprintf(vcd->f, "$scope module gpio $end\n");
+
+	for (int pin = 0; pin < vcd->num_pins; pin++)
+		fprintf(vcd->f, "$var wire 1 %c gpio%d $end\n", pin_code(pin), pin);
+
+	fprintf(vcd->f, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+
+	for (int pin = 0; pin < vcd->num_pins; pin++)
+		fprintf(vcd->f, "0%c\n", pin_code(pin));
+
+	fprintf(vcd->f, "$end\n");
+}
+
+// Formatted by hand as there can be tens of millions of changes a second
+static void write_change(vcd_writer_t *vcd, const pin_change_t *change) {
+	uint64_t ns = change->time * 1000 / CYCLES_PER_MICROSECOND;
+	char line[32];
+	char *p = line + sizeof(line);
+
+	*--p = '\n';
+	*--p = pin_code(change->pin);
+	*--p = '0' + change->level;
+
+	if (ns != vcd->last_time) {
+		*--p = '\n';
+
+		do {
+			*--p = '0' + ns % 10;
+			ns /= 10;
+		} while (ns != 0);
+
+		*--p = '#';
+		vcd->last_time = change->time * 1000 / CYCLES_PER_MICROSECOND;
+	}
+
+	fwrite(p, 1, line + sizeof(line) - p, vcd->f);
+}
+
+// Writes everything in the ring.  Returns false if it was empty.
+static bool drain(vcd_writer_t *vcd) {
+	uint64_t tail = atomic_load_explicit(&vcd->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&vcd->head, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	for (; tail != head; tail++)
+		write_change(vcd, &vcd->changes[tail & (VCD_RING_SIZE - 1)]);
+
+	atomic_store_explicit(&vcd->tail, tail, memory_order_release);
+	return true;
+}
+
+static void *run_writer(void *arg) {
+	vcd_writer_t *vcd = arg;
+	const struct timespec pause = { 0, 1000000 };
+
+	while (true) {
+		// Check before draining so changes made just before closing aren't missed
+		bool closing = atomic_load_explicit(&vcd->closing, memory_order_acquire);
+
+		if (!drain(vcd)) {
+			if (closing)
+				return NULL;
+
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+// Creates the file, writes its header and starts the thread that writes the changes.  Returns NULL
+// if the file can't be created.
+vcd_writer_t *open_vcd(const char *filename, int num_pins) {
+	vcd_writer_t *vcd = calloc(1, sizeof(vcd_writer_t));
+
+	if (vcd == NULL || (vcd->f = fopen(filename, "w")) == NULL) {
+		perror(filename);
+		free(vcd);
+		return NULL;
+	}
+
+	vcd->num_pins = num_pins;
+	setvbuf(vcd->f, NULL, _IOFBF, VCD_BUFFER_SIZE);
+	write_header(vcd);
+	pthread_create(&vcd->thread, NULL, run_writer, vcd);
+	return vcd;
+}
+
+// Writes any changes still in the ring and closes the file
+void close_vcd(vcd_writer_t *vcd) {
+	atomic_store_explicit(&vcd->closing, true, memory_order_release);
+	pthread_join(vcd->thread, NULL);
+	fclose(vcd->f);
+	free(vcd);
+}
+
+// Called on the emulator's thread
+void record_pin_change(vcd_writer_t *vcd, uint64_t time, int pin, bool level) {
+	uint64_t head = atomic_load_explicit(&vcd->head, memory_order_relaxed);
+
+	while (head - atomic_load_explicit(&vcd->tail, memory_order_acquire) == VCD_RING_SIZE)
+		sched_yield();
+
+	pin_change_t *change = &vcd->changes[head & (VCD_RING_SIZE - 1)];
+	change->time = time;
+	change->pin = pin;
+	change->level = level;
+	atomic_store_explicit(&vcd->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,17 @@
+#ifndef __VCD_H
+#define __VCD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pin changes waiting to be written.  A power of two so positions can be masked.
+enum { VCD_RING_SIZE = 64 * 1024 };
+
+typedef struct vcd_writer vcd_writer_t;
+
+// Public functions
+extern vcd_writer_t *open_vcd(const char *filename, int num_pins);
+extern void close_vcd(vcd_writer_t *vcd);
+extern void record_pin_change(vcd_writer_t *vcd, uint64_t time, int pin, bool level);
+
+#endif
@@ -0,0 +1,198 @@
+///////////////////////////////////////
+//
+// Raspberry Pi Emulator for Model B+
+//
+// (c) Mark Jackson	2019
+//
+// Generates the instruction decode table from instructions.spec.
+//
+// usage: gendecode instructions.spec decode_table.h decode_table.c
+//
+// The header gets an instruction_class_t with a CLASS_ for each class in
+// the order they first appear, after CLASS_UNDEFINED.  The source gets the
+// table of 4096 classes, indexed by bits 27:20 and 7:4 of the instruction.
+//
+///////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	TABLE_SIZE = 4096,
+	MAX_CLASSES = 256,				// The table holds a byte per entry
+	MAX_PATTERNS = 1024,
+	MAX_NAME_LENGTH = 64,
+	MAX_LINE_LENGTH = 256
+};
+
+// Bits 27:20 and 7:4 an index must have to match
+typedef struct pattern {
+	int class;
+	unsigned mask;
+	unsigned bits;
+} pattern_t;
+
+static char class_names[MAX_CLASSES][MAX_NAME_LENGTH] = { "UNDEFINED" };
+static int num_classes = 1;
+static pattern_t patterns[MAX_PATTERNS];
+static int num_patterns = 0;
+
+static int find_class(const char *name) {
+	for (int class = 0; class < num_classes; class++)
+		if (strcmp(class_names[class], name) == 0)
+			return class;
+
+	if (num_classes == MAX_CLASSES)
+		return -1;
+
+	strcpy(class_names[num_classes], name);
+	return num_classes++;
+}
+
+// Adds the field of the pattern, most significant bit first.  Returns false if it isn't length bits of 0, 1 or x.
+static bool parse_field(const char *field, int length, pattern_t *pattern) {
+	if ((int)strlen(field) != length)
+		return false;
+
+	for (int i = 0; i < length; i++) {
+		pattern->mask <<= 1;
+		pattern->bits <<= 1;
+
+		if (field[i] == '0' || field[i] == '1') {
+			pattern->mask |= 1;
+			pattern->bits |= field[i] - '0';
+		} else if (field[i] != 'x')
+			return false;
+	}
+
+	return true;
+}
+
+static bool valid_name(const char *name) {
+	return strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") == strlen(name) && strlen(name) < MAX_NAME_LENGTH;
+}
+
+static bool read_spec(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	char line[MAX_LINE_LENGTH];
+
+	if (f == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	for (int line_number = 1; fgets(line, sizeof(line), f) != NULL; line_number++) {
+		char name[MAX_LINE_LENGTH], high[MAX_LINE_LENGTH], low[MAX_LINE_LENGTH];
+		char *text = line + strspn(line, " \t\r\n");
+
+		if (*text == '\0' || *text == '#')
+			continue;
+
+		if (sscanf(text, "%255s %255s %255s", name, high, low) != 3 || !valid_name(name)) {
+			fprintf(stderr, "%s:%d: expected a class and the patterns of bits 27:20 and 7:4\n", filename, line_number);
+			fclose(f);
+			return false;
+		}
+
+		int class = find_class(name);
+
+		if (class < 0) {
+			fprintf(stderr, "%s:%d: more than %d classes\n", filename, line_number, MAX_CLASSES);
+			fclose(f);
+			return false;
+		}
+
+		// A class outside the table
+		if (strcmp(high, "-") == 0 && strcmp(low, "-") == 0)
+			continue;
+
+		pattern_t pattern = { class, 0, 0 };
+
+		if (!parse_field(high, 8, &pattern) || !parse_field(low, 4, &pattern) || num_patterns == MAX_PATTERNS) {
+			fprintf(stderr, "%s:%d: bad pattern %s %s\n", filename, line_number, high, low);
+			fclose(f);
+			return false;
+		}
+
+		patterns[num_patterns++] = pattern;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static bool write_header(const char *filename, const char *spec) {
+	FILE *f = fopen(filename, "w");
+
+	if (f == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	fprintf(f, "// Generated from %s by gendecode.  Don't edit.\n\n", spec);
+	fprintf(f, "#ifndef __DECODE_TABLE_H\n#define __DECODE_TABLE_H\n\n#include <stdint.h>\n\n");
+	fprintf(f, "typedef enum {\n");
+
+	for (int class = 0; class < num_classes; class++)
+		fprintf(f, "\tCLASS_%s,\n", class_names[class]);
+
+	fprintf(f, "\tNUM_CLASSES\n} instruction_class_t;\n\n");
+	fprintf(f, "enum { DECODE_TABLE_SIZE = %d };\n\n", TABLE_SIZE);
+	fprintf(f, "extern const uint8_t decode_table[DECODE_TABLE_SIZE];\n");
+	fprintf(f, "extern const char *const instruction_class_names[NUM_CLASSES];\n\n#endif\n");
+
+	return fclose(f) == 0;
+}
+
+static bool write_table(const char *filename, const char *spec) {
+	FILE *f = fopen(filename, "w");
+
+	if (f == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	fprintf(f, "// Generated from %s by gendecode.  Don't edit.\n\n#include \"decode_table.h\"\n\n", spec);
+	fprintf(f, "const char *const instruction_class_names[NUM_CLASSES] = {\n");
+
+	for (int class = 0; class < num_classes; class++)
+		fprintf(f, "\t\"%s\",\n", class_names[class]);
+
+	fprintf(f, "};\n\n// Indexed by bits 27:20 and 7:4 of the instruction\nconst uint8_t decode_table[DECODE_TABLE_SIZE] = {");
+
+	for (unsigned index = 0; index < TABLE_SIZE; index++) {
+		int class = 0;
+
+		for (int i = 0; i < num_patterns; i++) {
+			if ((index & patterns[i].mask) == patterns[i].bits) {
+				class = patterns[i].class;
+				break;
+			}
+		}
+
+		if (index % 16 == 0)
+			fprintf(f, "\n\t/* %03x */", index);
+
+		fprintf(f, " %d,", class);
+	}
+
+	fprintf(f, "\n};\n");
+	return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: gendecode instructions.spec decode_table.h decode_table.c\n");
+		return 1;
+	}
+
+	if (!read_spec(argv[1]) || !write_header(argv[2], argv[1]) || !write_table(argv[3], argv[1])) {
+		remove(argv[2]);
+		remove(argv[3]);
+		return 1;
+	}
+
+	return 0;
+}